@@ -0,0 +1,183 @@
+#include "corpus.h"
+#include <benchmark/benchmark.h>
+
+// Throughput benchmarks for the ingest hot paths, run with `meson test --benchmark` or the bench binary directly
+
+namespace {
+	const std::vector<std::size_t> corpus_sizes = { 0, 5000, 50000 }; // 0 is the checked in corpus as it is
+	const std::size_t chunk_size = 256 * 1024; // Block size of the multi-block xz corpora and frame size of the multi-frame zstd ones
+
+	// Every benchmark reports both MB/s and stanzas/s against the uncompressed corpus
+	void report(benchmark::State &state, std::size_t bytes, std::size_t stanzas) {
+		state.SetBytesProcessed(static_cast<std::int64_t>(state.iterations() * bytes));
+		state.counters["stanzas/s"] = benchmark::Counter(static_cast<double>(state.iterations() * stanzas), benchmark::Counter::kIsRate);
+	}
+
+	struct corpus {
+		std::string name;
+		std::string content;
+		std::size_t stanzas;
+	};
+
+	using decompressor = void (*)(const std::string, const std::string, const std::string);
+
+	// A decoder that's fast but wrong shouldn't get a number, so every archive is decoded once and compared first
+	// Archives a decompressor refuses outright are left to the benchmark, which reports them as skipped
+	bool round_trip(const std::string &name, decompressor function, const std::string &archive_path, const std::string &cache_path, std::string_view expected) {
+		try {
+			function("bench", archive_path, cache_path);
+		} catch (std::exception &exc) {
+			std::cerr << "round trip " << name << " skipped: " << exc.what() << std::endl;
+			return true;
+		}
+
+		if (bench::read_file(cache_path) != expected) {
+			std::cerr << "round trip " << name << " failed: output differs from the corpus" << std::endl;
+			return false;
+		}
+
+		return true;
+	}
+}
+
+int main(int argc, char **argv) {
+	benchmark::Initialize(&argc, argv);
+	if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+		return 1;
+	}
+
+	// The parallel xz and zstd paths need more than one worker, which a single core machine wouldn't lease out
+	setenv("CPU_WORKERS", std::to_string(std::max(2u, std::thread::hardware_concurrency())).c_str(), 0);
+	canister::config::load();
+
+	auto real = bench::read_file(std::string(BENCH_CORPUS) + "/real.Packages");
+	auto scratch = std::filesystem::temp_directory_path() / ("canister-bench-" + std::to_string(getpid()));
+	std::filesystem::create_directories(scratch);
+
+	std::vector<corpus> corpora;
+	for (auto size : corpus_sizes) {
+		auto content = size == 0 ? real : bench::grow_corpus(real, size, size);
+		auto stanzas = bench::split_stanzas(content).size();
+		corpora.push_back({ size == 0 ? "small" : std::to_string(size), std::move(content), stanzas });
+	}
+
+	// Benchmarks hold references into corpora, so it isn't touched again until they have all run
+	bool intact = true;
+	for (auto &data : corpora) {
+		benchmark::RegisterBenchmark(("parse_packages/" + data.name).c_str(), [&data](benchmark::State &state) {
+			for (auto _ : state) {
+				auto info = canister::parser::parse_packages("bench", data.content);
+				benchmark::DoNotOptimize(info.data.data());
+			}
+
+			report(state, data.content.size(), data.stanzas);
+		})->Unit(benchmark::kMillisecond)->UseRealTime();
+
+		std::vector<std::tuple<std::string, std::string, decompressor>> formats = {
+			{ "gz", bench::gzip(data.content), canister::decompress::gz },
+			{ "xz", bench::lzma_encode(data.content, true), canister::decompress::xz },
+			{ "xz-blocks", bench::lzma_encode(data.content, true, chunk_size), canister::decompress::xz },
+			{ "lzma", bench::lzma_encode(data.content, false), canister::decompress::lzma },
+			{ "bz2", bench::bzip2(data.content), canister::decompress::bz2 },
+			{ "zst", bench::zstd(data.content), canister::decompress::zstd },
+			{ "zst-frames", bench::zstd(data.content, chunk_size), canister::decompress::zstd },
+		};
+
+		for (auto &[extension, archive, function] : formats) {
+			auto archive_path = (scratch / (data.name + ".Packages." + extension)).string();
+			auto cache_path = (scratch / (data.name + "." + extension + ".Packages")).string();
+			bench::write_file(archive_path, archive);
+			intact = round_trip(extension + "/" + data.name, function, archive_path, cache_path, data.content) && intact;
+
+			// A damaged frame has to fail the whole archive instead of leaving a hole in the mapped output
+			if (extension == "zst-frames" && data.content.size() > chunk_size) {
+				auto damaged = archive;
+				damaged[damaged.size() - 1] ^= 0xff;
+
+				auto damaged_path = (scratch / (data.name + ".damaged.Packages.zst")).string();
+				bench::write_file(damaged_path, damaged);
+
+				try {
+					canister::decompress::zstd("bench", damaged_path, cache_path);
+					std::cerr << "round trip zst-frames/" << data.name << " failed: a damaged frame decoded without an error" << std::endl;
+					intact = false;
+				} catch (std::exception &) {
+				}
+			}
+
+			benchmark::RegisterBenchmark(("decompress/" + extension + "/" + data.name).c_str(), [&data, archive_path, cache_path, function](benchmark::State &state) {
+				// Some decompressors refuse archives past their size cap, that shows up as a skipped run instead of aborting the rest
+				for (auto _ : state) {
+					try {
+						function("bench", archive_path, cache_path);
+					} catch (std::exception &exc) {
+						state.SkipWithError(exc.what());
+						break;
+					}
+				}
+
+				report(state, data.content.size(), data.stanzas);
+			})->Unit(benchmark::kMillisecond)->UseRealTime();
+		}
+
+		benchmark::RegisterBenchmark(("matched_hash/" + data.name).c_str(), [&data](benchmark::State &state) {
+			auto copy = data.content;
+			for (auto _ : state) {
+				benchmark::DoNotOptimize(canister::util::matched_hash(data.content, copy));
+			}
+
+			report(state, data.content.size() * 2, data.stanzas);
+		});
+	}
+
+	// A single stanza through the key/value parser, without the splitting and threading parse_packages adds
+	auto stanzas = bench::split_stanzas(real);
+	benchmark::RegisterBenchmark("parse_apt_kv", [&stanzas](benchmark::State &state) {
+		std::size_t bytes = 0;
+		for (auto &stanza : stanzas) {
+			bytes += stanza.size();
+		}
+
+		std::array<std::byte, 64 * 1024> buffer;
+		for (auto _ : state) {
+			for (auto &stanza : stanzas) {
+				std::pmr::monotonic_buffer_resource arena(buffer.data(), buffer.size());
+				auto kv_map = canister::parser::parse_apt_kv(stanza, canister::util::packages_keys(), &arena);
+				benchmark::DoNotOptimize(kv_map.size());
+			}
+		}
+
+		report(state, bytes, stanzas.size());
+	});
+
+	// Pairs cover epochs, tildes, revisions and long numeric runs, which is where compare spends its time
+	std::vector<std::pair<std::string, std::string>> versions = {
+		{ "1.4.2-1", "1.4.2-2" },
+		{ "1:5.0-3", "5.0-3" },
+		{ "3.2~beta4", "3.2" },
+		{ "0.9.12+git20231101.a1b2c3d", "0.9.12+git20231102.a1b2c3d" },
+		{ "2023.11.04", "2023.11.4" },
+		{ "5.2.15-2", "5.2.15-10" },
+	};
+
+	benchmark::RegisterBenchmark("dpkg_compare", [&versions](benchmark::State &state) {
+		for (auto _ : state) {
+			for (auto &[left, right] : versions) {
+				benchmark::DoNotOptimize(canister::dpkg::compare(left, right));
+			}
+		}
+
+		state.SetItemsProcessed(static_cast<std::int64_t>(state.iterations() * versions.size()));
+	});
+
+	if (!intact) {
+		std::filesystem::remove_all(scratch);
+		return 1;
+	}
+
+	benchmark::RunSpecifiedBenchmarks();
+	benchmark::Shutdown();
+
+	std::filesystem::remove_all(scratch);
+	return 0;
+}
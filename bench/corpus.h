@@ -0,0 +1,197 @@
+#pragma once
+#include <canister.h>
+#include <random>
+
+// Shared by the benchmarks and the refresh harness
+// Bigger corpora are grown out of the checked in real-shaped one so the repository doesn't carry megabytes of fixtures
+
+#ifndef BENCH_CORPUS
+	#define BENCH_CORPUS "bench/corpus"
+#endif
+
+namespace bench {
+	inline std::string read_file(const std::string &path) {
+		std::ifstream file(path, std::ios::binary);
+		if (!file.is_open()) {
+			throw std::runtime_error("bench: missing corpus file " + path);
+		}
+
+		std::ostringstream stream;
+		stream << file.rdbuf();
+		return stream.str();
+	}
+
+	inline std::vector<std::string_view> split_stanzas(std::string_view content) {
+		std::vector<std::string_view> stanzas;
+		size_t start, end = 0;
+
+		while ((start = content.find_first_not_of('\n', end)) != std::string_view::npos) {
+			end = content.find("\n\n", start);
+			stanzas.push_back(content.substr(start, end - start));
+		}
+
+		return stanzas;
+	}
+
+	// Stanzas are cycled out of the real-shaped corpus with their identity rewritten, so keys, value lengths and
+	// line structure stay realistic while every package is unique
+	// A paid rate replaces the commercial tags of the corpus with ones handed out at that rate instead
+	inline std::string grow_corpus(std::string_view real, std::size_t count, std::uint64_t seed, double paid_rate = -1) {
+		auto templates = split_stanzas(real);
+		std::mt19937_64 random(seed);
+		std::bernoulli_distribution paid(std::max(0.0, paid_rate));
+		std::string output;
+		output.reserve(count * (real.size() / templates.size() + 64));
+
+		for (std::size_t index = 0; index < count; index++) {
+			auto stanza = templates[index % templates.size()];
+			size_t position = 0;
+
+			while (position < stanza.size()) {
+				auto end = std::min(stanza.find('\n', position), stanza.size());
+				auto line = stanza.substr(position, end - position);
+				position = end + 1;
+
+				if (line.starts_with("Package: ")) {
+					output.append(line).append(".").append(std::to_string(index));
+				} else if (line.starts_with("Version: ")) {
+					output.append("Version: ").append(std::to_string(random() % 20)).append(".").append(std::to_string(random() % 100)).append("-").append(std::to_string(random() % 5));
+				} else if (line.starts_with("SHA256: ")) {
+					canister::hash::digest digest;
+					for (auto &byte : digest) {
+						byte = static_cast<std::uint8_t>(random());
+					}
+
+					output.append("SHA256: ").append(canister::hash::to_hex(digest));
+				} else if (line.starts_with("Tag: ") && paid_rate >= 0) {
+					continue;
+				} else {
+					output.append(line);
+				}
+
+				output.push_back('\n');
+			}
+
+			if (paid_rate >= 0 && paid(random)) {
+				output.append("Tag: cydia::commercial\n");
+			}
+
+			output.push_back('\n');
+		}
+
+		return output;
+	}
+
+	inline std::string gzip(std::string_view data) {
+		z_stream stream {};
+		if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			throw std::runtime_error("bench: failed to initialize deflate");
+		}
+
+		std::string output(deflateBound(&stream, data.size()), '\0');
+		stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+		stream.avail_in = static_cast<uInt>(data.size());
+		stream.next_out = reinterpret_cast<Bytef *>(output.data());
+		stream.avail_out = static_cast<uInt>(output.size());
+
+		deflate(&stream, Z_FINISH);
+		output.resize(stream.total_out);
+		deflateEnd(&stream);
+		return output;
+	}
+
+	// A block size splits the xz stream into blocks with their sizes in the index, the way `xz -T` writes it
+	inline std::string lzma_encode(std::string_view data, bool container, std::uint64_t block_size = 0) {
+		lzma_stream stream = LZMA_STREAM_INIT;
+		lzma_ret status;
+
+		if (container && block_size > 0) {
+			lzma_mt options {};
+			options.threads = std::max(1u, std::thread::hardware_concurrency());
+			options.block_size = block_size;
+			options.preset = 6;
+			options.check = LZMA_CHECK_CRC64;
+			status = lzma_stream_encoder_mt(&stream, &options);
+		} else if (container) {
+			status = lzma_easy_encoder(&stream, 6, LZMA_CHECK_CRC64);
+		} else {
+			lzma_options_lzma options;
+			lzma_lzma_preset(&options, 6);
+			status = lzma_alone_encoder(&stream, &options);
+		}
+
+		if (status != LZMA_OK) {
+			throw std::runtime_error("bench: failed to initialize lzma");
+		}
+
+		std::string output(lzma_stream_buffer_bound(data.size()), '\0');
+		stream.next_in = reinterpret_cast<const std::uint8_t *>(data.data());
+		stream.avail_in = data.size();
+		stream.next_out = reinterpret_cast<std::uint8_t *>(output.data());
+		stream.avail_out = output.size();
+
+		// Every block carries its own headers, so a lot of small ones can outgrow the single block bound
+		while ((status = lzma_code(&stream, LZMA_FINISH)) == LZMA_OK && stream.avail_out == 0) {
+			output.resize(output.size() * 2);
+			stream.next_out = reinterpret_cast<std::uint8_t *>(output.data()) + stream.total_out;
+			stream.avail_out = output.size() - stream.total_out;
+		}
+
+		output.resize(stream.total_out);
+		lzma_end(&stream);
+
+		if (status != LZMA_STREAM_END) {
+			throw std::runtime_error("bench: failed to compress lzma");
+		}
+
+		return output;
+	}
+
+	inline std::string bzip2(std::string_view data) {
+		auto length = static_cast<unsigned int>(data.size() + data.size() / 100 + 600);
+		std::string output(length, '\0');
+
+		if (BZ2_bzBuffToBuffCompress(output.data(), &length, const_cast<char *>(data.data()), static_cast<unsigned int>(data.size()), 9, 0, 0) != BZ_OK) {
+			throw std::runtime_error("bench: failed to compress bz2");
+		}
+
+		output.resize(length);
+		return output;
+	}
+
+	// A frame size writes one checksummed frame per slice back to back, the way `pzstd` does
+	inline std::string zstd(std::string_view data, std::size_t frame_size = 0) {
+		if (frame_size == 0) {
+			std::string output(ZSTD_compressBound(data.size()), '\0');
+			output.resize(ZSTD_compress(output.data(), output.size(), data.data(), data.size(), 19));
+			return output;
+		}
+
+		ZSTD_CCtx *context = ZSTD_createCCtx();
+		ZSTD_CCtx_setParameter(context, ZSTD_c_compressionLevel, 19);
+		ZSTD_CCtx_setParameter(context, ZSTD_c_checksumFlag, 1);
+
+		std::string output;
+		for (std::size_t offset = 0; offset < data.size(); offset += frame_size) {
+			auto slice = data.substr(offset, frame_size);
+			auto start = output.size();
+			output.resize(start + ZSTD_compressBound(slice.size()));
+
+			auto written = ZSTD_compress2(context, output.data() + start, output.size() - start, slice.data(), slice.size());
+			if (ZSTD_isError(written)) {
+				ZSTD_freeCCtx(context);
+				throw std::runtime_error("bench: failed to compress zstd frame");
+			}
+
+			output.resize(start + written);
+		}
+
+		ZSTD_freeCCtx(context);
+		return output;
+	}
+
+	inline void write_file(const std::string &path, std::string_view data) {
+		std::ofstream file(path, std::ios::binary);
+		file.write(data.data(), static_cast<std::streamsize>(data.size()));
+	}
+}
@@ -51,3 +51,22 @@ CREATE TABLE IF NOT EXISTS "VPackages" (
 );
 ---
 CREATE UNIQUE INDEX IF NOT EXISTS "SingularCurrentPackage" ON "VPackages"(package) WHERE "current_version";
+---
+ALTER TABLE "VPackages" ADD COLUMN IF NOT EXISTS "fingerprint" CHAR(64);
+---
+CREATE UNIQUE INDEX IF NOT EXISTS "VPackageFingerprint" ON "VPackages"("fingerprint");
+---
+CREATE TABLE IF NOT EXISTS "Mirrors" (
+	"fingerprint" CHAR(64) NOT NULL,
+	"repo" VARCHAR(255) NOT NULL REFERENCES "Repositories"("slug"),
+	"uuid" VARCHAR(255) NOT NULL REFERENCES "VPackages",
+	"filename" TEXT NOT NULL,
+
+	PRIMARY KEY("fingerprint", "repo")
+);
+---
+CREATE INDEX IF NOT EXISTS "VPackageRepository" ON "VPackages"(split_part("uuid", '$$', 3));
+---
+CREATE INDEX IF NOT EXISTS "VPackagePackage" ON "VPackages"("package");
+---
+CREATE INDEX IF NOT EXISTS "MirrorUUID" ON "Mirrors"("uuid");
@@ -0,0 +1,168 @@
+#include "../bench/corpus.h"
+#include "differential.h"
+
+// Differential test for parse_apt_kv and dpkg::compare, runs as `meson test differential`
+// Checks the seed corpora, the benchmark corpus and randomly generated inputs, a fixed seed keeps runs reproducible
+//
+//   differential --iterations=100000 --seed=42
+
+#ifndef FUZZ_CORPUS
+	#define FUZZ_CORPUS "fuzz/corpus"
+#endif
+
+namespace {
+	std::size_t checked = 0;
+	std::size_t divergences = 0;
+
+	void record(const std::optional<std::string> &divergence) {
+		checked++;
+		if (!divergence.has_value()) {
+			return;
+		}
+
+		// Past the first few the output stops being useful, the count is still reported
+		if (++divergences <= 20) {
+			std::cerr << divergence.value() << std::endl;
+		}
+	}
+
+	std::vector<std::string> seeds(const std::string &target) {
+		std::vector<std::string> files;
+		for (auto &entry : std::filesystem::directory_iterator(std::string(FUZZ_CORPUS) + "/" + target)) {
+			if (entry.is_regular_file()) {
+				files.push_back(bench::read_file(entry.path().string()));
+			}
+		}
+
+		return files;
+	}
+
+	template <typename T>
+	const T &pick(std::mt19937_64 &random, const std::vector<T> &values) {
+		return values[random() % values.size()];
+	}
+
+	// Real keys and values mixed with the shapes that have broken parsers before: bare keys, trailing spaces,
+	// continuation lines, carriage returns, colons without a space and stray bytes
+	std::string generate_stanza(std::mt19937_64 &random) {
+		static const std::vector<std::string> keys = { "Package", "Version", "Depends", "Description", "Name", "Tag", "Origin", "X-Unknown", "", "Key:", " Package" };
+		static const std::vector<std::string> values = { "", " ", "com.example.tweak", "1:2.0~beta1-3", "libc (>= 2.0) | libd", "a: b", "::", "trailing  ", "tab\there", "cr\r", std::string("nul\0byte", 8), "\xe2\x80\xa8" };
+		static const std::vector<std::string> separators = { ": ", ":", ":  ", " : ", ": \r", ":\t" };
+
+		std::string stanza;
+		auto lines = random() % 12;
+		for (std::size_t line = 0; line < lines; line++) {
+			switch (random() % 6) {
+				case 0:
+					stanza.append(" ").append(pick(random, values));
+					break;
+				case 1:
+					stanza.append(pick(random, keys)).append(":").append(random() % 2 ? " " : "");
+					break;
+				case 2:
+					break;
+				default:
+					stanza.append(pick(random, keys)).append(pick(random, separators)).append(pick(random, values));
+					break;
+			}
+
+			if (random() % 20 == 0) {
+				stanza.push_back(static_cast<char>(random()));
+			}
+
+			stanza.push_back('\n');
+		}
+
+		if (random() % 4 == 0 && !stanza.empty()) {
+			stanza.pop_back();
+		}
+
+		return stanza;
+	}
+
+	// Epochs, tildes, revisions, leading zeros and the odd byte that isn't valid in a version at all
+	// Epochs just past the std::int8_t range exercise the epoch_wrap deviation
+	std::string generate_version(std::mt19937_64 &random) {
+		static const std::vector<std::string> epochs = { "", "", "", "0:", "1:", "2:", "10:", " 1:", "+1:", "-1:", "+-1:", "01:", ":", "a:", "99999999999:", "1a:", "127:", "128:", "255:", "256:", "-129:" };
+		static const std::vector<std::string> pieces = { "0", "1", "2", "9", "10", "007", "a", "z", "A", "~", "~~", "+", ".", "-", "beta", "rc", "git20231101", ":" };
+
+		auto version = pick(random, epochs);
+		auto count = random() % 6;
+		for (std::size_t piece = 0; piece < count; piece++) {
+			version.append(pick(random, pieces));
+		}
+
+		if (random() % 3 == 0) {
+			version.append("-").append(std::to_string(random() % 12));
+		}
+
+		if (random() % 50 == 0) {
+			version.push_back(static_cast<char>(random()));
+		}
+
+		return version;
+	}
+}
+
+int main(int argc, char **argv) {
+	std::size_t iterations = 20000;
+	std::uint64_t seed = 1;
+
+	for (int index = 1; index < argc; index++) {
+		std::string_view argument(argv[index]);
+		if (argument.starts_with("--iterations=")) {
+			iterations = std::stoul(std::string(argument.substr(13)));
+		} else if (argument.starts_with("--seed=")) {
+			seed = std::stoull(std::string(argument.substr(7)));
+		} else {
+			std::cerr << "differential: unknown option " << argument << std::endl;
+			return 2;
+		}
+	}
+
+	const std::vector<const std::vector<std::string> *> validators = { &canister::util::packages_keys(), &canister::util::release_keys(), &canister::util::control_keys() };
+
+	for (auto &seed_input : seeds("parse_apt_kv")) {
+		for (auto keys : validators) {
+			record(differential::parse_apt_kv(seed_input, *keys));
+		}
+	}
+
+	for (auto &seed_input : seeds("dpkg_compare")) {
+		record(differential::compare(seed_input));
+	}
+
+	// Every real stanza on its own and every pair of real versions against each other
+	auto real = bench::read_file(std::string(BENCH_CORPUS) + "/real.Packages");
+	std::vector<std::string> real_versions;
+	for (auto stanza : bench::split_stanzas(real)) {
+		record(differential::parse_apt_kv(stanza, canister::util::packages_keys()));
+
+		std::pmr::monotonic_buffer_resource arena;
+		auto kv_map = canister::parser::parse_apt_kv(stanza, canister::util::packages_keys(), &arena);
+		if (kv_map.contains("Version")) {
+			real_versions.emplace_back(kv_map["Version"]);
+		}
+	}
+
+	for (auto &left : real_versions) {
+		for (auto &right : real_versions) {
+			record(differential::compare(left, right));
+		}
+	}
+
+	std::mt19937_64 random(seed);
+	for (std::size_t iteration = 0; iteration < iterations; iteration++) {
+		record(differential::parse_apt_kv(generate_stanza(random), *pick(random, validators)));
+
+		// Versions are cheap, so they get a few comparisons for every stanza
+		for (int pair = 0; pair < 8; pair++) {
+			auto left = generate_version(random);
+			auto right = random() % 8 == 0 ? left : generate_version(random);
+			record(differential::compare(left, right));
+		}
+	}
+
+	std::cout << "differential: " << checked << " inputs checked, " << divergences << " divergences (seed " << seed << ")" << std::endl;
+	return divergences == 0 ? 0 : 1;
+}
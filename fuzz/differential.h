@@ -0,0 +1,161 @@
+#pragma once
+#include "reference.h"
+
+// Runs an input through the reference and the optimized implementation, shared by the fuzz targets and the test
+
+namespace differential {
+	inline std::string escape(std::string_view value) {
+		std::string output;
+		for (unsigned char character : value) {
+			if (character == '\\') {
+				output.append("\\\\");
+			} else if (character == '\n') {
+				output.append("\\n");
+			} else if (character == '\r') {
+				output.append("\\r");
+			} else if (character == '\t') {
+				output.append("\\t");
+			} else if (character < 0x20 || character >= 0x7f) {
+				char buffer[8];
+				std::snprintf(buffer, sizeof(buffer), "\\x%02x", character);
+				output.append(buffer);
+			} else {
+				output.push_back(static_cast<char>(character));
+			}
+		}
+
+		return output;
+	}
+
+	inline std::string describe(const std::map<std::string, std::string> &kv_map) {
+		std::string output = "{";
+		for (auto &[key, value] : kv_map) {
+			output.append(" \"").append(escape(key)).append("\": \"").append(escape(value)).append("\"");
+		}
+
+		return output + " }";
+	}
+
+	// Returns how the two disagree, nothing when they produced the same map
+	inline std::optional<std::string> parse_apt_kv(std::string_view content, const std::vector<std::string> &keys) {
+		auto expected = reference::parse_apt_kv(std::stringstream(std::string(content)), keys);
+
+		std::pmr::monotonic_buffer_resource arena;
+		auto kv_map = canister::parser::parse_apt_kv(content, keys, &arena);
+		std::map<std::string, std::string> actual;
+		for (auto &[key, value] : kv_map) {
+			actual.emplace(key, value);
+		}
+
+		if (actual == expected) {
+			return std::nullopt;
+		}
+
+		return "parse_apt_kv(\"" + escape(content) + "\")\n  reference: " + describe(expected) + "\n  optimized: " + describe(actual);
+	}
+
+	// Deliberate differences between dpkg::compare and the original, nothing else may make the two disagree
+	// Each has a seed under fuzz/corpus/dpkg_compare named after it
+	enum class deviation {
+		epoch_wrap, // The original stored epochs in an std::int8_t, so 128 and up wrapped around and sorted below 0
+		clamped, // The original passed on raw verrevcmp results like first_diff, dpkg::compare only returns -1, 0 or 1
+	};
+
+	inline std::string name(deviation value) {
+		return value == deviation::epoch_wrap ? "epoch_wrap" : "clamped";
+	}
+
+	// Parsed the way the original parses it, so it only throws where the original does
+	inline int epoch(const std::string &version) {
+		auto index = version.find(":", 0);
+		return index == std::string::npos ? 0 : std::stoi(version.substr(0, index));
+	}
+
+	// Which deviation lets the optimized result differ for this pair, nothing when the raw results have to match
+	inline std::optional<deviation> deviation_of(const std::string &left, const std::string &right, int original) {
+		auto wraps = [](int value) {
+			return value != static_cast<std::int8_t>(value);
+		};
+
+		if (wraps(epoch(left)) || wraps(epoch(right))) {
+			return deviation::epoch_wrap;
+		}
+
+		if (original < -1 || original > 1) {
+			return deviation::clamped;
+		}
+
+		return std::nullopt;
+	}
+
+	// The original with every deviation applied: epochs compared as ints and the result reduced to its sign
+	// Epochs are rewritten to 0 before the rest goes through the original, so it never sees one that wraps
+	inline int intended(const std::string &left, const std::string &right) {
+		auto left_epoch = epoch(left);
+		auto right_epoch = epoch(right);
+		if (left_epoch != right_epoch) {
+			return left_epoch > right_epoch ? 1 : -1;
+		}
+
+		auto without_epoch = [](const std::string &version) {
+			auto index = version.find(":", 0);
+			return "0:" + (index == std::string::npos ? version : version.substr(index + 1));
+		};
+
+		auto status = reference::compare(without_epoch(left), without_epoch(right));
+		return (status > 0) - (status < 0);
+	}
+
+	// Raw results are compared, both have to agree on which inputs are rejected
+	inline std::optional<std::string> compare(std::string_view left, std::string_view right) {
+		std::string left_raw(left);
+		std::string right_raw(right);
+
+		std::optional<int> original;
+		try {
+			original = reference::compare(left_raw, right_raw);
+		} catch (std::exception &) {
+		}
+
+		std::optional<int> optimized;
+		try {
+			optimized = canister::dpkg::compare(left, right);
+		} catch (std::exception &) {
+		}
+
+		if (optimized == original) {
+			return std::nullopt;
+		}
+
+		auto describe = [](const std::optional<int> &status) {
+			return status.has_value() ? std::to_string(status.value()) : std::string("throws");
+		};
+
+		std::string message = "compare(\"" + escape(left) + "\", \"" + escape(right) + "\")\n  reference: " + describe(original) + "\n  optimized: " + describe(optimized);
+		if (!original.has_value()) {
+			return message;
+		}
+
+		auto allowed = deviation_of(left_raw, right_raw, original.value());
+		if (!allowed.has_value()) {
+			return message;
+		}
+
+		auto expected = intended(left_raw, right_raw);
+		if (optimized == expected) {
+			return std::nullopt;
+		}
+
+		return message + "\n  " + name(allowed.value()) + " expects: " + std::to_string(expected);
+	}
+
+	// Fuzz inputs are a single buffer, the first newline separates the two versions
+	inline std::optional<std::string> compare(std::string_view input) {
+		auto separator = input.find('\n');
+		if (separator == std::string_view::npos) {
+			return compare(input, input);
+		}
+
+		return compare(input.substr(0, separator), input.substr(separator + 1));
+	}
+}
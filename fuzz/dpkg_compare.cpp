@@ -0,0 +1,14 @@
+#include "differential.h"
+
+// libFuzzer target, the input is two versions separated by a newline
+//   ./fuzz-dpkg-compare -max_len=256 fuzz/corpus/dpkg_compare
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t *data, std::size_t size) {
+	std::string_view input(reinterpret_cast<const char *>(data), size);
+	if (auto divergence = differential::compare(input)) {
+		std::cerr << divergence.value() << std::endl;
+		std::abort();
+	}
+
+	return 0;
+}
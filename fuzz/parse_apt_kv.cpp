@@ -0,0 +1,21 @@
+#include "differential.h"
+
+// libFuzzer target, aborts as soon as the optimized parser disagrees with the reference one
+//   ./fuzz-parse-apt-kv -max_len=4096 fuzz/corpus/parse_apt_kv
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t *data, std::size_t size) {
+	// std::regex recurses once per character, so the reference overflows the stack on huge lines
+	if (size > 16384) {
+		return -1;
+	}
+
+	std::string_view content(reinterpret_cast<const char *>(data), size);
+	for (auto keys : { &canister::util::packages_keys(), &canister::util::release_keys() }) {
+		if (auto divergence = differential::parse_apt_kv(content, *keys)) {
+			std::cerr << divergence.value() << std::endl;
+			std::abort();
+		}
+	}
+
+	return 0;
+}
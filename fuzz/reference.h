@@ -0,0 +1,163 @@
+#pragma once
+#include <canister.h>
+
+// The original parse_apt_kv and dpkg::compare, kept byte for byte apart from their names
+// dpkg::version is declared inline since the one in canister.h is views now, its std::int8_t epoch is kept
+// They're slow on purpose, the optimized versions in src are only correct while they agree with these
+
+namespace reference {
+	inline std::map<std::string, std::string> parse_apt_kv(std::stringstream stream, std::vector<std::string> key_validator) {
+		std::map<std::string, std::string> kv_map;
+		std::string line, previous_key;
+
+		while (std::getline(stream, line, '\n')) {
+			if (line.size() == 0) {
+				continue;
+			}
+
+			std::smatch matches;
+			if (!std::regex_match(line, matches, std::regex("^(.*?): (.*)"))) {
+				// There's a chance instead of multiline, some idiot gave a key without value
+				// Trim the string incase there may be a space after the colon
+				size_t end = line.find_last_not_of(' ');
+				end == std::string::npos ? line = "" : line = line.substr(0, end + 1);
+
+				if (!line.ends_with(":")) {
+					kv_map[previous_key].append("\n" + line);
+				} else {
+					previous_key = matches[1];
+				}
+			}
+
+			// This means we don't have a value before and after the colon in the KV
+			if (matches.size() != 3) {
+				continue;
+			}
+
+			// Validate our key before adding it to the map since Canister doesn't need all keys
+			if (std::find(key_validator.begin(), key_validator.end(), matches[1]) != key_validator.end()) {
+				kv_map.insert(std::make_pair(matches[1], matches[2]));
+			}
+
+			previous_key = matches[1];
+		}
+
+		return kv_map;
+	}
+
+	// These are taken from dpkg with minor modifications to build with C++20 and Canister
+	// https://git.dpkg.org/cgit/dpkg/dpkg.git/tree/lib/dpkg/version.c
+	inline int order(int c) {
+		if (isdigit(c))
+			return 0;
+		else if (isalpha(c))
+			return c;
+		else if (c == '~')
+			return -1;
+		else if (c)
+			return c + 256;
+		else
+			return 0;
+	}
+
+	inline int verrevcmp(const char *a, const char *b) {
+		if (a == NULL)
+			a = "";
+		if (b == NULL)
+			b = "";
+
+		while (*a || *b) {
+			int first_diff = 0;
+
+			while ((*a && !isdigit(*a)) || (*b && !isdigit(*b))) {
+				int ac = order(*a);
+				int bc = order(*b);
+
+				if (ac != bc)
+					return ac - bc;
+
+				a++;
+				b++;
+			}
+			while (*a == '0')
+				a++;
+			while (*b == '0')
+				b++;
+			while (isdigit(*a) && isdigit(*b)) {
+				if (!first_diff)
+					first_diff = *a - *b;
+				a++;
+				b++;
+			}
+
+			if (isdigit(*a))
+				return 1;
+			if (isdigit(*b))
+				return -1;
+			if (first_diff)
+				return first_diff;
+		}
+
+		return 0;
+	}
+
+	inline int compare(const std::string &left_raw, const std::string &right_raw) {
+		struct {
+			std::int8_t epoch;
+			std::string version;
+			std::string revision;
+		} left, right;
+		std::string::size_type index;
+
+		// Find out if we have an epoch (dpkg defaults to 0 if it doesn't exist)
+		index = left_raw.find(":", 0);
+		if (index == std::string::npos) {
+			left.epoch = 0;
+			left.version = left_raw;
+		} else {
+			left.epoch = std::stoi(left_raw.substr(0, index));
+			left.version = left_raw.substr(index + 1, left_raw.length());
+		}
+
+		index = right_raw.find(":", 0);
+		if (index == std::string::npos) {
+			right.epoch = 0;
+			right.version = right_raw;
+		} else {
+			right.epoch = std::stoi(right_raw.substr(0, index));
+			right.version = right_raw.substr(index + 1, right_raw.length());
+		}
+
+		// Find out the version strings and their revisions if applicable
+		index = left.version.rfind("-", left_raw.length());
+		if (index == std::string::npos) {
+			left.revision = "0";
+		} else {
+			left.revision = left.version.substr(index + 1, left.version.length());
+			left.version = left.version.substr(0, index);
+		}
+
+		index = right.version.rfind("-", right_raw.length());
+		if (index == std::string::npos) {
+			right.revision = "0";
+		} else {
+			right.revision = right.version.substr(index + 1, right.version.length());
+			right.version = right.version.substr(0, index);
+		}
+
+		// Compare everything
+		if (left.epoch > right.epoch) {
+			return 1;
+		}
+
+		if (left.epoch < right.epoch) {
+			return -1;
+		}
+
+		if (int status = verrevcmp(left.version.c_str(), right.version.c_str())) {
+			return status;
+		}
+
+		return verrevcmp(left.revision.c_str(), right.revision.c_str());
+	}
+}
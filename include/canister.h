@@ -1,17 +1,74 @@
+#pragma once
 #define PROJECT_NAME "canister"
 #define UWS_NO_ZLIB 1 // Disable compression on uWebSockets
 #define UWS_HTTPRESPONSE_NO_WRITEMARK // Remove the uWebSockets header
 #define MANIFEST_URL "https://pull.canister.me/index-repositories.json"
 #define USER_AGENT "Canister/2.0 [Core] (+https://canister.me/go/ua)"
+#define CACHE_PATH "/tmp/canister/" // Downloaded and decompressed indexes, debs and snapshots live under this
+#define HTTP_PORT 8080
+#define CONNECT_TIMEOUT 10 // Seconds to get a connection to any host
+#define FETCH_TIMEOUT 300 // Seconds a repository file download may take, 0 never gives up
+#define SILEO_TIMEOUT 10 // Seconds a payment endpoint request may take
+#define LOW_SPEED_LIMIT 1024 // Transfers slower than this many bytes per second for LOW_SPEED_TIME are aborted
+#define LOW_SPEED_TIME 30
+#define FETCH_ATTEMPTS 3 // Tries per request when the failure looks transient, like a timeout or a 5xx
+#define FETCH_RETRY_DELAY 500 // Milliseconds, doubled for every retry and jittered
+#define BREAKER_THRESHOLD 5 // Requests in a row that have to fail before a host is skipped
+#define BREAKER_COOLDOWN 300 // Seconds a failing host is skipped before it gets another try
+#define HOST_RATE 4 // Requests per second any single host gets from us once its burst is spent
+#define HOST_BURST 8
+#define BANDWIDTH_LIMIT 0 // Bytes per second shared by every download, 0 doesn't cap it
+#define HTTP_BUFFER_POOL 8 // Response buffers kept around for the next fetch to write into
+#define HTTP_BUFFER_RETAIN 67108864 // Buffers that grew past this many bytes go back to the allocator instead of the pool
+#define HTTP_PRESIZE_LIMIT 268435456 // A Content-Length above this isn't trusted for presizing, the buffer grows as the body arrives
 #define SENTRY_DSN "https://2493ed76073e4cecb7738191e7e18fc8@o1033514.ingest.sentry.io/6090078"
+#define DEB_CACHE_BUDGET 10737418240ULL // Bytes of .deb files kept on disk
+#define DEB_FETCH_WORKERS 2 // Debs downloaded in the background at the same time
+#define DEB_CONTROL_LIMIT 1048576 // Control files bigger than this are rejected instead of read into memory
+#define DEB_RANGE_PARTS 4 // Parallel byte ranges a single large deb is split into
+#define DEB_RANGE_MINIMUM 4194304 // Debs are only split into ranges once every range would be at least this big
+#define DECOMPRESS_STREAM_BUFFER 65536 // Output chunk handed to a sink by the streaming decompressors
+#define DECOMPRESS_WRITE_BUFFER 1048576 // Page aligned output chunk the xz and zstd decompressors write to disk at once
+#define CPU_WORKERS 0 // Threads shared by parallel decompression and parsing across every pipeline, 0 uses one per core
+#define HTTP_WORKERS 0 // Threads serving HTTP and WebSockets, 0 uses one per core
+#define PIPELINE_FETCH_WORKERS 4 // Repositories downloaded and decompressed at the same time, also the number of price lookup workers
+#define PIPELINE_QUEUE_DEPTH 2 // Finished jobs allowed to wait on the next stage before a stage blocks
+#define SCHEDULER_TICK 60 // Seconds between checks for repositories that are due for a refresh
+#define SCHEDULER_MIN_INTERVAL 300 // Repositories that change constantly are never polled faster than this
+#define SCHEDULER_MAX_INTERVAL 21600 // Dormant repositories are still polled at least this often
+#define SCHEDULER_INITIAL_INTERVAL 1800
+#define RESPONSES_ZSTD_LEVEL 3 // Payloads rendered on a cache miss are compressed inside the request handler, so only cheap levels
+#define RESPONSES_GZIP_LEVEL 6
+#define RESPONSES_WARM_ZSTD_LEVEL 19 // Warmed listings are compressed once per refresh off the request path, so the slow levels are affordable
+#define RESPONSES_WARM_GZIP_LEVEL 9
+#define RESPONSES_MAX_ENTRIES 16384 // Cached payloads per generation, the least recently used one is evicted past this
+#define SNAPSHOT_VERSION 3 // Bumped whenever the snapshot layout changes, older snapshots are then ignored
 
+#include <array>
+#include <atomic>
+#include <charconv>
 #include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
 #include <fstream>
+#include <functional>
 #include <future>
+#include <list>
+#include <map>
+#include <memory_resource>
+#include <mutex>
+#include <random>
 #include <regex>
+#include <set>
+#include <shared_mutex>
+#include <span>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <bzlib.h>
 #include <ctype.h>
@@ -20,17 +77,100 @@
 #include <curlpp/Multi.hpp>
 #include <curlpp/Options.hpp>
 #include <curlpp/cURLpp.hpp>
+#include <fcntl.h>
 #include <lzma.h>
 #include <nlohmann/json.hpp>
-#include <picosha2.h>
 #include <sentry.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <tao/pq.hpp>
+#include <unistd.h>
 #include <uv.h>
 #include <uws/App.h>
+#include <validator.h>
 #include <zlib.h>
 #include <zstd.h>
 
+#if defined(__x86_64__)
+	#include <immintrin.h>
+#endif
+
 namespace canister {
+	namespace hash {
+		using digest = std::array<std::uint8_t, 32>;
+
+		// Block functions hashers can run on, the best one the CPU supports is picked once at startup
+		enum class engine {
+			portable,
+			sha_ni
+		};
+
+		bool supported(canister::hash::engine engine);
+
+		// Incremental SHA-256, so bodies can be hashed while they are streamed in
+		class sha256 {
+		public:
+			sha256();
+			// Pins a hasher to one engine, only the known answer test needs this and it throws if the CPU can't run it
+			explicit sha256(canister::hash::engine engine);
+			void update(std::string_view data);
+			canister::hash::digest finish();
+
+		private:
+			void (*compress)(std::uint32_t *state, const std::uint8_t *data, std::size_t blocks);
+			std::array<std::uint32_t, 8> state;
+			std::array<std::uint8_t, 64> buffer {};
+			std::size_t buffered = 0;
+			std::uint64_t length = 0;
+		};
+
+		// Lets digests key unordered containers
+		struct digest_hasher {
+			std::size_t operator()(const canister::hash::digest &digest) const;
+		};
+
+		canister::hash::digest digest_of(std::string_view data);
+		std::optional<canister::hash::digest> from_hex(std::string_view hex);
+		std::string to_hex(const canister::hash::digest &digest);
+		bool verify(std::string_view data, std::string_view expected_hex);
+
+		// Identical builds share a fingerprint no matter which repository or filename they're hosted under
+		std::optional<canister::hash::digest> fingerprint(std::string_view sha_256, std::string_view size, std::string_view version);
+	}
+
+	namespace config {
+		// Defaults are the compile time constants, CANISTER_CONFIG points at a JSON file and the uppercase names in the environment win over both
+		struct settings {
+			std::string manifest_url = MANIFEST_URL;
+			std::string user_agent = USER_AGENT;
+			std::string cache_path = CACHE_PATH;
+			std::uint16_t port = HTTP_PORT;
+			std::uint32_t http_workers = HTTP_WORKERS;
+			std::uint32_t connect_timeout = CONNECT_TIMEOUT;
+			std::uint32_t fetch_timeout = FETCH_TIMEOUT;
+			std::uint32_t sileo_timeout = SILEO_TIMEOUT;
+			std::uint32_t low_speed_limit = LOW_SPEED_LIMIT;
+			std::uint32_t low_speed_time = LOW_SPEED_TIME;
+			std::uint32_t fetch_attempts = FETCH_ATTEMPTS;
+			std::uint32_t fetch_retry_delay = FETCH_RETRY_DELAY;
+			std::uint32_t breaker_threshold = BREAKER_THRESHOLD;
+			std::uint32_t breaker_cooldown = BREAKER_COOLDOWN;
+			std::uint32_t host_rate = HOST_RATE;
+			std::uint32_t host_burst = HOST_BURST;
+			std::uint64_t bandwidth_limit = BANDWIDTH_LIMIT;
+			std::size_t pipeline_fetch_workers = PIPELINE_FETCH_WORKERS;
+			std::size_t pipeline_queue_depth = PIPELINE_QUEUE_DEPTH;
+			std::size_t deb_fetch_workers = DEB_FETCH_WORKERS;
+			std::uint64_t deb_cache_budget = DEB_CACHE_BUDGET;
+			std::uint32_t scheduler_tick = SCHEDULER_TICK;
+			std::uint32_t cpu_workers = CPU_WORKERS;
+		};
+
+		// Throws with every invalid setting listed, called by main before anything else runs
+		void load();
+		const canister::config::settings &get();
+	}
+
 	namespace db {
 		struct repository {
 			std::string slug;
@@ -51,46 +191,78 @@ namespace canister {
 			std::string sileo_endpoint;
 		};
 
+		// Packages and VPackages are views into the repository's scratch arena
+		// They are only valid until that repository has been committed
 		struct package {
-			std::string id;
-			std::string repo;
-			std::string price;
+			std::string_view id;
+			std::string_view repo;
+			std::string_view price;
 		};
 
 		struct vpackage {
-			std::string uuid;
-			std::string package;
+			std::string_view uuid;
+			std::string_view package;
 			bool current_version;
 
-			std::string version;
-			std::string architecture;
-			std::string filename;
+			std::string_view version;
+			std::string_view architecture;
+			std::string_view filename;
 
-			std::string sha_256;
-			std::string name;
-			std::string description;
-			std::string author;
-			std::string maintainer;
-			std::string depiction;
-			std::string native_depiction;
-			std::string header;
-			std::string tint_color;
-			std::string icon;
-			std::string section;
-			std::string tag;
-			std::string installed_size;
-			std::string size;
+			std::string_view sha_256;
+			std::string_view name;
+			std::string_view description;
+			std::string_view author;
+			std::string_view maintainer;
+			std::string_view depiction;
+			std::string_view native_depiction;
+			std::string_view header;
+			std::string_view tint_color;
+			std::string_view icon;
+			std::string_view section;
+			std::string_view tag;
+			std::string_view installed_size;
+			std::string_view size;
+			std::string_view fingerprint; // Hex, empty when the stanza had no usable SHA256
+		};
+
+		// Every repository hosting an identical build points at the one canonical VPackage
+		struct current_version {
+			std::string package;
+			std::string uuid;
+			std::string fingerprint;
+		};
+
+		struct mirror {
+			std::string_view fingerprint;
+			std::string_view repo;
+			std::string_view uuid;
+			std::string_view filename;
 		};
 
 		void bootstrap();
-		std::optional<std::string> package_exists(std::string id);
-		std::optional<std::string> current_vpackage_version(std::string package);
-		std::int8_t repository_ranking(std::string slug);
+		std::optional<std::string> package_exists(std::string_view id);
+		std::optional<std::string> current_vpackage_version(std::string_view package);
+		std::unordered_map<canister::hash::digest, std::string, canister::hash::digest_hasher> fingerprints();
 
 		void write_repository(canister::db::repository data);
 		void write_package(canister::db::package data);
 		void write_vpackage(canister::db::vpackage data);
-		void set_current_vpackage(std::string uuid, std::string package);
+		void write_mirror(canister::db::mirror data);
+		// Moves a build from the row another repository wrote over to a new row, which inherits its mirrors and current flag
+		bool replace_canonical(canister::db::vpackage data, std::string_view previous);
+		// Drops the mirrors of a repository that aren't among the fingerprints it still lists
+		void prune_mirrors(std::string_view slug, const std::vector<std::string> &fingerprints);
+		void set_current_vpackage(std::string_view uuid, std::string_view package);
+		void update_repository_ranking(std::string_view slug, std::int8_t ranking, const std::vector<std::string> &aliases);
+		// Only the fields the manifest decides are read, nothing when the query failed
+		std::optional<std::vector<canister::db::repository>> repositories();
+
+		// Moves every package the repositories host to its best ranked host in one statement, price looks up (repo, id)
+		std::size_t reconcile_owners(const std::vector<std::string> &slugs, const std::function<std::optional<std::string>(const std::string &, const std::string &)> &price);
+
+		// Drops every row of the given repositories in one transaction, currents replace the versions that went with them
+		// Returns the remaining repositories that only mirrored a build the pruned ones hosted, they need a rewrite
+		std::vector<std::string> prune_repositories(const std::vector<std::string> &slugs, const std::vector<canister::db::current_version> &currents);
 	}
 
 	namespace decompress {
@@ -99,18 +271,36 @@ namespace canister {
 		void bz2(const std::string id, const std::string archive, const std::string cache);
 		void lzma(const std::string id, const std::string archive, const std::string cache);
 		void zstd(const std::string id, const std::string archive, const std::string cache);
+
+		// Streaming variants for archives already in memory, the sink returns false once it has what it needs
+		using sink = std::function<bool(std::string_view)>;
+		void gz_stream(const std::string id, std::string_view archive, const canister::decompress::sink &write);
+		void xz_stream(const std::string id, std::string_view archive, const canister::decompress::sink &write);
+		void zstd_stream(const std::string id, std::string_view archive, const canister::decompress::sink &write);
 	}
 
 	namespace dpkg {
+		// Views into the version string that was split
 		struct version {
-			std::int8_t epoch;
-			std::string version;
-			std::string revision;
+			int epoch;
+			std::string_view version;
+			std::string_view revision;
 		};
 
-		int compare(const std::string &left, const std::string &right);
+		// Relationship operators, the old "<" and ">" mean the same as "<=" and ">="
+		enum class relation : std::uint8_t {
+			any,
+			earlier,
+			earlier_equal,
+			equal,
+			later_equal,
+			later
+		};
+
+		int compare(std::string_view left, std::string_view right);
+		bool satisfies(std::string_view candidate, canister::dpkg::relation relation, std::string_view constraint);
 		int order(int c);
-		int verrevcmp(const char *a, const char *b);
+		int verrevcmp(std::string_view left, std::string_view right);
 	}
 
 	namespace log {
@@ -128,35 +318,559 @@ namespace canister {
 			std::string suite;
 		};
 
+		// Keys and values point into the parsed content or the arena it was parsed with
+		using apt_kv = std::pmr::map<std::string_view, std::string_view>;
+
 		struct packages_info {
 			std::uint32_t count;
 			std::vector<std::string> sections;
-			std::vector<std::map<std::string, std::string>> data;
+
+			// Every stanza is allocated from these, so they must outlive data
+			std::vector<std::unique_ptr<std::pmr::monotonic_buffer_resource>> arenas;
+			std::vector<canister::parser::apt_kv> data;
+		};
+
+		std::vector<canister::parser::repo_manifest> read_manifest(const nlohmann::json &data, std::function<void(const std::string &)> report);
+		std::map<std::string, std::string> parse_release(const std::string id, std::string_view content);
+		std::map<std::string, canister::hash::digest> parse_release_hashes(std::string_view content);
+		canister::parser::packages_info parse_packages(const std::string id, std::string_view content);
+		canister::parser::apt_kv parse_apt_kv(std::string_view content, const std::vector<std::string> &key_validator, std::pmr::memory_resource *arena);
+	}
+
+	namespace responses {
+		// A serialized body with its compressed variants, empty variants weren't worth compressing
+		struct payload {
+			std::string etag;
+			std::string identity;
+			std::string gzip;
+			std::string zstd;
+		};
+
+		// Request handlers render with fast compression, only warm() can afford the best
+		enum class effort {
+			fast,
+			best
 		};
 
-		void parse_manifest(const nlohmann::json data, uWS::WebSocket<false, true, std::string> *ws);
-		std::map<std::string, std::string> parse_release(const std::string id, const std::string content);
-		canister::parser::packages_info parse_packages(const std::string id, const std::string content);
-		std::map<std::string, std::string> parse_apt_kv(std::stringstream stream, std::vector<std::string> key_validator);
+		std::shared_ptr<const canister::responses::payload> build(std::string body, canister::responses::effort effort = canister::responses::effort::fast);
+		std::shared_ptr<const canister::responses::payload> get(const std::string &key, std::function<std::optional<std::string>()> render, canister::responses::effort effort = canister::responses::effort::fast);
+		void invalidate();
+		void warm();
 	}
 
 	namespace http {
+		// Unchanged manifests come back as the copy from the last full response
+		struct manifest_response {
+			bool changed;
+			nlohmann::json data;
+		};
+
+		// Transient failures like timeouts and 5xx responses are tried again, anything else is final
+		enum class attempt {
+			success,
+			retry,
+			fail
+		};
+
+		struct breaker {
+			std::uint32_t failures = 0; // Requests in a row that still failed after every attempt
+			std::chrono::steady_clock::time_point open_until {};
+			bool probing = false;
+			std::uint64_t skipped = 0;
+		};
+
+		// Lower classes are admitted first when requests queue up, inside a class the better ranked repository goes first
+		enum class traffic : std::uint8_t {
+			release,
+			packages,
+			price,
+			deb
+		};
+
+		struct priority {
+			canister::http::traffic kind;
+			std::int8_t ranking = 0;
+
+			auto operator<=>(const priority &) const = default;
+		};
+
+		// Tokens refill at host_rate per second up to host_burst, every request to the host takes one
+		struct bucket {
+			double tokens;
+			std::chrono::steady_clock::time_point refilled;
+			std::uint64_t requests = 0;
+		};
+
+		struct traffic_stats {
+			std::uint64_t requests = 0;
+			std::uint64_t bytes = 0;
+			std::uint64_t queued = 0; // Milliseconds spent waiting on host buckets
+			std::uint64_t throttled = 0; // Milliseconds spent waiting on the bandwidth cap
+			std::uint32_t waiting = 0;
+			std::uint32_t throttling = 0;
+		};
+
+		// Response bodies are written straight into pooled storage and read as a view by every stage after the fetch
+		// The storage goes back to the pool when the buffer is destroyed, so it has to outlive any view of it
+		class buffer {
+		public:
+			buffer();
+			buffer(buffer &&other) noexcept;
+			buffer &operator=(buffer &&other) noexcept;
+			buffer(const buffer &) = delete;
+			buffer &operator=(const buffer &) = delete;
+			~buffer();
+
+			void reserve(std::size_t size);
+			void append(const char *data, std::size_t size);
+			void clear();
+			std::string_view view() const;
+
+		private:
+			void release();
+
+			std::string storage;
+			bool pooled = false;
+		};
+
 		uWS::App http_server();
+		// Returns once every worker has bound the port, false if any of them couldn't and the rest were shut down again
+		bool start();
+		void wait();
+		void broadcast(const std::string &topic, const std::string &message);
 		std::list<std::string> headers();
-		std::optional<nlohmann::json> manifest();
-		std::optional<std::ostringstream> fetch(const std::string url);
-		std::optional<std::ostringstream> sileo_endpoint(const std::string uri);
-		std::optional<std::string> sileo_endpoint_price(const std::string package, std::string uri);
+		void respond(uWS::HttpResponse<false> *res, std::string_view status, std::string_view body);
+		void respond(uWS::HttpResponse<false> *res, uWS::HttpRequest *req, const canister::responses::payload &payload);
+		// Every outgoing request goes through these, so no single host can hold a refresh up for longer than the policy allows
+		void apply_policy(curlpp::Easy &request, std::uint32_t timeout);
+		canister::http::attempt classify(long status);
+		bool with_policy(const std::string &url, canister::http::priority priority, const std::function<canister::http::attempt()> &perform);
+		// Blocks until the host's bucket has a token for this request, returns how long it queued
+		std::chrono::milliseconds admit(const std::string &host, canister::http::priority priority);
+		// Called from write callbacks, blocks while the shared bandwidth is spent
+		void throttle(std::size_t bytes, canister::http::traffic kind);
+		nlohmann::json stats();
+
+		std::optional<canister::http::manifest_response> manifest();
+		std::optional<canister::http::buffer> fetch(const std::string url, canister::http::priority priority);
+		std::optional<canister::http::buffer> sileo_endpoint(const std::string uri, std::int8_t ranking);
+		std::optional<std::string> sileo_endpoint_price(std::string_view package, std::string uri, std::int8_t ranking);
+		std::string release_url(const canister::parser::repo_manifest &manifest);
 		std::string fetch_release(canister::parser::repo_manifest manifest);
-		std::string fetch_packages(canister::parser::repo_manifest manifest);
+		std::string fetch_packages(canister::parser::repo_manifest manifest, const std::map<std::string, canister::hash::digest> &release_hashes);
 	}
 
 	namespace util {
+		// Read-only view of a cached file, mapped for sequential reads
+		// The view is only valid for as long as the mapping is alive
+		class mapped_file {
+		public:
+			mapped_file() = default;
+			explicit mapped_file(const std::string &path);
+			mapped_file(mapped_file &&other) noexcept;
+			mapped_file &operator=(mapped_file &&other) noexcept;
+			mapped_file(const mapped_file &) = delete;
+			mapped_file &operator=(const mapped_file &) = delete;
+			~mapped_file();
+
+			bool good() const;
+			std::string_view view() const;
+			std::int64_t modified() const;
+
+		private:
+			void *data = nullptr;
+			std::size_t size = 0;
+			std::int64_t modified_at = 0;
+			bool opened = false;
+		};
+
+		// CPU heavy stages borrow their extra threads from one shared budget so concurrent pipelines don't oversubscribe the cores
+		// The calling thread always counts as one, so a lease never blocks and never comes back empty
+		class worker_lease {
+		public:
+			explicit worker_lease(std::size_t wanted);
+			worker_lease(const worker_lease &) = delete;
+			worker_lease &operator=(const worker_lease &) = delete;
+			~worker_lease();
+
+			std::size_t count() const;
+
+		private:
+			std::size_t leased;
+		};
+
 		std::string timestamp();
 		std::string cache_path();
-		std::vector<std::string> release_keys();
-		std::vector<std::string> packages_keys();
+		const std::vector<std::string> &release_keys();
+		const std::vector<std::string> &packages_keys();
+		const std::vector<std::string> &control_keys();
 		std::string safe_fs_name(const std::string token);
-		bool matched_hash(const std::string left, const std::string right);
+		bool matched_hash(std::string_view left, std::string_view right);
+	}
+
+	namespace pipeline {
+		// Bounded queue between two stages, producers block while it's full so memory stays bounded
+		template <typename T>
+		class queue {
+		public:
+			explicit queue(std::size_t capacity)
+				: capacity(capacity) {
+			}
+
+			bool push(T value) {
+				std::unique_lock lock(mutex);
+				not_full.wait(lock, [this] {
+					return closed || items.size() < capacity;
+				});
+
+				if (closed) {
+					return false;
+				}
+
+				items.push_back(std::move(value));
+				not_empty.notify_one();
+				return true;
+			}
+
+			// Returns nothing once the queue is closed and drained
+			std::optional<T> pop() {
+				std::unique_lock lock(mutex);
+				not_empty.wait(lock, [this] {
+					return closed || !items.empty();
+				});
+
+				if (items.empty()) {
+					return std::nullopt;
+				}
+
+				auto value = std::move(items.front());
+				items.pop_front();
+				not_full.notify_one();
+				return value;
+			}
+
+			void close() {
+				std::lock_guard lock(mutex);
+				closed = true;
+				not_full.notify_all();
+				not_empty.notify_all();
+			}
+
+		private:
+			std::size_t capacity;
+			std::deque<T> items;
+			std::mutex mutex;
+			std::condition_variable not_full;
+			std::condition_variable not_empty;
+			bool closed = false;
+		};
+
+		struct repository_job {
+			canister::parser::repo_manifest manifest;
+			std::string release_path;
+			std::string packages_path;
+			std::string sileo_endpoint;
+
+			// A failure is the message reported for the repository, it skips every later stage
+			std::string failure;
+			bool cached = false;
+			bool catalog_only = false; // Unchanged, but parsed anyway because the catalog hasn't seen it yet
+
+			std::map<std::string, std::string> release;
+			canister::util::mapped_file packages_file;
+			canister::parser::packages_info packages_info;
+			std::vector<std::string> prices;
+			std::vector<std::optional<canister::hash::digest>> fingerprints; // One per stanza, from SHA256, Size and Version
+		};
+
+		enum class outcome {
+			updated,
+			cached,
+			failed
+		};
+
+		struct summary {
+			int successful = 0;
+			int failed = 0;
+			int cached = 0;
+			std::map<std::string, canister::pipeline::outcome> outcomes;
+		};
+
+		// Canonical rows can disappear when repositories are pruned, the write stage then reads them again
+		void reload_fingerprints();
+		void fetch(canister::pipeline::repository_job &job);
+		void parse(canister::pipeline::repository_job &job);
+		void price(canister::pipeline::repository_job &job);
+		void write(canister::pipeline::repository_job &job);
+		canister::pipeline::summary refresh(const std::vector<canister::parser::repo_manifest> &manifests, std::function<void(const std::string &)> report);
+	}
+
+	namespace catalog {
+		// Read-optimized copies of what was last written for each repository
+		struct vpackage {
+			std::string uuid;
+			std::string package;
+			std::string repo;
+			std::string price;
+
+			std::string version;
+			std::string architecture;
+			std::string filename;
+
+			std::string sha_256;
+			std::string name;
+			std::string description;
+			std::string author;
+			std::string maintainer;
+			std::string depiction;
+			std::string native_depiction;
+			std::string header;
+			std::string icon;
+			std::string section;
+			std::string tag;
+			std::string installed_size;
+			std::string size;
+
+			std::string depends;
+			std::string pre_depends;
+			std::string conflicts;
+			std::string provides;
+			std::string replaces;
+
+			std::optional<canister::hash::digest> fingerprint;
+		};
+
+		struct repository {
+			std::string slug;
+			std::vector<std::string> aliases;
+			std::int8_t ranking;
+			std::vector<std::string> sections;
+
+			std::string uri;
+			std::string dist;
+			std::string suite;
+
+			std::string name;
+			std::string version;
+			std::string description;
+			std::string date;
+			std::string payment_gateway;
+			std::string sileo_endpoint;
+
+			std::vector<canister::catalog::vpackage> packages;
+			std::unordered_map<std::string, std::vector<std::size_t>> package_indexes;
+
+			// Size and modification time (ns) of the cached Packages file this was built from
+			std::uint64_t packages_size = 0;
+			std::int64_t packages_modified = 0;
+		};
+
+		// Versions point into the repositories that host them and are rebuilt whenever one of those is replaced
+		struct package {
+			std::string id;
+			std::string repo;
+			std::string price;
+			std::int8_t ranking;
+
+			// Identical builds collapse into the copy from the best ranked repository, the rest are its mirrors
+			std::vector<const canister::catalog::vpackage *> versions;
+			std::vector<std::vector<const canister::catalog::vpackage *>> mirrors;
+			const canister::catalog::vpackage *current = nullptr;
+		};
+
+		std::shared_ptr<const canister::catalog::repository> from_job(canister::pipeline::repository_job &job);
+		void update_repository(std::shared_ptr<const canister::catalog::repository> repository);
+		std::vector<std::string> remove_repository(const std::string &slug); // Returns every package it hosted
+		void rerank_repository(const std::string &slug, std::int8_t ranking, const std::vector<std::string> &aliases);
+		bool contains_repository(const std::string &slug);
+		std::vector<std::shared_ptr<const canister::catalog::repository>> repositories();
+
+		std::optional<std::string> package_json(const std::string &id);
+		std::optional<std::string> repository_json(const std::string &slug);
+		std::optional<canister::catalog::vpackage> current_vpackage(const std::string &id);
+		std::optional<std::string> package_price(const std::string &slug, const std::string &id); // As listed by that repository
+		void for_each_current(const std::function<void(const canister::catalog::vpackage &)> &callback);
+		std::string repositories_json();
+		std::string sections_json();
+		std::string search_json(std::string_view query, std::size_t limit);
+	}
+
+	namespace deb {
+		// Size is only a hint for splitting the download, the SHA256 is what decides if it's kept
+		struct download {
+			std::string url;
+			std::string sha_256;
+			std::uint64_t size;
+		};
+
+		// Fields are only the ones in control_keys, scripts are the maintainer scripts the package ships
+		struct control_info {
+			std::map<std::string, std::string> fields;
+			std::vector<std::string> scripts;
+		};
+
+		std::string store_path(std::string_view sha_256);
+		std::optional<std::string> cached(std::string_view sha_256);
+		std::optional<std::string> fetch(const canister::deb::download &download);
+		std::optional<canister::deb::control_info> control(const std::string &path);
+		void enqueue(const canister::catalog::repository &repository);
+		void start();
+	}
+
+	namespace graph {
+		enum class kind : std::uint8_t {
+			depends,
+			pre_depends,
+			conflicts,
+			provides,
+			replaces,
+		};
+
+		// Alternatives written as "a | b" share a group, the constraint indexes into the graph's own table
+		struct edge {
+			std::uint32_t node;
+			canister::graph::kind kind;
+			canister::dpkg::relation relation;
+			std::uint32_t group;
+			std::uint32_t constraint;
+		};
+
+		// Nodes are interned package names, virtual ones have no version
+		// Edges of a node live at [offsets[node], offsets[node + 1]), reverse edges point back at their source
+		struct index {
+			std::deque<std::string> names;
+			std::unordered_map<std::string_view, std::uint32_t> ids;
+			std::vector<std::string> versions;
+			std::vector<std::string> constraints;
+
+			std::vector<std::uint32_t> forward_offsets;
+			std::vector<canister::graph::edge> forward;
+			std::vector<std::uint32_t> reverse_offsets;
+			std::vector<canister::graph::edge> reverse;
+		};
+
+		void rebuild();
+		std::optional<std::string> dependencies_json(const std::string &id);
+		std::optional<std::string> dependents_json(const std::string &id, std::string_view version);
+		std::optional<std::string> providers_json(const std::string &name);
+	}
+
+	namespace search {
+		// Tokens a package was indexed under are kept so its postings can be dropped when it changes
+		struct document {
+			std::string id;
+			std::int8_t ranking;
+			std::vector<std::string> tokens;
+		};
+
+		void update_document(const canister::catalog::package &package);
+		void remove_document(const std::string &id);
+		std::vector<std::string> query(std::string_view text, std::size_t limit);
+	}
+
+	namespace snapshot {
+		// Every string lives once in a shared table at the end of the file and is referenced by offset and length
+		struct string_ref {
+			std::uint32_t offset;
+			std::uint32_t length;
+		};
+
+		// Sections are laid out in this order and every offset is from the start of the file
+		struct header {
+			char magic[8];
+			std::uint32_t version;
+			std::uint32_t repository_count;
+			std::uint64_t repositories_offset;
+			std::uint64_t lists_offset;
+			std::uint64_t list_count;
+			std::uint64_t packages_offset;
+			std::uint64_t package_count;
+			std::uint64_t strings_offset;
+			std::uint64_t strings_size;
+		};
+
+		// Aliases and sections are runs in the shared list of string references, packages are runs of package records
+		struct repository_record {
+			std::uint64_t packages_size;
+			std::int64_t packages_modified;
+			canister::snapshot::string_ref slug;
+			canister::snapshot::string_ref uri;
+			canister::snapshot::string_ref dist;
+			canister::snapshot::string_ref suite;
+			canister::snapshot::string_ref name;
+			canister::snapshot::string_ref version;
+			canister::snapshot::string_ref description;
+			canister::snapshot::string_ref date;
+			canister::snapshot::string_ref payment_gateway;
+			canister::snapshot::string_ref sileo_endpoint;
+			std::uint32_t aliases_first;
+			std::uint32_t aliases_count;
+			std::uint32_t sections_first;
+			std::uint32_t sections_count;
+			std::uint64_t packages_first;
+			std::uint64_t packages_count;
+			std::int32_t ranking;
+			std::uint32_t reserved;
+		};
+
+		struct package_record {
+			canister::snapshot::string_ref uuid;
+			canister::snapshot::string_ref package;
+			canister::snapshot::string_ref repo;
+			canister::snapshot::string_ref price;
+			canister::snapshot::string_ref version;
+			canister::snapshot::string_ref architecture;
+			canister::snapshot::string_ref filename;
+			canister::snapshot::string_ref sha_256;
+			canister::snapshot::string_ref name;
+			canister::snapshot::string_ref description;
+			canister::snapshot::string_ref author;
+			canister::snapshot::string_ref maintainer;
+			canister::snapshot::string_ref depiction;
+			canister::snapshot::string_ref native_depiction;
+			canister::snapshot::string_ref header;
+			canister::snapshot::string_ref icon;
+			canister::snapshot::string_ref section;
+			canister::snapshot::string_ref tag;
+			canister::snapshot::string_ref installed_size;
+			canister::snapshot::string_ref size;
+			canister::snapshot::string_ref depends;
+			canister::snapshot::string_ref pre_depends;
+			canister::snapshot::string_ref conflicts;
+			canister::snapshot::string_ref provides;
+			canister::snapshot::string_ref replaces;
+			canister::hash::digest fingerprint;
+			std::uint32_t has_fingerprint;
+		};
+
+		std::string path();
+		void write();
+		void load();
+	}
+
+	namespace scheduler {
+		struct repository_schedule {
+			std::chrono::seconds interval;
+			std::chrono::steady_clock::time_point next_refresh;
+		};
+
+		// How the manifest changed since the one that was applied last
+		struct manifest_diff {
+			std::vector<canister::parser::repo_manifest> added;
+			std::vector<canister::parser::repo_manifest> removed;
+			std::vector<canister::parser::repo_manifest> moved; // The URI, dist or suite changed
+			std::vector<canister::parser::repo_manifest> reranked; // Only the ranking or aliases changed
+		};
+
+		void start();
+		void run();
+		void request_refresh();
+		void refresh_all();
+		void tick();
+		std::optional<std::vector<canister::parser::repo_manifest>> current_manifests(std::function<void(const std::string &)> report);
+		canister::scheduler::manifest_diff diff(const std::map<std::string, canister::parser::repo_manifest> &previous, const std::vector<canister::parser::repo_manifest> &current);
+		void apply(const canister::scheduler::manifest_diff &changes);
+		std::vector<canister::parser::repo_manifest> due(const std::vector<canister::parser::repo_manifest> &manifests);
+		void record(const canister::pipeline::summary &summary);
 	}
 }
@@ -1,12 +1,25 @@
 #include <canister.h>
 
 int main() {
+	// Nothing has read a setting yet, so a bad one stops the core before it touches the database or the network
+	try {
+		canister::config::load();
+	} catch (std::exception &exc) {
+		canister::log::error("config", exc.what());
+		return 1;
+	}
+
 	const auto connection = std::getenv("DB_CONN");
 	if (!connection) {
 		canister::log::error("db", "connection string DB_CONN not set");
 		return 1;
 	}
 
+	if (!std::getenv("GATEWAY_BEARER")) {
+		canister::log::error("http", "env 'GATEWAY_BEARER' not set");
+		return 1;
+	}
+
 	// Database Migrations
 	canister::db::bootstrap();
 
@@ -15,16 +28,28 @@ int main() {
 	sentry_init(options);
 
 	// This directory is used for cache
-	if (!std::filesystem::is_directory("/tmp/canister") || !std::filesystem::exists("/tmp/canister")) {
-		std::filesystem::create_directory("/tmp/canister");
-	}
+	std::filesystem::create_directories(canister::config::get().cache_path);
 
-	try {
-		auto server = canister::http::http_server();
-		server.run();
-	} catch (std::exception &exc) {
-		canister::log::error("http", exc.what());
+	// Whatever was parsed before the last shutdown is served right away and unchanged repositories skip their first refresh
+	canister::snapshot::load();
+	canister::graph::rebuild();
+	canister::responses::warm();
+
+	// Refreshes fetch from several threads, so curl's global state has to exist before any of them start
+	curlpp::Cleanup curl_cleanup;
+
+	// The port is bound before any background thread starts, so a failed bind can still exit cleanly
+	if (!canister::http::start()) {
+		sentry_close();
+		return 1;
 	}
 
+	// Package files are downloaded in the background as refreshes find them
+	canister::deb::start();
+
+	// The coordinator owns every refresh and the database, the HTTP workers only ever read
+	canister::scheduler::start();
+	canister::http::wait();
+
 	sentry_close();
 }
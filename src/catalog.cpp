@@ -0,0 +1,561 @@
+#include <canister.h>
+
+// Readers share the lock, a refresh takes it exclusively to swap in one repository at a time
+std::shared_mutex catalog_mutex;
+std::unordered_map<std::string, std::shared_ptr<const canister::catalog::repository>> catalog_repositories;
+std::unordered_map<std::string, canister::catalog::package> catalog_packages;
+std::unordered_map<std::string, std::vector<std::string>> catalog_hosts;
+
+namespace {
+	nlohmann::json vpackage_json(const canister::catalog::vpackage &vpackage) {
+		return nlohmann::json({
+			{ "uuid", vpackage.uuid },
+			{ "package", vpackage.package },
+			{ "repo", vpackage.repo },
+			{ "version", vpackage.version },
+			{ "architecture", vpackage.architecture },
+			{ "filename", vpackage.filename },
+			{ "sha_256", vpackage.sha_256 },
+			{ "name", vpackage.name },
+			{ "description", vpackage.description },
+			{ "author", vpackage.author },
+			{ "maintainer", vpackage.maintainer },
+			{ "depiction", vpackage.depiction },
+			{ "native_depiction", vpackage.native_depiction },
+			{ "header", vpackage.header },
+			{ "icon", vpackage.icon },
+			{ "section", vpackage.section },
+			{ "tag", vpackage.tag },
+			{ "installed_size", vpackage.installed_size },
+			{ "size", vpackage.size },
+			{ "depends", vpackage.depends },
+			{ "pre_depends", vpackage.pre_depends },
+			{ "conflicts", vpackage.conflicts },
+			{ "provides", vpackage.provides },
+			{ "replaces", vpackage.replaces },
+		});
+	}
+
+	nlohmann::json repository_object(const canister::catalog::repository &data) {
+		return nlohmann::json({
+			{ "slug", data.slug },
+			{ "aliases", data.aliases },
+			{ "ranking", data.ranking },
+			{ "package_count", data.packages.size() },
+			{ "sections", data.sections },
+			{ "uri", data.uri },
+			{ "dist", data.dist },
+			{ "suite", data.suite },
+			{ "name", data.name },
+			{ "version", data.version },
+			{ "description", data.description },
+			{ "date", data.date },
+			{ "payment_gateway", data.payment_gateway },
+			{ "sileo_endpoint", data.sileo_endpoint },
+		});
+	}
+
+	// A package changed when its versions or their hashes in this repository aren't the same anymore
+	std::vector<std::pair<std::string_view, std::string_view>> signature(const canister::catalog::repository &repository, const std::vector<std::size_t> &indexes) {
+		std::vector<std::pair<std::string_view, std::string_view>> result;
+		for (auto index : indexes) {
+			result.emplace_back(repository.packages[index].uuid, repository.packages[index].sha_256);
+		}
+
+		std::sort(result.begin(), result.end());
+		return result;
+	}
+
+	// Must be called with the exclusive lock held, after every touched package was rebuilt
+	std::optional<std::string> changes_json(const canister::catalog::repository *previous, const canister::catalog::repository &current, const std::vector<std::string> &touched, const std::unordered_map<std::string, std::string> &previous_current) {
+		auto added = nlohmann::json::array();
+		auto updated = nlohmann::json::array();
+		auto removed = nlohmann::json::array();
+		auto flipped = nlohmann::json::array();
+
+		for (auto &id : touched) {
+			auto before = previous ? previous->package_indexes.find(id) : current.package_indexes.end();
+			auto after = current.package_indexes.find(id);
+			auto existed = previous && before != previous->package_indexes.end();
+			auto exists = after != current.package_indexes.end();
+
+			if (!existed && exists) {
+				added.push_back(id);
+			} else if (existed && !exists) {
+				removed.push_back(id);
+			} else if (existed && exists && signature(*previous, before->second) != signature(current, after->second)) {
+				updated.push_back(id);
+			}
+
+			// Flips can come from a version in another repository losing to this one, or the other way around
+			auto old_current = previous_current.find(id);
+			auto package = catalog_packages.find(id);
+			auto from = old_current == previous_current.end() ? nlohmann::json() : nlohmann::json(old_current->second);
+			auto to = package == catalog_packages.end() ? nlohmann::json() : nlohmann::json(package->second.current->uuid);
+
+			if (from != to) {
+				flipped.push_back({
+					{ "package", id },
+					{ "from", from },
+					{ "to", to },
+				});
+			}
+		}
+
+		if (added.empty() && updated.empty() && removed.empty() && flipped.empty()) {
+			return std::nullopt;
+		}
+
+		auto json = nlohmann::json({
+			{ "type", "changes" },
+			{ "repo", current.slug },
+			{ "added", added },
+			{ "updated", updated },
+			{ "removed", removed },
+			{ "current", flipped },
+			{ "timestamp", canister::util::timestamp() },
+		});
+
+		return json.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+	}
+
+	// Must be called with the exclusive lock held
+	void rebuild_package(const std::string &id) {
+		auto hosts = catalog_hosts.find(id);
+		if (hosts == catalog_hosts.end() || hosts->second.empty()) {
+			catalog_hosts.erase(id);
+			catalog_packages.erase(id);
+			canister::search::remove_document(id);
+			return;
+		}
+
+		canister::catalog::package package;
+		package.id = id;
+		const canister::catalog::repository *owner = nullptr;
+
+		std::unordered_map<canister::hash::digest, std::size_t, canister::hash::digest_hasher> builds;
+		std::vector<std::int8_t> rankings;
+
+		for (auto &slug : hosts->second) {
+			auto &repository = catalog_repositories.at(slug);
+
+			// Lower ranking is better
+			if (!owner || repository->ranking < owner->ranking) {
+				owner = repository.get();
+			}
+
+			for (auto index : repository->package_indexes.at(id)) {
+				auto &vpackage = repository->packages[index];
+
+				// A build that's already listed only adds a mirror, and takes over if its repository ranks better
+				if (vpackage.fingerprint.has_value()) {
+					auto [build, inserted] = builds.try_emplace(vpackage.fingerprint.value(), package.versions.size());
+					if (!inserted) {
+						package.mirrors[build->second].push_back(&vpackage);
+						if (repository->ranking < rankings[build->second]) {
+							package.versions[build->second] = &vpackage;
+							rankings[build->second] = repository->ranking;
+						}
+
+						continue;
+					}
+				}
+
+				package.versions.push_back(&vpackage);
+				package.mirrors.push_back({ &vpackage });
+				rankings.push_back(repository->ranking);
+			}
+		}
+
+		for (size_t index = 0; index < package.versions.size(); index++) {
+			auto &mirrors = package.mirrors[index];
+			std::stable_sort(mirrors.begin(), mirrors.end(), [](auto *left, auto *right) {
+				return catalog_repositories.at(left->repo)->ranking < catalog_repositories.at(right->repo)->ranking;
+			});
+
+			// When it's equal to a value of one that means the first argument is a greater version
+			auto vpackage = package.versions[index];
+			if (!package.current || canister::dpkg::compare(vpackage->version, package.current->version) > 0) {
+				package.current = vpackage;
+			}
+		}
+
+		package.repo = owner->slug;
+		package.ranking = owner->ranking;
+		package.price = owner->packages[owner->package_indexes.at(id).front()].price;
+		auto [entry, inserted] = catalog_packages.insert_or_assign(id, std::move(package));
+
+		// The search index only ever sees the current version, so it's updated alongside the catalog
+		canister::search::update_document(entry->second);
+	}
+}
+
+std::shared_ptr<const canister::catalog::repository> canister::catalog::from_job(canister::pipeline::repository_job &job) {
+	auto repository = std::make_shared<canister::catalog::repository>();
+	auto &manifest = job.manifest;
+
+	auto release_value = [&job](const std::string &key) {
+		auto value = job.release.find(key);
+		return value == job.release.end() ? std::string() : value->second;
+	};
+
+	repository->slug = manifest.slug;
+	repository->aliases = manifest.aliases;
+	repository->ranking = manifest.ranking;
+	repository->sections = job.packages_info.sections;
+	repository->uri = manifest.uri;
+	repository->dist = manifest.dist;
+	repository->suite = manifest.suite;
+	repository->name = release_value("Name");
+	repository->version = release_value("Version");
+	repository->description = release_value("Description");
+	repository->date = release_value("Date");
+	repository->payment_gateway = release_value("Payment-Gateway");
+	repository->sileo_endpoint = job.sileo_endpoint;
+	repository->packages_size = job.packages_file.view().size();
+	repository->packages_modified = job.packages_file.modified();
+	repository->packages.reserve(job.packages_info.data.size());
+
+	for (size_t index = 0; index < job.packages_info.data.size(); index++) {
+		auto &package_map = job.packages_info.data[index];
+
+		// The parsed stanzas are views into the refresh's arenas, so everything is copied out here
+		auto field = [&package_map](std::string_view key) {
+			auto value = package_map.find(key);
+			return value == package_map.end() ? std::string() : std::string(value->second);
+		};
+
+		auto id = field("Package");
+		if (id.empty()) {
+			continue;
+		}
+
+		repository->package_indexes[id].push_back(repository->packages.size());
+		repository->packages.push_back({
+			.uuid = id + "$$" + field("Version") + "$$" + manifest.slug,
+			.package = id,
+			.repo = manifest.slug,
+			.price = index < job.prices.size() ? job.prices[index] : "Free",
+			.version = field("Version"),
+			.architecture = field("Architecture"),
+			.filename = field("Filename"),
+			.sha_256 = field("SHA256"),
+			.name = field("Name"),
+			.description = field("Description"),
+			.author = field("Author"),
+			.maintainer = field("Maintainer"),
+			.depiction = field("Depiction"),
+			.native_depiction = field("SileoDepiction"),
+			.header = field("Header"),
+			.icon = field("Icon"),
+			.section = field("Section"),
+			.tag = field("Tag"),
+			.installed_size = field("Installed-Size"),
+			.size = field("Size"),
+			.depends = field("Depends"),
+			.pre_depends = field("Pre-Depends"),
+			.conflicts = field("Conflicts"),
+			.provides = field("Provides"),
+			.replaces = field("Replaces"),
+			.fingerprint = index < job.fingerprints.size() ? job.fingerprints[index] : canister::hash::fingerprint(field("SHA256"), field("Size"), field("Version")),
+		});
+	}
+
+	return repository;
+}
+
+void canister::catalog::update_repository(std::shared_ptr<const canister::catalog::repository> repository) {
+	std::unique_lock lock(catalog_mutex);
+	std::vector<std::string> touched;
+	std::shared_ptr<const canister::catalog::repository> replaced;
+
+	// Every package the repository hosted before or hosts now needs its versions and owner rebuilt
+	auto previous = catalog_repositories.find(repository->slug);
+	if (previous != catalog_repositories.end()) {
+		replaced = previous->second;
+		for (auto &[id, indexes] : previous->second->package_indexes) {
+			auto &hosts = catalog_hosts[id];
+			hosts.erase(std::remove(hosts.begin(), hosts.end(), repository->slug), hosts.end());
+			touched.push_back(id);
+		}
+	}
+
+	for (auto &[id, indexes] : repository->package_indexes) {
+		catalog_hosts[id].push_back(repository->slug);
+		touched.push_back(id);
+	}
+
+	std::sort(touched.begin(), touched.end());
+	touched.erase(std::unique(touched.begin(), touched.end()), touched.end());
+
+	// Current versions are remembered so the change feed can tell which ones flipped
+	std::unordered_map<std::string, std::string> previous_current;
+	for (auto &id : touched) {
+		auto package = catalog_packages.find(id);
+		if (package != catalog_packages.end()) {
+			previous_current.emplace(id, package->second.current->uuid);
+		}
+	}
+
+	auto slug = repository->slug;
+	catalog_repositories.insert_or_assign(slug, repository);
+
+	for (auto &id : touched) {
+		rebuild_package(id);
+	}
+
+	auto changes = changes_json(replaced.get(), *repository, touched, previous_current);
+
+	// Cached responses were rendered from the old repository, they're dropped once the new one is readable
+	lock.unlock();
+	canister::responses::invalidate();
+
+	if (changes.has_value()) {
+		canister::http::broadcast("changes", changes.value());
+	}
+}
+
+std::vector<std::string> canister::catalog::remove_repository(const std::string &slug) {
+	std::unique_lock lock(catalog_mutex);
+	auto previous = catalog_repositories.find(slug);
+	if (previous == catalog_repositories.end()) {
+		return {};
+	}
+
+	auto replaced = previous->second;
+	std::vector<std::string> touched;
+	std::unordered_map<std::string, std::string> previous_current;
+
+	for (auto &[id, indexes] : replaced->package_indexes) {
+		auto &hosts = catalog_hosts[id];
+		hosts.erase(std::remove(hosts.begin(), hosts.end(), slug), hosts.end());
+		touched.push_back(id);
+
+		auto package = catalog_packages.find(id);
+		if (package != catalog_packages.end()) {
+			previous_current.emplace(id, package->second.current->uuid);
+		}
+	}
+
+	catalog_repositories.erase(previous);
+	for (auto &id : touched) {
+		rebuild_package(id);
+	}
+
+	// An empty repository under the same slug makes the change feed list every package it hosted as removed
+	canister::catalog::repository empty;
+	empty.slug = slug;
+	auto changes = changes_json(replaced.get(), empty, touched, previous_current);
+
+	lock.unlock();
+	canister::responses::invalidate();
+
+	if (changes.has_value()) {
+		canister::http::broadcast("changes", changes.value());
+	}
+
+	return touched;
+}
+
+void canister::catalog::rerank_repository(const std::string &slug, std::int8_t ranking, const std::vector<std::string> &aliases) {
+	std::shared_ptr<const canister::catalog::repository> existing;
+
+	{
+		std::shared_lock lock(catalog_mutex);
+		auto repository = catalog_repositories.find(slug);
+		if (repository == catalog_repositories.end()) {
+			return;
+		}
+
+		existing = repository->second;
+	}
+
+	// Repositories are immutable once published, so the copy is swapped in like any other refresh
+	auto repository = std::make_shared<canister::catalog::repository>(*existing);
+	repository->ranking = ranking;
+	repository->aliases = aliases;
+	canister::catalog::update_repository(repository);
+}
+
+bool canister::catalog::contains_repository(const std::string &slug) {
+	std::shared_lock lock(catalog_mutex);
+	return catalog_repositories.contains(slug);
+}
+
+std::vector<std::shared_ptr<const canister::catalog::repository>> canister::catalog::repositories() {
+	std::shared_lock lock(catalog_mutex);
+	std::vector<std::shared_ptr<const canister::catalog::repository>> result;
+
+	for (auto &[slug, repository] : catalog_repositories) {
+		result.push_back(repository);
+	}
+
+	return result;
+}
+
+std::optional<canister::catalog::vpackage> canister::catalog::current_vpackage(const std::string &id) {
+	std::shared_lock lock(catalog_mutex);
+
+	auto package = catalog_packages.find(id);
+	if (package == catalog_packages.end()) {
+		return std::nullopt;
+	}
+
+	return *package->second.current;
+}
+
+std::optional<std::string> canister::catalog::package_price(const std::string &slug, const std::string &id) {
+	std::shared_lock lock(catalog_mutex);
+
+	auto repository = catalog_repositories.find(slug);
+	if (repository == catalog_repositories.end()) {
+		return std::nullopt;
+	}
+
+	auto indexes = repository->second->package_indexes.find(id);
+	if (indexes == repository->second->package_indexes.end() || indexes->second.empty()) {
+		return std::nullopt;
+	}
+
+	return repository->second->packages[indexes->second.front()].price;
+}
+
+void canister::catalog::for_each_current(const std::function<void(const canister::catalog::vpackage &)> &callback) {
+	std::shared_lock lock(catalog_mutex);
+
+	for (auto &[id, package] : catalog_packages) {
+		if (package.current != nullptr) {
+			callback(*package.current);
+		}
+	}
+}
+
+std::optional<std::string> canister::catalog::package_json(const std::string &id) {
+	std::shared_lock lock(catalog_mutex);
+
+	auto package = catalog_packages.find(id);
+	if (package == catalog_packages.end()) {
+		return std::nullopt;
+	}
+
+	auto versions = nlohmann::json::array();
+	for (size_t index = 0; index < package->second.versions.size(); index++) {
+		auto vpackage = package->second.versions[index];
+
+		// Mirrors are ordered best ranked first, which is also the copy the version itself points at
+		auto mirrors = nlohmann::json::array();
+		for (auto mirror : package->second.mirrors[index]) {
+			mirrors.push_back({
+				{ "repo", mirror->repo },
+				{ "filename", mirror->filename },
+			});
+		}
+
+		versions.push_back({
+			{ "uuid", vpackage->uuid },
+			{ "repo", vpackage->repo },
+			{ "version", vpackage->version },
+			{ "mirrors", mirrors },
+		});
+	}
+
+	auto json = nlohmann::json({
+		{ "id", package->second.id },
+		{ "repo", package->second.repo },
+		{ "price", package->second.price },
+		{ "current", vpackage_json(*package->second.current) },
+		{ "versions", versions },
+	});
+
+	// Repositories aren't always valid UTF-8, so bad sequences are replaced instead of throwing
+	return json.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+}
+
+std::optional<std::string> canister::catalog::repository_json(const std::string &slug) {
+	std::shared_lock lock(catalog_mutex);
+
+	auto repository = catalog_repositories.find(slug);
+	if (repository == catalog_repositories.end()) {
+		return std::nullopt;
+	}
+
+	return repository_object(*repository->second).dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+}
+
+std::string canister::catalog::repositories_json() {
+	std::shared_lock lock(catalog_mutex);
+	std::vector<const canister::catalog::repository *> repositories;
+
+	for (auto &[slug, repository] : catalog_repositories) {
+		repositories.push_back(repository.get());
+	}
+
+	// Better ranked repositories are listed first
+	std::sort(repositories.begin(), repositories.end(), [](auto left, auto right) {
+		return std::tie(left->ranking, left->slug) < std::tie(right->ranking, right->slug);
+	});
+
+	auto results = nlohmann::json::array();
+	for (auto repository : repositories) {
+		results.push_back(repository_object(*repository));
+	}
+
+	auto json = nlohmann::json({
+		{ "count", results.size() },
+		{ "data", results },
+	});
+
+	return json.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+}
+
+std::string canister::catalog::sections_json() {
+	std::shared_lock lock(catalog_mutex);
+	std::map<std::string, std::size_t> sections;
+
+	// Sections are counted by how many repositories use them
+	for (auto &[slug, repository] : catalog_repositories) {
+		for (auto &section : repository->sections) {
+			sections[section]++;
+		}
+	}
+
+	auto results = nlohmann::json::array();
+	for (auto &[section, count] : sections) {
+		results.push_back({
+			{ "section", section },
+			{ "repositories", count },
+		});
+	}
+
+	auto json = nlohmann::json({
+		{ "count", results.size() },
+		{ "data", results },
+	});
+
+	return json.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+}
+
+std::string canister::catalog::search_json(std::string_view query, std::size_t limit) {
+	// The catalog lock is always taken before the search lock, the same order a refresh takes them in
+	std::shared_lock lock(catalog_mutex);
+	auto results = nlohmann::json::array();
+
+	for (auto &id : canister::search::query(query, limit)) {
+		auto package = catalog_packages.find(id);
+		if (package == catalog_packages.end()) {
+			continue;
+		}
+
+		auto result = vpackage_json(*package->second.current);
+		result["price"] = package->second.price;
+		results.push_back(result);
+	}
+
+	auto json = nlohmann::json({
+		{ "query", query },
+		{ "count", results.size() },
+		{ "data", results },
+	});
+
+	return json.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+}
@@ -0,0 +1,175 @@
+#include <canister.h>
+
+// Loaded once by main before any other thread starts, everything after that only reads it
+canister::config::settings config_current;
+
+namespace {
+	// Types and ranges every setting has to satisfy, whether it came from the file or the environment
+	const nlohmann::json schema = R"({
+		"$schema": "http://json-schema.org/draft-07/schema#",
+		"type": "object",
+		"additionalProperties": false,
+		"properties": {
+			"manifest_url": { "type": "string", "pattern": "^https?://" },
+			"user_agent": { "type": "string", "minLength": 1 },
+			"cache_path": { "type": "string", "minLength": 1 },
+			"port": { "type": "integer", "minimum": 1, "maximum": 65535 },
+			"http_workers": { "type": "integer", "minimum": 0, "maximum": 1024 },
+			"connect_timeout": { "type": "integer", "minimum": 1, "maximum": 300 },
+			"fetch_timeout": { "type": "integer", "minimum": 0, "maximum": 3600 },
+			"sileo_timeout": { "type": "integer", "minimum": 0, "maximum": 3600 },
+			"low_speed_limit": { "type": "integer", "minimum": 0 },
+			"low_speed_time": { "type": "integer", "minimum": 1, "maximum": 3600 },
+			"fetch_attempts": { "type": "integer", "minimum": 1, "maximum": 10 },
+			"fetch_retry_delay": { "type": "integer", "minimum": 0, "maximum": 60000 },
+			"breaker_threshold": { "type": "integer", "minimum": 1, "maximum": 1000 },
+			"breaker_cooldown": { "type": "integer", "minimum": 0, "maximum": 86400 },
+			"host_rate": { "type": "integer", "minimum": 1, "maximum": 10000 },
+			"host_burst": { "type": "integer", "minimum": 1, "maximum": 10000 },
+			"bandwidth_limit": { "type": "integer", "minimum": 0 },
+			"pipeline_fetch_workers": { "type": "integer", "minimum": 1, "maximum": 256 },
+			"pipeline_queue_depth": { "type": "integer", "minimum": 1, "maximum": 4096 },
+			"deb_fetch_workers": { "type": "integer", "minimum": 0, "maximum": 256 },
+			"deb_cache_budget": { "type": "integer", "minimum": 0 },
+			"scheduler_tick": { "type": "integer", "minimum": 1, "maximum": 86400 },
+			"cpu_workers": { "type": "integer", "minimum": 0, "maximum": 1024 }
+		}
+	})"_json;
+
+	// Environment variables are the uppercase setting names, they win over the file
+	const std::vector<std::string> environment_keys = {
+		"manifest_url",
+		"user_agent",
+		"cache_path",
+		"port",
+		"http_workers",
+		"connect_timeout",
+		"fetch_timeout",
+		"sileo_timeout",
+		"low_speed_limit",
+		"low_speed_time",
+		"fetch_attempts",
+		"fetch_retry_delay",
+		"breaker_threshold",
+		"breaker_cooldown",
+		"host_rate",
+		"host_burst",
+		"bandwidth_limit",
+		"pipeline_fetch_workers",
+		"pipeline_queue_depth",
+		"deb_fetch_workers",
+		"deb_cache_budget",
+		"scheduler_tick",
+		"cpu_workers",
+	};
+
+	// Everything in the environment is a string, integers are converted so the schema can range check them
+	nlohmann::json environment_value(const std::string &key, const std::string &value) {
+		auto type = schema["properties"][key]["type"];
+		if (type != "integer") {
+			return value;
+		}
+
+		std::int64_t number;
+		auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), number);
+		if (error != std::errc() || end != value.data() + value.size()) {
+			throw std::runtime_error(key + " must be an integer, got '" + value + "'");
+		}
+
+		return number;
+	}
+
+	class collecting_handler : public nlohmann::json_schema::basic_error_handler {
+	public:
+		void error(const nlohmann::json::json_pointer &pointer, const nlohmann::json &instance, const std::string &message) override {
+			nlohmann::json_schema::basic_error_handler::error(pointer, instance, message);
+			errors.push_back((pointer.empty() ? std::string("config") : pointer.to_string().substr(1)) + ": " + message);
+		}
+
+		std::vector<std::string> errors;
+	};
+}
+
+void canister::config::load() {
+	auto values = nlohmann::json::object();
+
+	// The file is optional, a missing one just means every default is kept
+	const auto file_path = std::getenv("CANISTER_CONFIG");
+	if (file_path) {
+		std::ifstream file(file_path);
+		if (!file.is_open()) {
+			throw std::runtime_error("config: can't open " + std::string(file_path));
+		}
+
+		try {
+			values = nlohmann::json::parse(file);
+		} catch (nlohmann::json::parse_error &exc) {
+			throw std::runtime_error("config: " + std::string(file_path) + " is not valid JSON: " + exc.what());
+		}
+	}
+
+	for (auto &key : environment_keys) {
+		auto name = key;
+		std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+
+		if (auto value = std::getenv(name.c_str())) {
+			try {
+				values[key] = environment_value(key, value);
+			} catch (std::exception &exc) {
+				throw std::runtime_error("config: " + std::string(exc.what()));
+			}
+		}
+	}
+
+	// Every problem is reported at once instead of making whoever deploys fix them one restart at a time
+	nlohmann::json_schema::json_validator validator;
+	validator.set_root_schema(schema);
+
+	collecting_handler handler;
+	validator.validate(values, handler);
+	if (handler) {
+		std::string message = "config: invalid settings";
+		for (auto &error : handler.errors) {
+			message += "\n  " + error;
+		}
+
+		throw std::runtime_error(message);
+	}
+
+	canister::config::settings settings;
+	settings.manifest_url = values.value("manifest_url", settings.manifest_url);
+	settings.user_agent = values.value("user_agent", settings.user_agent);
+	settings.cache_path = values.value("cache_path", settings.cache_path);
+	settings.port = values.value("port", settings.port);
+	settings.http_workers = values.value("http_workers", settings.http_workers);
+	settings.connect_timeout = values.value("connect_timeout", settings.connect_timeout);
+	settings.fetch_timeout = values.value("fetch_timeout", settings.fetch_timeout);
+	settings.sileo_timeout = values.value("sileo_timeout", settings.sileo_timeout);
+	settings.low_speed_limit = values.value("low_speed_limit", settings.low_speed_limit);
+	settings.low_speed_time = values.value("low_speed_time", settings.low_speed_time);
+	settings.fetch_attempts = values.value("fetch_attempts", settings.fetch_attempts);
+	settings.fetch_retry_delay = values.value("fetch_retry_delay", settings.fetch_retry_delay);
+	settings.breaker_threshold = values.value("breaker_threshold", settings.breaker_threshold);
+	settings.breaker_cooldown = values.value("breaker_cooldown", settings.breaker_cooldown);
+	settings.host_rate = values.value("host_rate", settings.host_rate);
+	settings.host_burst = values.value("host_burst", settings.host_burst);
+	settings.bandwidth_limit = values.value("bandwidth_limit", settings.bandwidth_limit);
+	settings.pipeline_fetch_workers = values.value("pipeline_fetch_workers", settings.pipeline_fetch_workers);
+	settings.pipeline_queue_depth = values.value("pipeline_queue_depth", settings.pipeline_queue_depth);
+	settings.deb_fetch_workers = values.value("deb_fetch_workers", settings.deb_fetch_workers);
+	settings.deb_cache_budget = values.value("deb_cache_budget", settings.deb_cache_budget);
+	settings.scheduler_tick = values.value("scheduler_tick", settings.scheduler_tick);
+	settings.cpu_workers = values.value("cpu_workers", settings.cpu_workers);
+
+	// Every cache path is built by appending to this
+	if (!settings.cache_path.ends_with('/')) {
+		settings.cache_path.push_back('/');
+	}
+
+	config_current = std::move(settings);
+	canister::log::info("config", "manifest " + config_current.manifest_url + ", cache " + config_current.cache_path + ", port " + std::to_string(config_current.port));
+}
+
+const canister::config::settings &canister::config::get() {
+	return config_current;
+}
@@ -1,7 +1,86 @@
 #include <canister.h>
 
-// Global Variable Pragma
-auto connection = tao::pq::connection::create(std::getenv("DB_CONN"));
+namespace {
+	// Opened on first use so anything linking the library without touching the database doesn't need one
+	const std::shared_ptr<tao::pq::connection> &connection() {
+		static auto instance = tao::pq::connection::create(std::getenv("DB_CONN"));
+		return instance;
+	}
+
+	// Shared by plain writes and canonical takeovers, which need the insert inside their own transaction
+	const char *vpackage_statement = R""""(
+		INSERT INTO "VPackages" (
+			uuid,
+			package,
+			current_version,
+			version,
+			architecture,
+			filename,
+			sha_256,
+			name,
+			description,
+			author,
+			maintainer,
+			depiction,
+			native_depiction,
+			header,
+			tint_color,
+			icon,
+			section,
+			tag,
+			installed_size,
+			size,
+			fingerprint
+		) VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12, $13, $14, $15, $16, $17, $18, $19, $20, NULLIF($21, ''))
+		ON CONFLICT (uuid) DO UPDATE SET
+			package=$2,
+			current_version=$3,
+			version=$4,
+			architecture=$5,
+			filename=$6,
+			sha_256=$7,
+			name=$8,
+			description=$9,
+			author=$10,
+			maintainer=$11,
+			depiction=$12,
+			native_depiction=$13,
+			header=$14,
+			tint_color=$15,
+			icon=$16,
+			section=$17,
+			tag=$18,
+			installed_size=$19,
+			size=$20,
+			fingerprint=NULLIF($21, '')
+	)"""";
+
+	void insert_vpackage(const std::shared_ptr<tao::pq::transaction> &transaction, const canister::db::vpackage &data) {
+		transaction->execute(
+			vpackage_statement,
+			data.uuid,
+			data.package,
+			data.current_version,
+			data.version,
+			data.architecture,
+			data.filename,
+			data.sha_256,
+			data.name,
+			data.description,
+			data.author,
+			data.maintainer,
+			data.depiction,
+			data.native_depiction,
+			data.header,
+			data.tint_color,
+			data.icon,
+			data.section,
+			data.tag,
+			data.installed_size,
+			data.size,
+			data.fingerprint);
+	}
+}
 
 void canister::db::bootstrap() {
 	auto stream = std::ostringstream();
@@ -19,12 +98,12 @@ void canister::db::bootstrap() {
 	while ((start = contents.find_first_not_of("---", end)) != std::string::npos) {
 		end = contents.find("---", start);
 		auto statement = contents.substr(start, end - start);
-		connection->execute(tao::pq::internal::zsv(statement));
+		connection()->execute(tao::pq::internal::zsv(statement));
 	}
 }
 
-std::optional<std::string> canister::db::package_exists(std::string id) {
-	auto result = connection->execute(R""""(SELECT "repo" FROM "Packages" WHERE "id"=$1)"""", id);
+std::optional<std::string> canister::db::package_exists(std::string_view id) {
+	auto result = connection()->execute(R""""(SELECT "repo" FROM "Packages" WHERE "id"=$1)"""", id);
 	if (result.empty()) {
 		return std::nullopt;
 	} else {
@@ -32,8 +111,8 @@ std::optional<std::string> canister::db::package_exists(std::string id) {
 	}
 }
 
-std::optional<std::string> canister::db::current_vpackage_version(std::string package) {
-	auto result = connection->execute(R""""(SELECT "version" FROM "VPackages" WHERE "package"=$1 AND "current_version"=true)"""", package);
+std::optional<std::string> canister::db::current_vpackage_version(std::string_view package) {
+	auto result = connection()->execute(R""""(SELECT "version" FROM "VPackages" WHERE "package"=$1 AND "current_version"=true)"""", package);
 	if (result.empty()) {
 		return std::nullopt;
 	} else {
@@ -41,29 +120,31 @@ std::optional<std::string> canister::db::current_vpackage_version(std::string pa
 	}
 }
 
-std::int8_t canister::db::repository_ranking(std::string slug) {
-	auto result = connection->execute(R""""(SELECT "ranking" FROM "Repositories" WHERE slug=$1)"""", slug);
-	if (result.empty()) {
-		auto message = "unexpectedly recieved no ranking for slug: " + slug;
-		canister::log::error("db", message);
-		sentry_capture_event(sentry_value_new_message_event(SENTRY_LEVEL_ERROR, "db", message.c_str()));
-		return 6; // This is higher than all rankings, causing it to be ignored where it's called
-	} else {
-		return result[0]["ranking"].as<std::int8_t>();
+std::unordered_map<canister::hash::digest, std::string, canister::hash::digest_hasher> canister::db::fingerprints() {
+	std::unordered_map<canister::hash::digest, std::string, canister::hash::digest_hasher> result;
+	auto rows = connection()->execute(R""""(SELECT "fingerprint", "uuid" FROM "VPackages" WHERE "fingerprint" IS NOT NULL)"""");
+
+	for (auto &row : rows) {
+		auto fingerprint = canister::hash::from_hex(row["fingerprint"].as<std::string>());
+		if (fingerprint.has_value()) {
+			result.emplace(fingerprint.value(), row["uuid"].as<std::string>());
+		}
 	}
+
+	return result;
 }
 
-void canister::db::set_current_vpackage(std::string uuid, std::string package) {
+void canister::db::set_current_vpackage(std::string_view uuid, std::string_view package) {
 	try {
-		connection->execute(R""""(UPDATE "VPackages" SET "current_version"=false WHERE "package"=$1 AND "current_version"=true)"""", package);
-		connection->execute(R""""(UPDATE "VPackages" SET "current_version"=true WHERE "uuid"=$1 AND "package"=$2)"""", uuid, package);
+		connection()->execute(R""""(UPDATE "VPackages" SET "current_version"=false WHERE "package"=$1 AND "current_version"=true)"""", package);
+		connection()->execute(R""""(UPDATE "VPackages" SET "current_version"=true WHERE "uuid"=$1 AND "package"=$2)"""", uuid, package);
 	} catch (std::exception &exc) {
 		canister::log::error("db", exc.what());
 	}
 }
 
 void canister::db::write_package(canister::db::package data) {
-	auto transaction = connection->transaction();
+	auto transaction = connection()->transaction();
 	auto statement = R""""(
 		INSERT INTO "Packages" (
 			id,
@@ -78,7 +159,7 @@ void canister::db::write_package(canister::db::package data) {
 	try {
 		transaction->execute(statement, data.id, data.repo, data.price);
 		transaction->commit();
-		canister::log::info("db", "inserted_package: " + data.id);
+		canister::log::info("db", "inserted_package: " + std::string(data.id));
 	} catch (std::exception &exc) {
 		canister::log::error("db", exc.what());
 		transaction->rollback();
@@ -86,78 +167,72 @@ void canister::db::write_package(canister::db::package data) {
 }
 
 void canister::db::write_vpackage(canister::db::vpackage data) {
-	auto transaction = connection->transaction();
+	auto transaction = connection()->transaction();
+
+	try {
+		insert_vpackage(transaction, data);
+		transaction->commit();
+		canister::log::info("db", "inserted_vpackage: " + std::string(data.package) + ":" + std::string(data.version));
+	} catch (std::exception &exc) {
+		canister::log::error("db", exc.what());
+		transaction->rollback();
+	}
+}
+
+bool canister::db::replace_canonical(canister::db::vpackage data, std::string_view previous) {
+	auto transaction = connection()->transaction();
+
+	try {
+		// The old row gives up the fingerprint and the current flag first since both are unique
+		auto released = transaction->execute(R""""(
+			UPDATE "VPackages" v SET "fingerprint"=NULL, "current_version"=false
+			FROM (SELECT "uuid", "current_version" FROM "VPackages" WHERE "uuid"=$1) old
+			WHERE v."uuid"=old."uuid"
+			RETURNING old."current_version"
+		)"""", previous);
+
+		data.current_version = !released.empty() && released[0]["current_version"].as<bool>();
+		insert_vpackage(transaction, data);
+
+		// Every mirror follows the build to its new row before the old one can go
+		transaction->execute(R""""(UPDATE "Mirrors" SET "uuid"=$1 WHERE "uuid"=$2)"""", data.uuid, previous);
+		transaction->execute(R""""(DELETE FROM "VPackages" WHERE "uuid"=$1)"""", previous);
+		transaction->commit();
+
+		canister::log::info("db", "replaced_canonical: " + std::string(previous) + " -> " + std::string(data.uuid));
+		return true;
+	} catch (std::exception &exc) {
+		canister::log::error("db", exc.what());
+		transaction->rollback();
+		return false;
+	}
+}
+
+void canister::db::prune_mirrors(std::string_view slug, const std::vector<std::string> &fingerprints) {
+	try {
+		connection()->execute(R""""(DELETE FROM "Mirrors" WHERE "repo"=$1 AND NOT ("fingerprint"=ANY($2)))"""", slug, fingerprints);
+	} catch (std::exception &exc) {
+		canister::log::error("db", exc.what());
+	}
+}
+
+void canister::db::write_mirror(canister::db::mirror data) {
+	auto transaction = connection()->transaction();
 	auto statement = R""""(
-		INSERT INTO "VPackages" (
+		INSERT INTO "Mirrors" (
+			fingerprint,
+			repo,
 			uuid,
-			package,
-			current_version,
-			version,
-			architecture,
-			filename,
-			sha_256,
-			name,
-			description,
-			author,
-			maintainer,
-			depiction,
-			native_depiction,
-			header,
-			tint_color,
-			icon,
-			section,
-			tag,
-			installed_size,
-			size
-		) VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12, $13, $14, $15, $16, $17, $18, $19, $20)
-		ON CONFLICT (uuid) DO UPDATE SET
-			package=$2,
-			current_version=$3,
-			version=$4,
-			architecture=$5,
-			filename=$6,
-			sha_256=$7,
-			name=$8,
-			description=$9,
-			author=$10,
-			maintainer=$11,
-			depiction=$12,
-			native_depiction=$13,
-			header=$14,
-			tint_color=$15,
-			icon=$16,
-			section=$17,
-			tag=$18,
-			installed_size=$19,
-			size=$20
+			filename
+		) VALUES ($1, $2, $3, $4)
+		ON CONFLICT (fingerprint, repo) DO UPDATE SET
+			uuid=$3,
+			filename=$4
 	)"""";
 
 	try {
-		transaction->execute(
-			statement,
-			data.uuid,
-			data.package,
-			data.current_version,
-			data.version,
-			data.architecture,
-			data.filename,
-			data.sha_256,
-			data.name,
-			data.description,
-			data.author,
-			data.maintainer,
-			data.depiction,
-			data.native_depiction,
-			data.header,
-			data.tint_color,
-			data.icon,
-			data.section,
-			data.tag,
-			data.installed_size,
-			data.size);
-
+		transaction->execute(statement, data.fingerprint, data.repo, data.uuid, data.filename);
 		transaction->commit();
-		canister::log::info("db", "inserted_vpackage: " + data.package + ":" + data.version);
 	} catch (std::exception &exc) {
 		canister::log::error("db", exc.what());
 		transaction->rollback();
@@ -165,7 +240,7 @@ void canister::db::write_vpackage(canister::db::vpackage data) {
 }
 
 void canister::db::write_repository(canister::db::repository data) {
-	auto transaction = connection->transaction();
+	auto transaction = connection()->transaction();
 	auto statement = R""""(
 		INSERT INTO "Repositories" (
 			slug,
@@ -224,3 +299,162 @@ void canister::db::write_repository(canister::db::repository data) {
 		transaction->rollback();
 	}
 }
+
+void canister::db::update_repository_ranking(std::string_view slug, std::int8_t ranking, const std::vector<std::string> &aliases) {
+	try {
+		connection()->execute(R""""(UPDATE "Repositories" SET "ranking"=$2, "aliases"=$3 WHERE "slug"=$1)"""", slug, ranking, aliases);
+	} catch (std::exception &exc) {
+		canister::log::error("db", exc.what());
+	}
+}
+
+std::optional<std::vector<canister::db::repository>> canister::db::repositories() {
+	try {
+		std::vector<canister::db::repository> result;
+		auto rows = connection()->execute(R""""(SELECT "slug", "aliases", "ranking", "uri", "dist", "suite" FROM "Repositories")"""");
+
+		for (auto &row : rows) {
+			canister::db::repository repository {};
+			repository.slug = row["slug"].as<std::string>();
+			repository.aliases = row["aliases"].as<std::vector<std::string>>();
+			repository.ranking = static_cast<std::int8_t>(row["ranking"].as<std::int16_t>());
+			repository.uri = row["uri"].as<std::string>();
+			repository.dist = row["dist"].is_null() ? "" : row["dist"].as<std::string>();
+			repository.suite = row["suite"].is_null() ? "" : row["suite"].as<std::string>();
+			result.push_back(std::move(repository));
+		}
+
+		return result;
+	} catch (std::exception &exc) {
+		canister::log::error("db", exc.what());
+		return std::nullopt;
+	}
+}
+
+std::size_t canister::db::reconcile_owners(const std::vector<std::string> &slugs, const std::function<std::optional<std::string>(const std::string &, const std::string &)> &price) {
+	// Every repository hosting a version or a mirror of a package competes for it, lower ranking is better
+	// Ties stay with the repository that already owns the package, which is what the old per package check did
+	auto statement = R""""(
+		WITH affected AS (
+			SELECT v."package" FROM "VPackages" v WHERE split_part(v."uuid", '$$', 3)=ANY($1)
+			UNION
+			SELECT v."package" FROM "Mirrors" m JOIN "VPackages" v ON v."uuid"=m."uuid" WHERE m."repo"=ANY($1)
+		), hosts AS (
+			SELECT v."package", split_part(v."uuid", '$$', 3) AS "repo" FROM "VPackages" v JOIN affected a ON a."package"=v."package"
+			UNION
+			SELECT v."package", m."repo" FROM "Mirrors" m JOIN "VPackages" v ON v."uuid"=m."uuid" JOIN affected a ON a."package"=v."package"
+		), owners AS (
+			SELECT DISTINCT ON (h."package") h."package", h."repo"
+			FROM hosts h
+			JOIN "Repositories" r ON r."slug"=h."repo"
+			JOIN "Packages" p ON p."id"=h."package"
+			ORDER BY h."package", r."ranking", (h."repo"=p."repo") DESC, h."repo"
+		)
+		UPDATE "Packages" SET "repo"=owners."repo" FROM owners
+		WHERE "Packages"."id"=owners."package" AND "Packages"."repo"<>owners."repo"
+		RETURNING "Packages"."id", "Packages"."repo"
+	)"""";
+
+	auto transaction = connection()->transaction();
+	std::size_t reassigned = 0;
+
+	try {
+		auto result = transaction->execute(statement, slugs);
+		reassigned = result.size();
+
+		// Prices belong to the hosting repository, so the new owners' prices are written in one more pass
+		std::vector<std::string> ids, prices;
+		for (auto &row : result) {
+			auto id = row["id"].as<std::string>();
+			auto value = price(row["repo"].as<std::string>(), id);
+			if (value.has_value()) {
+				ids.push_back(std::move(id));
+				prices.push_back(std::move(value.value()));
+			}
+		}
+
+		if (!ids.empty()) {
+			transaction->execute(R""""(
+				UPDATE "Packages" SET "price"=c."price"
+				FROM unnest($1::TEXT[], $2::TEXT[]) AS c("id", "price")
+				WHERE "Packages"."id"=c."id"
+			)"""", ids, prices);
+		}
+
+		transaction->commit();
+	} catch (std::exception &exc) {
+		canister::log::error("db", exc.what());
+		transaction->rollback();
+		return 0;
+	}
+
+	if (reassigned > 0) {
+		canister::log::info("db", "reassigned " + std::to_string(reassigned) + " packages");
+	}
+
+	return reassigned;
+}
+
+std::vector<std::string> canister::db::prune_repositories(const std::vector<std::string> &slugs, const std::vector<canister::db::current_version> &currents) {
+	std::vector<std::string> packages, uuids, fingerprints;
+	for (auto &current : currents) {
+		packages.push_back(current.package);
+		uuids.push_back(current.uuid);
+		fingerprints.push_back(current.fingerprint);
+	}
+
+	// The uuid of every VPackage ends with the slug of the repository that hosts it
+	auto transaction = connection()->transaction();
+	std::vector<std::string> orphaned;
+
+	try {
+		// Mirrors of builds whose only row is going away leave their repository without that build
+		auto mirrors = transaction->execute(R""""(DELETE FROM "Mirrors" WHERE "repo"=ANY($1) OR split_part("uuid", '$$', 3)=ANY($1) RETURNING "repo")"""", slugs);
+		for (auto &row : mirrors) {
+			auto repo = row["repo"].as<std::string>();
+			if (std::find(slugs.begin(), slugs.end(), repo) == slugs.end() && std::find(orphaned.begin(), orphaned.end(), repo) == orphaned.end()) {
+				orphaned.push_back(repo);
+			}
+		}
+
+		auto vpackages = transaction->execute(R""""(DELETE FROM "VPackages" WHERE split_part("uuid", '$$', 3)=ANY($1))"""", slugs).rows_affected();
+
+		// Packages still hosted elsewhere move to the best ranked of those repositories, the rest go away
+		transaction->execute(R""""(
+			UPDATE "Packages" SET "repo"=owners."repo" FROM (
+				SELECT DISTINCT ON (v."package") v."package", r."slug" AS "repo"
+				FROM "VPackages" v
+				JOIN "Repositories" r ON r."slug"=split_part(v."uuid", '$$', 3)
+				WHERE v."package" IN (SELECT "id" FROM "Packages" WHERE "repo"=ANY($1))
+				ORDER BY v."package", r."ranking", r."slug"
+			) owners
+			WHERE "Packages"."id"=owners."package"
+		)"""", slugs);
+
+		auto removed = transaction->execute(R""""(DELETE FROM "Packages" WHERE "repo"=ANY($1))"""", slugs).rows_affected();
+		transaction->execute(R""""(DELETE FROM "Repositories" WHERE "slug"=ANY($1))"""", slugs);
+
+		// Packages that lost their current version get the one the catalog picked, found by uuid or by its fingerprint
+		// Anything the catalog couldn't place still gets a current row, otherwise later refreshes would skip the package
+		transaction->execute(R""""(
+			UPDATE "VPackages" SET "current_version"=true WHERE "uuid" IN (
+				SELECT DISTINCT ON (v."package") v."uuid"
+				FROM "VPackages" v
+				LEFT JOIN unnest($1::TEXT[], $2::TEXT[], $3::TEXT[]) AS c("package", "uuid", "fingerprint") ON c."package"=v."package"
+				WHERE v."package"=ANY($1) AND NOT EXISTS (
+					SELECT 1 FROM "VPackages" w WHERE w."package"=v."package" AND w."current_version"
+				)
+				ORDER BY v."package", (v."uuid"=c."uuid") DESC NULLS LAST, (v."fingerprint"=NULLIF(c."fingerprint", '')) DESC NULLS LAST, v."uuid"
+			)
+		)"""", packages, uuids, fingerprints);
+
+		transaction->commit();
+		canister::log::info("db", "pruned " + std::to_string(slugs.size()) + " repositories: " + std::to_string(removed) + " packages, " + std::to_string(vpackages) + " vpackages");
+	} catch (std::exception &exc) {
+		canister::log::error("db", exc.what());
+		transaction->rollback();
+		return {};
+	}
+
+	return orphaned;
+}
@@ -0,0 +1,529 @@
+#include <canister.h>
+
+// Debs are stored by their SHA256, so a file mirrored by several repositories is only kept once
+// The front of the list is the most recently used file and eviction starts from the back
+std::mutex store_mutex;
+std::once_flag store_scanned;
+std::list<std::string> store_lru;
+std::unordered_map<std::string, std::pair<std::list<std::string>::iterator, std::uint64_t>> store_entries;
+std::uint64_t store_bytes = 0;
+
+// Hashes stay in the queued set until their download finishes so nothing is fetched twice at once
+std::mutex downloads_mutex;
+std::condition_variable downloads_wake;
+std::deque<canister::deb::download> downloads_queue;
+std::unordered_set<std::string> downloads_queued;
+
+namespace {
+	std::uint64_t budget() {
+		return canister::config::get().deb_cache_budget;
+	}
+
+	bool valid_hash(std::string_view sha_256) {
+		return sha_256.size() == 64 && std::all_of(sha_256.begin(), sha_256.end(), [](char character) {
+			return std::isxdigit(static_cast<unsigned char>(character)) && !std::isupper(static_cast<unsigned char>(character));
+		});
+	}
+
+	// Rebuilds the index from disk, files keep their last access as their modification time
+	void scan_store() {
+		auto root = canister::util::cache_path() + "debs";
+		std::filesystem::create_directories(root);
+		std::vector<std::tuple<std::filesystem::file_time_type, std::string, std::uint64_t>> files;
+
+		for (auto &entry : std::filesystem::recursive_directory_iterator(root)) {
+			if (!entry.is_regular_file()) {
+				continue;
+			}
+
+			auto name = entry.path().filename().string();
+
+			// Leftovers from a download that was interrupted by a restart
+			if (!valid_hash(name)) {
+				std::filesystem::remove(entry.path());
+				continue;
+			}
+
+			files.emplace_back(entry.last_write_time(), name, entry.file_size());
+		}
+
+		std::sort(files.begin(), files.end(), [](auto &left, auto &right) {
+			return std::get<0>(left) > std::get<0>(right);
+		});
+
+		std::lock_guard lock(store_mutex);
+		for (auto &[time, name, size] : files) {
+			store_lru.push_back(name);
+			store_entries.emplace(name, std::make_pair(std::prev(store_lru.end()), size));
+			store_bytes += size;
+		}
+
+		canister::log::info("deb", "cache holds " + std::to_string(files.size()) + " files (" + std::to_string(store_bytes) + " bytes)");
+	}
+
+	// Must be called with the store lock held
+	void evict() {
+		while (store_bytes > budget() && !store_lru.empty()) {
+			auto sha_256 = store_lru.back();
+			std::error_code error;
+			std::filesystem::remove(canister::deb::store_path(sha_256), error);
+
+			store_bytes -= store_entries.at(sha_256).second;
+			store_entries.erase(sha_256);
+			store_lru.pop_back();
+		}
+	}
+
+	void admit(const std::string &sha_256, std::uint64_t size) {
+		std::lock_guard lock(store_mutex);
+		if (store_entries.contains(sha_256)) {
+			return;
+		}
+
+		store_lru.push_front(sha_256);
+		store_entries.emplace(sha_256, std::make_pair(store_lru.begin(), size));
+		store_bytes += size;
+		evict();
+	}
+
+	// Writes one byte range of the download into its place in the file, so parts can land in any order
+	bool fetch_range(const std::string &url, int descriptor, std::uint64_t first, std::uint64_t last, bool ranged) {
+		// Every attempt writes from the start of its range again, so a retry overwrites whatever the last one left
+		// Caching debs is the least urgent thing core downloads, it only gets what the repository refresh leaves over
+		auto priority = canister::http::priority { .kind = canister::http::traffic::deb };
+		return canister::http::with_policy(url, priority, [&]() {
+			curlpp::Easy request;
+			std::uint64_t offset = first;
+			bool failed = false;
+
+			canister::http::apply_policy(request, 0);
+			request.setOpt(new curlpp::options::Url(url));
+			request.setOpt(new curlpp::options::HttpHeader(canister::http::headers()));
+			request.setOpt(new curlpp::options::FollowLocation(true));
+
+			if (ranged) {
+				request.setOpt(new curlpp::options::Range(std::to_string(first) + "-" + std::to_string(last)));
+			}
+
+			request.setOpt(new curlpp::options::WriteFunction([descriptor, &offset, &failed, &priority](char *data, size_t size, size_t count) -> size_t {
+				auto length = size * count;
+				canister::http::throttle(length, priority.kind);
+				if (pwrite(descriptor, data, length, static_cast<off_t>(offset)) != static_cast<ssize_t>(length)) {
+					failed = true;
+					return 0;
+				}
+
+				offset += length;
+				return length;
+			}));
+
+			// A failed write aborts the transfer, the disk isn't going to recover on a retry
+			try {
+				request.perform();
+			} catch (curlpp::RuntimeError &) {
+				if (failed) {
+					return canister::http::attempt::fail;
+				}
+
+				throw;
+			}
+
+			// A server that ignores the range answers with the whole file, which would corrupt the other parts
+			auto http_code = curlpp::infos::ResponseCode::get(request);
+			if (failed || http_code != (ranged ? 206 : 200)) {
+				return http_code >= 400 ? canister::http::classify(http_code) : canister::http::attempt::fail;
+			}
+
+			if (ranged && offset != last + 1) {
+				return canister::http::attempt::retry;
+			}
+
+			return canister::http::attempt::success;
+		});
+	}
+
+	// Tar is a run of 512 byte headers each followed by its data padded out to 512 bytes
+	// It's read as it streams out of the decompressor so the archive is never held in full
+	class tar_reader {
+	public:
+		bool feed(std::string_view chunk) {
+			while (!chunk.empty()) {
+				if (remaining > 0) {
+					auto take = std::min<std::uint64_t>(remaining, chunk.size());
+					if (capturing) {
+						control.append(chunk.substr(0, take));
+					}
+
+					remaining -= take;
+					chunk.remove_prefix(take);
+
+					if (remaining == 0 && capturing) {
+						capturing = false;
+						control_found = true;
+					}
+
+					continue;
+				}
+
+				if (padding > 0) {
+					auto take = std::min<std::uint64_t>(padding, chunk.size());
+					padding -= take;
+					chunk.remove_prefix(take);
+					continue;
+				}
+
+				auto take = std::min(512 - header.size(), chunk.size());
+				header.append(chunk.substr(0, take));
+				chunk.remove_prefix(take);
+
+				if (header.size() < 512) {
+					continue;
+				}
+
+				// An empty header is the end of the archive
+				if (header.find_first_not_of('\0') == std::string::npos) {
+					return false;
+				}
+
+				read_header();
+				header.clear();
+			}
+
+			return true;
+		}
+
+		std::string control;
+		bool control_found = false;
+		std::vector<std::string> scripts;
+
+	private:
+		void read_header() {
+			auto field = [this](size_t offset, size_t length) {
+				auto value = std::string_view(header).substr(offset, length);
+				return value.substr(0, value.find('\0'));
+			};
+
+			std::string name(field(0, 100));
+			if (field(257, 5) == "ustar" && !field(345, 155).empty()) {
+				name = std::string(field(345, 155)) + "/" + name;
+			}
+
+			if (name.starts_with("./")) {
+				name.erase(0, 2);
+			}
+
+			std::uint64_t size = 0;
+			auto size_field = field(124, 12);
+			auto begin = size_field.find_first_not_of(' ');
+			if (begin != std::string_view::npos) {
+				auto result = std::from_chars(size_field.data() + begin, size_field.data() + size_field.size(), size, 8);
+				if (result.ec != std::errc()) {
+					throw std::runtime_error("tar: invalid entry size for " + name);
+				}
+			}
+
+			auto type = header[156];
+			if (type == '0' || type == '\0') {
+				if (name == "control") {
+					if (size > DEB_CONTROL_LIMIT) {
+						throw std::runtime_error("tar: control file is too large");
+					}
+
+					capturing = true;
+					control_found = size == 0;
+				} else if (name == "preinst" || name == "postinst" || name == "prerm" || name == "postrm" || name == "triggers" || name == "config") {
+					scripts.push_back(name);
+				}
+			}
+
+			remaining = size;
+			padding = (512 - size % 512) % 512;
+
+			if (remaining == 0) {
+				capturing = false;
+			}
+		}
+
+		std::string header;
+		std::uint64_t remaining = 0;
+		std::uint64_t padding = 0;
+		bool capturing = false;
+	};
+
+	// Debs are ar archives of debian-binary, control.tar.* and data.tar.*, only the control member is ever looked at
+	std::optional<std::pair<std::string_view, std::string_view>> control_member(std::string_view archive) {
+		if (!archive.starts_with("!<arch>\n")) {
+			return std::nullopt;
+		}
+
+		size_t position = 8;
+		while (archive.size() >= 60 && position <= archive.size() - 60) {
+			auto header = archive.substr(position, 60);
+			auto name = header.substr(0, 16);
+			name = name.substr(0, name.find_last_not_of(' ') + 1);
+			if (name.ends_with('/')) {
+				name.remove_suffix(1);
+			}
+
+			std::uint64_t size = 0;
+			auto size_field = header.substr(48, 10);
+			std::from_chars(size_field.data(), size_field.data() + size_field.size(), size);
+
+			if (size > archive.size() - position - 60) {
+				return std::nullopt;
+			}
+
+			if (name.starts_with("control.tar")) {
+				return std::make_pair(name, archive.substr(position + 60, size));
+			}
+
+			// Members are padded to an even offset
+			position += 60 + size + (size & 1);
+		}
+
+		return std::nullopt;
+	}
+
+	bool fetch_file(const canister::deb::download &download, const std::string &path) {
+		int descriptor = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (descriptor < 0) {
+			return false;
+		}
+
+		bool fetched = false;
+
+		try {
+			auto parts = std::min<std::uint64_t>(DEB_RANGE_PARTS, download.size / DEB_RANGE_MINIMUM);
+
+			// Big files are split into ranges on separate connections, one slow connection no longer caps the download
+			if (parts > 1 && ftruncate(descriptor, static_cast<off_t>(download.size)) == 0) {
+				auto part_size = download.size / parts;
+				std::vector<std::future<bool>> ranges;
+
+				for (std::uint64_t part = 0; part < parts; part++) {
+					auto first = part * part_size;
+					auto last = part == parts - 1 ? download.size - 1 : first + part_size - 1;
+
+					ranges.push_back(std::async(std::launch::async, [&download, descriptor, first, last]() {
+						try {
+							return fetch_range(download.url, descriptor, first, last, true);
+						} catch (...) {
+							return false;
+						}
+					}));
+				}
+
+				fetched = true;
+				for (auto &range : ranges) {
+					fetched = range.get() && fetched;
+				}
+			}
+
+			// Small files, and servers without range support, take a single request
+			if (!fetched) {
+				if (ftruncate(descriptor, 0) == 0) {
+					fetched = fetch_range(download.url, descriptor, 0, 0, false);
+				}
+			}
+		} catch (std::exception &exc) {
+			canister::log::error("deb", download.url + " - " + std::string(exc.what()));
+			fetched = false;
+		}
+
+		close(descriptor);
+		return fetched;
+	}
+}
+
+std::string canister::deb::store_path(std::string_view sha_256) {
+	// Two characters of fan-out keeps any one directory from holding every file
+	return canister::util::cache_path() + "debs/" + std::string(sha_256.substr(0, 2)) + "/" + std::string(sha_256);
+}
+
+std::optional<std::string> canister::deb::cached(std::string_view sha_256) {
+	std::call_once(store_scanned, scan_store);
+
+	std::lock_guard lock(store_mutex);
+	auto entry = store_entries.find(std::string(sha_256));
+	if (entry == store_entries.end()) {
+		return std::nullopt;
+	}
+
+	// The modification time doubles as the access time so the order survives a restart
+	store_lru.splice(store_lru.begin(), store_lru, entry->second.first);
+	auto path = canister::deb::store_path(sha_256);
+
+	std::error_code error;
+	std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), error);
+	return path;
+}
+
+std::optional<std::string> canister::deb::fetch(const canister::deb::download &download) {
+	if (!valid_hash(download.sha_256)) {
+		return std::nullopt;
+	}
+
+	auto existing = canister::deb::cached(download.sha_256);
+	if (existing.has_value()) {
+		return existing;
+	}
+
+	if (download.size > budget()) {
+		canister::log::error("deb", download.url + " - larger than the whole cache budget");
+		return std::nullopt;
+	}
+
+	auto path = canister::deb::store_path(download.sha_256);
+	std::filesystem::create_directories(std::filesystem::path(path).parent_path());
+
+	// Partial files never carry a valid hash as their name, so they can't be mistaken for finished ones
+	std::ostringstream temporary;
+	temporary << path << ".part-" << std::this_thread::get_id();
+
+	if (!fetch_file(download, temporary.str())) {
+		std::filesystem::remove(temporary.str());
+		canister::log::error("deb", download.url + " - download failed");
+		return std::nullopt;
+	}
+
+	canister::util::mapped_file file(temporary.str());
+	if (!file.good() || !canister::hash::verify(file.view(), download.sha_256)) {
+		std::filesystem::remove(temporary.str());
+		canister::log::error("deb", download.url + " - SHA256 mismatch");
+		return std::nullopt;
+	}
+
+	auto size = file.view().size();
+	std::filesystem::rename(temporary.str(), path);
+	admit(download.sha_256, size);
+	return path;
+}
+
+std::optional<canister::deb::control_info> canister::deb::control(const std::string &path) {
+	canister::util::mapped_file file(path);
+	if (!file.good()) {
+		return std::nullopt;
+	}
+
+	auto member = control_member(file.view());
+	if (!member.has_value()) {
+		return std::nullopt;
+	}
+
+	auto [name, data] = member.value();
+	tar_reader reader;
+
+	// The reader stops the decompressor at the end of the control archive, data.tar is never even looked at
+	auto sink = [&reader](std::string_view chunk) {
+		return reader.feed(chunk);
+	};
+
+	if (name == "control.tar") {
+		sink(data);
+	} else if (name == "control.tar.gz") {
+		canister::decompress::gz_stream(path, data, sink);
+	} else if (name == "control.tar.xz") {
+		canister::decompress::xz_stream(path, data, sink);
+	} else if (name == "control.tar.zst") {
+		canister::decompress::zstd_stream(path, data, sink);
+	} else {
+		throw std::runtime_error(path + " - unsupported control archive " + std::string(name));
+	}
+
+	if (!reader.control_found) {
+		return std::nullopt;
+	}
+
+	// The control file is just another stanza so it goes through the same parser as Packages
+	std::pmr::monotonic_buffer_resource arena;
+	auto kv_map = canister::parser::parse_apt_kv(reader.control, canister::util::control_keys(), &arena);
+
+	canister::deb::control_info info;
+	for (auto &[key, value] : kv_map) {
+		info.fields.emplace(key, value);
+	}
+
+	info.scripts = std::move(reader.scripts);
+	return info;
+}
+
+void canister::deb::enqueue(const canister::catalog::repository &repository) {
+	// Only the newest version of each package is cached ahead of time, older ones are fetched on demand
+	std::unordered_map<std::string_view, const canister::catalog::vpackage *> newest;
+	for (auto &vpackage : repository.packages) {
+		auto &current = newest[vpackage.package];
+		if (!current || canister::dpkg::compare(vpackage.version, current->version) > 0) {
+			current = &vpackage;
+		}
+	}
+
+	std::vector<canister::deb::download> pending;
+	for (auto &[id, vpackage] : newest) {
+		if (vpackage->filename.empty() || !valid_hash(vpackage->sha_256)) {
+			continue;
+		}
+
+		auto filename = std::string_view(vpackage->filename);
+		if (filename.starts_with("./")) {
+			filename.remove_prefix(2);
+		}
+
+		std::uint64_t size = 0;
+		std::from_chars(vpackage->size.data(), vpackage->size.data() + vpackage->size.size(), size);
+
+		pending.push_back({
+			.url = repository.uri + "/" + std::string(filename),
+			.sha_256 = vpackage->sha_256,
+			.size = size,
+		});
+	}
+
+	std::call_once(store_scanned, scan_store);
+	std::lock_guard lock(downloads_mutex);
+
+	for (auto &download : pending) {
+		{
+			std::lock_guard store_lock(store_mutex);
+			if (store_entries.contains(download.sha_256)) {
+				continue;
+			}
+		}
+
+		if (downloads_queued.insert(download.sha_256).second) {
+			downloads_queue.push_back(std::move(download));
+		}
+	}
+
+	downloads_wake.notify_all();
+}
+
+void canister::deb::start() {
+	std::call_once(store_scanned, scan_store);
+
+	for (std::size_t worker = 0; worker < canister::config::get().deb_fetch_workers; worker++) {
+		std::thread([]() {
+			while (true) {
+				canister::deb::download download;
+
+				{
+					std::unique_lock lock(downloads_mutex);
+					downloads_wake.wait(lock, []() {
+						return !downloads_queue.empty();
+					});
+
+					download = std::move(downloads_queue.front());
+					downloads_queue.pop_front();
+				}
+
+				try {
+					canister::deb::fetch(download);
+				} catch (std::exception &exc) {
+					canister::log::error("deb", download.url + " - " + std::string(exc.what()));
+				}
+
+				std::lock_guard lock(downloads_mutex);
+				downloads_queued.erase(download.sha_256);
+			}
+		}).detach();
+	}
+}
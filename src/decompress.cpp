@@ -1,14 +1,187 @@
 #include <canister.h>
 
+namespace {
+	// Output goes to disk in large page aligned writes instead of a stdio call for every 8 KB chunk
+	class output_file {
+	public:
+		output_file(const std::string &id, const std::string &format, const std::string &path) : id(id), format(format) {
+			descriptor = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+			if (descriptor < 0) {
+				throw std::runtime_error(id + " - " + format + ": failed to make extract handle at " + path);
+			}
+		}
+
+		output_file(const output_file &) = delete;
+		output_file &operator=(const output_file &) = delete;
+
+		~output_file() {
+			close(descriptor);
+		}
+
+		void write(const std::uint8_t *data, std::size_t size) {
+			while (size > 0) {
+				auto written = ::write(descriptor, data, size);
+				if (written < 0 && errno == EINTR) {
+					continue;
+				}
+
+				if (written <= 0) {
+					throw std::runtime_error(id + " - " + format + ": write error > " + strerror(errno));
+				}
+
+				data += written;
+				size -= static_cast<std::size_t>(written);
+			}
+		}
+
+		int handle() const {
+			return descriptor;
+		}
+
+	private:
+		int descriptor;
+		std::string id;
+		std::string format;
+	};
+
+	struct aligned_free {
+		void operator()(std::uint8_t *data) const {
+			std::free(data);
+		}
+	};
+
+	std::unique_ptr<std::uint8_t[], aligned_free> aligned_buffer(std::size_t size) {
+		auto data = static_cast<std::uint8_t *>(std::aligned_alloc(4096, size));
+		if (!data) {
+			throw std::bad_alloc();
+		}
+
+		return std::unique_ptr<std::uint8_t[], aligned_free>(data);
+	}
+
+	// Blocks are only decoded in parallel when their sizes are in the index, which xz -T writes and plain xz doesn't
+	// The index sits right before the footer, anything unusual like stream padding is reported as a single block
+	std::uint64_t xz_blocks(std::string_view archive) {
+		if (archive.size() < 2 * LZMA_STREAM_HEADER_SIZE) {
+			return 1;
+		}
+
+		auto data = reinterpret_cast<const std::uint8_t *>(archive.data());
+		auto footer_start = archive.size() - LZMA_STREAM_HEADER_SIZE;
+
+		lzma_stream_flags footer;
+		if (lzma_stream_footer_decode(&footer, data + footer_start) != LZMA_OK || footer.backward_size > footer_start - LZMA_STREAM_HEADER_SIZE) {
+			return 1;
+		}
+
+		lzma_index *index = nullptr;
+		std::uint64_t memory_limit = UINT64_MAX;
+		std::size_t position = 0;
+		if (lzma_index_buffer_decode(&index, &memory_limit, nullptr, data + footer_start - footer.backward_size, &position, footer.backward_size) != LZMA_OK) {
+			return 1;
+		}
+
+		auto blocks = lzma_index_block_count(index);
+		lzma_index_end(index, nullptr);
+		return std::max<std::uint64_t>(1, blocks);
+	}
+
+	struct zstd_frame {
+		std::size_t offset;
+		std::size_t size;
+		std::size_t content;
+		std::size_t destination;
+	};
+
+	// Frames can only be decoded side by side when every one of them records how big it decompresses to
+	std::vector<zstd_frame> zstd_frames(std::string_view archive) {
+		std::vector<zstd_frame> frames;
+		std::size_t offset = 0;
+		std::size_t destination = 0;
+
+		while (offset < archive.size()) {
+			auto size = ZSTD_findFrameCompressedSize(archive.data() + offset, archive.size() - offset);
+			if (ZSTD_isError(size)) {
+				return {};
+			}
+
+			auto content = ZSTD_getFrameContentSize(archive.data() + offset, size);
+			if (content == ZSTD_CONTENTSIZE_UNKNOWN || content == ZSTD_CONTENTSIZE_ERROR) {
+				return {};
+			}
+
+			frames.push_back({ .offset = offset, .size = size, .content = static_cast<std::size_t>(content), .destination = destination });
+			offset += size;
+			destination += static_cast<std::size_t>(content);
+		}
+
+		return frames;
+	}
+
+	// Every frame is decoded straight into its place in the mapped output, the workers pull frames off a shared counter
+	void zstd_parallel(const std::string &id, std::string_view archive, const std::vector<zstd_frame> &frames, output_file &output, std::size_t workers) {
+		auto total = frames.back().destination + frames.back().content;
+		if (total == 0) {
+			return;
+		}
+
+		if (ftruncate(output.handle(), static_cast<off_t>(total)) != 0) {
+			throw std::runtime_error(id + " - zstd: failed to size extract handle > " + strerror(errno));
+		}
+
+		auto mapping = mmap(nullptr, total, PROT_READ | PROT_WRITE, MAP_SHARED, output.handle(), 0);
+		if (mapping == MAP_FAILED) {
+			throw std::runtime_error(id + " - zstd: failed to map extract handle > " + strerror(errno));
+		}
+
+		auto destination = static_cast<char *>(mapping);
+		std::atomic<std::size_t> next = 0;
+		std::vector<std::future<std::optional<std::string>>> threads;
+
+		for (std::size_t worker = 0; worker < workers; worker++) {
+			threads.push_back(std::async(std::launch::async, [&archive, &frames, &next, destination]() -> std::optional<std::string> {
+				ZSTD_DCtx *context = ZSTD_createDCtx();
+				if (context == nullptr) {
+					return "invalid decompression context";
+				}
+
+				for (auto index = next++; index < frames.size(); index = next++) {
+					auto &frame = frames[index];
+					auto status = ZSTD_decompressDCtx(context, destination + frame.destination, frame.content, archive.data() + frame.offset, frame.size);
+					if (ZSTD_isError(status) || status != frame.content) {
+						ZSTD_freeDCtx(context);
+						return ZSTD_isError(status) ? ZSTD_getErrorName(status) : "frame size mismatch";
+					}
+				}
+
+				ZSTD_freeDCtx(context);
+				return std::nullopt;
+			}));
+		}
+
+		std::optional<std::string> failure;
+		for (auto &thread : threads) {
+			auto result = thread.get();
+			if (result.has_value() && !failure.has_value()) {
+				failure = result;
+			}
+		}
+
+		munmap(mapping, total);
+		if (failure.has_value()) {
+			throw std::runtime_error(id + " - zstd: decompression error > " + failure.value());
+		}
+	}
+}
+
 void canister::decompress::gz(const std::string id, const std::string archive, const std::string cache) {
-	std::ifstream archive_file(archive.c_str());
-	if (!archive_file.is_open()) {
+	canister::util::mapped_file archive_file(archive);
+	if (!archive_file.good()) {
 		throw std::runtime_error(id + " - gz: failed to open archive at " + archive);
 	}
 
-	// Converts our ifstream to a string using streambuf iterators
-	auto iterator = std::istreambuf_iterator<char>(archive_file);
-	std::string buffer_data = std::string(iterator, std::istreambuf_iterator<char>());
+	// Zlib reads straight out of the mapping so the archive is never copied
+	auto buffer_data = archive_file.view();
 	std::string output_data;
 	size_t max_size(10000000);
 	z_stream inflate_stream;
@@ -30,8 +203,8 @@ void canister::decompress::gz(const std::string id, const std::string archive, c
 	std::size_t inflated_size = 0;
 	std::size_t buffer_size = buffer_data.size();
 
-	// Because of Zlib's weird pointer magic, we need to reinterpret this as a pointer first
-	inflate_stream.next_in = reinterpret_cast<z_const Bytef *>(buffer_data.data());
+	// Because of Zlib's weird pointer magic, we need to reinterpret this as a pointer first (it never writes to it)
+	inflate_stream.next_in = reinterpret_cast<z_const Bytef *>(const_cast<char *>(buffer_data.data()));
 	if (buffer_size > max_size || (buffer_size * 2) > max_size) {
 		inflateEnd(&inflate_stream);
 		throw std::runtime_error(id + " - gz: inflate is using too much memory");
@@ -80,96 +253,88 @@ void canister::decompress::gz(const std::string id, const std::string archive, c
 }
 
 void canister::decompress::xz(const std::string id, const std::string archive, const std::string cache) {
-	FILE *const file_in = fopen(archive.c_str(), "rb");
-	FILE *const file_out = fopen(cache.c_str(), "wb+");
-
-	if (!file_in) {
+	canister::util::mapped_file archive_file(archive);
+	if (!archive_file.good()) {
 		throw std::runtime_error(id + " - xz: failed to open archive at " + archive);
 	}
 
-	if (!file_out) {
-		throw std::runtime_error(id + " - xz: failed to make extract handle at " + cache);
-	}
-
-	lzma_stream macro_stream = LZMA_STREAM_INIT;
-	lzma_ret status = lzma_stream_decoder(&macro_stream, UINT64_MAX, LZMA_CONCATENATED);
-	lzma_stream *stream = reinterpret_cast<lzma_stream *>(&macro_stream);
+	output_file output(id, "xz", cache);
+	auto archive_data = archive_file.view();
+
+	// Leased threads go unused on single block archives, so only as many as there are blocks are asked for
+	canister::util::worker_lease lease(xz_blocks(archive_data));
+	lzma_stream stream = LZMA_STREAM_INIT;
+
+#if LZMA_VERSION >= 50040002
+	// The threaded decoder showed up in 5.4, it decodes on the calling thread by itself when the blocks don't allow more
+	lzma_mt options {};
+	options.flags = LZMA_CONCATENATED;
+	options.threads = static_cast<std::uint32_t>(lease.count());
+	options.memlimit_threading = std::max<std::uint64_t>(lzma_physmem() / 4, 64 * 1024 * 1024);
+	options.memlimit_stop = UINT64_MAX;
+	lzma_ret status = lzma_stream_decoder_mt(&stream, &options);
+#else
+	lzma_ret status = lzma_stream_decoder(&stream, UINT64_MAX, LZMA_CONCATENATED);
+#endif
 
 	switch (status) {
 		case LZMA_OK:
 			break;
 
 		case LZMA_MEM_ERROR:
-			lzma_end(stream);
+			lzma_end(&stream);
 			throw std::runtime_error(id + " - xz: stream memory error");
 
 		case LZMA_OPTIONS_ERROR:
-			lzma_end(stream);
+			lzma_end(&stream);
 			throw std::runtime_error(id + " - xz: stream options error");
 
 		default:
-			lzma_end(stream);
+			lzma_end(&stream);
 			throw std::runtime_error(id + " - xz: stream init error");
 	}
 
-	lzma_action action = LZMA_RUN;
-	uint8_t in_buf[BUFSIZ];
-	uint8_t out_buf[BUFSIZ];
-
-	stream->next_in = NULL;
-	stream->avail_in = 0;
-	stream->next_out = out_buf;
-	stream->avail_out = sizeof(out_buf);
+	// The whole archive is handed over at once since it's already mapped
+	auto out_buf = aligned_buffer(DECOMPRESS_WRITE_BUFFER);
+	stream.next_in = reinterpret_cast<const std::uint8_t *>(archive_data.data());
+	stream.avail_in = archive_data.size();
+	stream.next_out = out_buf.get();
+	stream.avail_out = DECOMPRESS_WRITE_BUFFER;
 
 	for (;;) { // Break inside when finished
-		if (stream->avail_in == 0 && !feof(file_in)) {
-			stream->next_in = in_buf;
-			stream->avail_in = fread(in_buf, 1, sizeof(in_buf), file_in);
-
-			if (ferror(file_in)) {
-				throw std::runtime_error(id + " - xz: read error > " + strerror(errno));
+		lzma_ret status = lzma_code(&stream, LZMA_FINISH);
+		if (stream.avail_out == 0 || status == LZMA_STREAM_END) {
+			try {
+				output.write(out_buf.get(), DECOMPRESS_WRITE_BUFFER - stream.avail_out);
+			} catch (...) {
+				lzma_end(&stream);
+				throw;
 			}
 
-			if (feof(file_in)) {
-				action = LZMA_FINISH;
-			}
-		}
-
-		lzma_ret status = lzma_code(stream, action);
-		if (stream->avail_out == 0 || status == LZMA_STREAM_END) {
-			size_t write_size = sizeof(out_buf) - stream->avail_out;
-
-			if (std::fwrite(out_buf, 1, write_size, file_out) != write_size) {
-				throw std::runtime_error(id + " - xz: write error > " + strerror(errno));
-			}
-
-			stream->next_out = out_buf;
-			stream->avail_out = sizeof(out_buf);
+			stream.next_out = out_buf.get();
+			stream.avail_out = DECOMPRESS_WRITE_BUFFER;
 		}
 
 		if (status != LZMA_OK) {
 			switch (status) {
 				case LZMA_STREAM_END:
-					lzma_end(stream);
+					lzma_end(&stream);
 					return;
 
 				case LZMA_MEM_ERROR:
-					lzma_end(stream);
+					lzma_end(&stream);
 					throw std::runtime_error(id + " - xz: stream memory error");
 
 				case LZMA_OPTIONS_ERROR:
-					lzma_end(stream);
+					lzma_end(&stream);
 					throw std::runtime_error(id + " - xz: stream options error");
 
 				default:
-					lzma_end(stream);
+					lzma_end(&stream);
 					throw std::runtime_error(id + " - xz: stream decompression error");
 			}
 		}
 	}
-
-	fclose(file_in);
-	fclose(file_out);
 }
 
 void canister::decompress::bz2(const std::string id, const std::string archive, const std::string cache) {
@@ -204,24 +369,17 @@ void canister::decompress::bz2(const std::string id, const std::string archive,
 	} while (status == BZ_OK);
 
 	if (status != BZ_STREAM_END) {
-		BZ2_bzReadClose(&status, &bzip_handle);
+		std::string error = BZ2_bzerror(bzip_handle, &status);
+		BZ2_bzReadClose(&status, bzip_handle);
 		fclose(file_out);
 		fclose(file_in);
 
-		throw std::runtime_error(id + " - bz2: decompression error > " + BZ2_bzerror(&bzip_handle, &status));
+		throw std::runtime_error(id + " - bz2: decompression error > " + error);
 	}
 
+	BZ2_bzReadClose(&status, bzip_handle);
 	fclose(file_out);
 	fclose(file_in);
-
-	std::ifstream cache_file(cache);
-	if (!cache_file.is_open()) {
-		throw std::runtime_error(id + " - bz2: failed to open decompressed file");
-	}
-
-	// Converts our ifstream to a string using streambuf iterators
-	auto iterator = std::istreambuf_iterator<char>(cache_file);
-	std::string cache_data = std::string(iterator, std::istreambuf_iterator<char>());
 }
 
 void canister::decompress::lzma(const std::string id, const std::string archive, const std::string cache) {
@@ -291,7 +449,10 @@ void canister::decompress::lzma(const std::string id, const std::string archive,
 		if (status != LZMA_OK) {
 			switch (status) {
 				case LZMA_STREAM_END:
+					// Closing flushes whatever stdio still buffers, the caller reads the file straight after
 					lzma_end(stream);
+					fclose(file_in);
+					fclose(file_out);
 					return;
 
 				case LZMA_MEM_ERROR:
@@ -314,91 +475,206 @@ void canister::decompress::lzma(const std::string id, const std::string archive,
 }
 
 void canister::decompress::zstd(const std::string id, const std::string archive, const std::string cache) {
-	FILE *const file_in = fopen(archive.c_str(), "rb");
-	FILE *const file_out = fopen(cache.c_str(), "wb+");
-
-	if (!file_in) {
+	canister::util::mapped_file archive_file(archive);
+	if (!archive_file.good()) {
 		throw std::runtime_error(id + " - zstd: failed to open archive at " + archive);
 	}
 
-	if (!file_out) {
-		throw std::runtime_error(id + " - zstd: failed to make extract handle at " + cache);
-	}
-
-	// Streams don't require a set size, so we use ZSTD's allocated size
-	size_t const buffer_in_size = ZSTD_DStreamInSize();
-	size_t const buffer_out_size = ZSTD_DStreamOutSize();
+	output_file output(id, "zstd", cache);
+	auto archive_data = archive_file.view();
 
-	void *const buffer_in = malloc(buffer_in_size);
-	void *const buffer_out = malloc(buffer_out_size);
+	// Archives written with more than one frame, like zstd -T or pzstd output, are decoded a frame per worker
+	auto frames = zstd_frames(archive_data);
+	if (frames.size() > 1) {
+		canister::util::worker_lease lease(frames.size());
+		if (lease.count() > 1) {
+			zstd_parallel(id, archive_data, frames, output, lease.count());
+			return;
+		}
+	}
 
 	ZSTD_DCtx *const dict_ctx = ZSTD_createDCtx();
 	if (dict_ctx == NULL) {
-		fclose(file_in);
-		free(buffer_in);
-		free(buffer_out);
-
 		throw std::runtime_error(id + " - zstd: invalid decompression context");
 	}
 
-	size_t read_size;
+	// The mapped archive is the input buffer, only the output needs one of its own
+	auto buffer_out = aligned_buffer(DECOMPRESS_WRITE_BUFFER);
+	ZSTD_inBuffer input = {
+		archive_data.data(),
+		archive_data.size(),
+		0
+	};
+
 	size_t last_status = 0;
-	size_t const pending_read = buffer_in_size;
+	while (input.pos < input.size) {
+		ZSTD_outBuffer output_buffer = {
+			buffer_out.get(),
+			DECOMPRESS_WRITE_BUFFER,
+			0
+		};
+
+		size_t const status = ZSTD_decompressStream(dict_ctx, &output_buffer, &input);
+		if (ZSTD_isError(status)) {
+			ZSTD_freeDCtx(dict_ctx);
+			throw std::runtime_error(id + " - zstd: decompression error > " + ZSTD_getErrorName(status));
+		}
 
-	// We have to basically read every byte at a time and decompress/write it to a buffer
-	while ((read_size = fread(buffer_in, 1, pending_read, file_in))) {
-		ZSTD_inBuffer input = {
-			buffer_in,
-			read_size,
+		try {
+			output.write(buffer_out.get(), output_buffer.pos);
+		} catch (...) {
+			ZSTD_freeDCtx(dict_ctx);
+			throw;
+		}
+
+		last_status = status;
+	}
+
+	// A frame can still be holding output once the input runs out
+	while (last_status != 0) {
+		ZSTD_outBuffer output_buffer = {
+			buffer_out.get(),
+			DECOMPRESS_WRITE_BUFFER,
 			0
 		};
 
-		while (input.pos < input.size) {
-			ZSTD_outBuffer output = {
-				buffer_out,
-				buffer_out_size,
-				0
-			};
-
-			size_t const status = ZSTD_decompressStream(dict_ctx, &output, &input);
-			if (ZSTD_isError(status)) {
-				ZSTD_freeDCtx(dict_ctx);
-				fclose(file_in);
-				fclose(file_out);
-				free(buffer_in);
-				free(buffer_out);
-
-				throw std::runtime_error(id + " - zstd: decompression error > " + ZSTD_getErrorName(status));
-			}
+		size_t const status = ZSTD_decompressStream(dict_ctx, &output_buffer, &input);
+		if (ZSTD_isError(status) || output_buffer.pos == 0) {
+			break;
+		}
 
-			fwrite(buffer_out, 1, output.pos, file_out);
-			last_status = status;
+		try {
+			output.write(buffer_out.get(), output_buffer.pos);
+		} catch (...) {
+			ZSTD_freeDCtx(dict_ctx);
+			throw;
 		}
+
+		last_status = status;
 	}
 
 	// If the last status was not okay that means decompression had an EOF
 	if (last_status != 0) {
 		ZSTD_freeDCtx(dict_ctx);
-		fclose(file_in);
-		fclose(file_out);
-		free(buffer_in);
-		free(buffer_out);
-
 		throw std::runtime_error(id + " - zstd: unexpected EOF on last_status > " + ZSTD_getErrorName(last_status));
 	}
 
 	ZSTD_freeDCtx(dict_ctx);
-	fclose(file_in);
-	fclose(file_out);
-	free(buffer_in);
-	free(buffer_out);
+}
 
-	std::ifstream cache_file(cache);
-	if (!cache_file.is_open()) {
-		throw std::runtime_error(id + " - zstd: failed to open decompressed file");
+void canister::decompress::gz_stream(const std::string id, std::string_view archive, const canister::decompress::sink &write) {
+	z_stream inflate_stream {};
+
+	// windowBits 15
+	// ENABLE_ZLIB_GZIP 32
+	if (inflateInit2(&inflate_stream, 15 | 32) != Z_OK) {
+		throw std::runtime_error(id + " - gz: invalid zlib handle");
 	}
 
-	// Converts our ifstream to a string using streambuf iterators
-	auto iterator = std::istreambuf_iterator<char>(cache_file);
-	std::string cache_data = std::string(iterator, std::istreambuf_iterator<char>());
+	inflate_stream.next_in = reinterpret_cast<z_const Bytef *>(const_cast<char *>(archive.data()));
+	inflate_stream.avail_in = static_cast<unsigned int>(archive.size());
+
+	std::vector<char> buffer(DECOMPRESS_STREAM_BUFFER);
+	int status;
+
+	do {
+		inflate_stream.next_out = reinterpret_cast<Bytef *>(buffer.data());
+		inflate_stream.avail_out = static_cast<unsigned int>(buffer.size());
+
+		// Running out of input before the end of the stream means the archive was cut short
+		status = inflate(&inflate_stream, Z_NO_FLUSH);
+		if (status != Z_OK && status != Z_STREAM_END) {
+			std::string error_message = inflate_stream.msg ? inflate_stream.msg : "truncated stream";
+			inflateEnd(&inflate_stream);
+
+			throw std::runtime_error(id + " - gz: decompression error > " + error_message);
+		}
+
+		auto produced = buffer.size() - inflate_stream.avail_out;
+		if (produced > 0 && !write(std::string_view(buffer.data(), produced))) {
+			break;
+		}
+	} while (status != Z_STREAM_END);
+
+	inflateEnd(&inflate_stream);
+}
+
+void canister::decompress::xz_stream(const std::string id, std::string_view archive, const canister::decompress::sink &write) {
+	lzma_stream stream = LZMA_STREAM_INIT;
+	if (lzma_stream_decoder(&stream, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+		lzma_end(&stream);
+		throw std::runtime_error(id + " - xz: stream init error");
+	}
+
+	std::vector<uint8_t> buffer(DECOMPRESS_STREAM_BUFFER);
+	stream.next_in = reinterpret_cast<const uint8_t *>(archive.data());
+	stream.avail_in = archive.size();
+
+	for (;;) { // Break inside when finished
+		stream.next_out = buffer.data();
+		stream.avail_out = buffer.size();
+
+		// The whole archive is already in memory so the decoder can be told this is all of it
+		lzma_ret status = lzma_code(&stream, LZMA_FINISH);
+		if (status != LZMA_OK && status != LZMA_STREAM_END) {
+			lzma_end(&stream);
+			throw std::runtime_error(id + " - xz: stream decompression error");
+		}
+
+		auto produced = buffer.size() - stream.avail_out;
+		if (produced > 0 && !write(std::string_view(reinterpret_cast<const char *>(buffer.data()), produced))) {
+			break;
+		}
+
+		if (status == LZMA_STREAM_END) {
+			break;
+		}
+	}
+
+	lzma_end(&stream);
+}
+
+void canister::decompress::zstd_stream(const std::string id, std::string_view archive, const canister::decompress::sink &write) {
+	ZSTD_DCtx *const dict_ctx = ZSTD_createDCtx();
+	if (dict_ctx == NULL) {
+		throw std::runtime_error(id + " - zstd: invalid decompression context");
+	}
+
+	std::vector<char> buffer(std::max<size_t>(DECOMPRESS_STREAM_BUFFER, ZSTD_DStreamOutSize()));
+	ZSTD_inBuffer input = {
+		archive.data(),
+		archive.size(),
+		0
+	};
+
+	for (;;) { // Break inside when finished
+		ZSTD_outBuffer output = {
+			buffer.data(),
+			buffer.size(),
+			0
+		};
+
+		size_t const status = ZSTD_decompressStream(dict_ctx, &output, &input);
+		if (ZSTD_isError(status)) {
+			ZSTD_freeDCtx(dict_ctx);
+			throw std::runtime_error(id + " - zstd: decompression error > " + ZSTD_getErrorName(status));
+		}
+
+		if (output.pos > 0 && !write(std::string_view(buffer.data(), output.pos))) {
+			break;
+		}
+
+		// A finished frame with all input consumed is the end, any input left over is another frame
+		if (status == 0 && input.pos == input.size) {
+			break;
+		}
+
+		// If there was room left in the output that means zstd is waiting on input that isn't coming
+		if (input.pos == input.size && output.pos < output.size) {
+			ZSTD_freeDCtx(dict_ctx);
+			throw std::runtime_error(id + " - zstd: unexpected EOF");
+		}
+	}
+
+	ZSTD_freeDCtx(dict_ctx);
 }
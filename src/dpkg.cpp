@@ -1,44 +1,31 @@
 #include <canister.h>
 
-int canister::dpkg::compare(const std::string &left_raw, const std::string &right_raw) {
-	canister::dpkg::version left, right;
-	std::string::size_type index;
-
-	// Find out if we have an epoch (dpkg defaults to 0 if it doesn't exist)
-	index = left_raw.find(":", 0);
-	if (index == std::string::npos) {
-		left.epoch = 0;
-		left.version = left_raw;
-	} else {
-		left.epoch = std::stoi(left_raw.substr(0, index));
-		left.version = left_raw.substr(index + 1, left_raw.length());
-	}
+namespace {
+	canister::dpkg::version split(std::string_view raw) {
+		canister::dpkg::version result { .epoch = 0, .version = raw, .revision = "0" };
+
+		// Find out if we have an epoch (dpkg defaults to 0 if it doesn't exist)
+		auto index = raw.find(':');
+		if (index != std::string_view::npos) {
+			result.epoch = std::stoi(std::string(raw.substr(0, index)));
+			result.version = raw.substr(index + 1);
+		}
 
-	index = right_raw.find(":", 0);
-	if (index == std::string::npos) {
-		right.epoch = 0;
-		right.version = right_raw;
-	} else {
-		right.epoch = std::stoi(right_raw.substr(0, index));
-		right.version = right_raw.substr(index + 1, right_raw.length());
-	}
+		// Find out the version strings and their revisions if applicable
+		index = result.version.rfind('-');
+		if (index != std::string_view::npos) {
+			result.revision = result.version.substr(index + 1);
+			result.version = result.version.substr(0, index);
+		}
 
-	// Find out the version strings and their revisions if applicable
-	index = left.version.rfind("-", left_raw.length());
-	if (index == std::string::npos) {
-		left.revision = "0";
-	} else {
-		left.revision = left.version.substr(index + 1, left.version.length());
-		left.version = left.version.substr(0, index);
+		return result;
 	}
+}
 
-	index = right.version.rfind("-", right_raw.length());
-	if (index == std::string::npos) {
-		right.revision = "0";
-	} else {
-		right.revision = right.version.substr(index + 1, right.version.length());
-		right.version = right.version.substr(0, index);
-	}
+int canister::dpkg::compare(std::string_view left_raw, std::string_view right_raw) {
+	// Everything but an epoch is a view into the arguments
+	auto left = split(left_raw);
+	auto right = split(right_raw);
 
 	// Compare everything
 	if (left.epoch > right.epoch) {
@@ -49,11 +36,35 @@ int canister::dpkg::compare(const std::string &left_raw, const std::string &righ
 		return -1;
 	}
 
-	if (int status = canister::dpkg::verrevcmp(left.version.c_str(), right.version.c_str())) {
-		return status;
+	// verrevcmp hands back raw differences like 7 for "9" against "2", callers only get the sign
+	if (int status = canister::dpkg::verrevcmp(left.version, right.version)) {
+		return status > 0 ? 1 : -1;
 	}
 
-	return verrevcmp(left.revision.c_str(), right.revision.c_str());
+	int status = canister::dpkg::verrevcmp(left.revision, right.revision);
+	return (status > 0) - (status < 0);
+}
+
+bool canister::dpkg::satisfies(std::string_view candidate, canister::dpkg::relation relation, std::string_view constraint) {
+	if (relation == canister::dpkg::relation::any) {
+		return true;
+	}
+
+	auto status = canister::dpkg::compare(candidate, constraint);
+	switch (relation) {
+		case canister::dpkg::relation::earlier:
+			return status < 0;
+		case canister::dpkg::relation::earlier_equal:
+			return status <= 0;
+		case canister::dpkg::relation::equal:
+			return status == 0;
+		case canister::dpkg::relation::later_equal:
+			return status >= 0;
+		case canister::dpkg::relation::later:
+			return status > 0;
+		default:
+			return true;
+	}
 }
 
 // These are taken from dpkg with minor modifications to build with C++20 and Canister
@@ -71,39 +82,43 @@ int canister::dpkg::order(int c) {
 		return 0;
 }
 
-int canister::dpkg::verrevcmp(const char *a, const char *b) {
-	if (a == NULL)
-		a = "";
-	if (b == NULL)
-		b = "";
+int canister::dpkg::verrevcmp(std::string_view left, std::string_view right) {
+	// Views aren't null terminated, so reading past the end yields the terminator dpkg expects
+	auto a = left.begin();
+	auto b = right.begin();
+	auto at = [](std::string_view value, std::string_view::const_iterator position) {
+		return position == value.end() ? '\0' : *position;
+	};
 
-	while (*a || *b) {
+	while (at(left, a) || at(right, b)) {
 		int first_diff = 0;
 
-		while ((*a && !isdigit(*a)) || (*b && !isdigit(*b))) {
-			int ac = order(*a);
-			int bc = order(*b);
+		while ((at(left, a) && !isdigit(at(left, a))) || (at(right, b) && !isdigit(at(right, b)))) {
+			int ac = order(at(left, a));
+			int bc = order(at(right, b));
 
 			if (ac != bc)
 				return ac - bc;
 
-			a++;
-			b++;
+			if (a != left.end())
+				a++;
+			if (b != right.end())
+				b++;
 		}
-		while (*a == '0')
+		while (at(left, a) == '0')
 			a++;
-		while (*b == '0')
+		while (at(right, b) == '0')
 			b++;
-		while (isdigit(*a) && isdigit(*b)) {
+		while (isdigit(at(left, a)) && isdigit(at(right, b))) {
 			if (!first_diff)
-				first_diff = *a - *b;
+				first_diff = at(left, a) - at(right, b);
 			a++;
 			b++;
 		}
 
-		if (isdigit(*a))
+		if (isdigit(at(left, a)))
 			return 1;
-		if (isdigit(*b))
+		if (isdigit(at(right, b)))
 			return -1;
 		if (first_diff)
 			return first_diff;
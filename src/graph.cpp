@@ -0,0 +1,351 @@
+#include <canister.h>
+
+// Queries grab the current index and keep it alive on their own, a rebuild just swaps in the next one
+std::mutex graph_mutex;
+std::shared_ptr<const canister::graph::index> graph_current = std::make_shared<canister::graph::index>();
+
+namespace {
+	const char *kind_names[] = { "depends", "pre_depends", "conflicts", "provides", "replaces" };
+	const char *relation_names[] = { "", "<<", "<=", "=", ">=", ">>" };
+
+	std::string_view trim(std::string_view value) {
+		auto begin = value.find_first_not_of(" \t\n");
+		if (begin == std::string_view::npos) {
+			return std::string_view();
+		}
+
+		auto end = value.find_last_not_of(" \t\n");
+		return value.substr(begin, end - begin + 1);
+	}
+
+	struct pending_edge {
+		std::uint32_t source;
+		canister::graph::edge edge;
+	};
+
+	class builder {
+	public:
+		explicit builder(canister::graph::index &index)
+			: index(index) {
+		}
+
+		std::uint32_t intern(std::string_view name) {
+			auto existing = index.ids.find(name);
+			if (existing != index.ids.end()) {
+				return existing->second;
+			}
+
+			auto id = static_cast<std::uint32_t>(index.names.size());
+			auto &stored = index.names.emplace_back(name);
+			index.ids.emplace(stored, id);
+			return id;
+		}
+
+		std::uint32_t constraint(std::string_view version) {
+			auto existing = constraint_ids.find(std::string(version));
+			if (existing != constraint_ids.end()) {
+				return existing->second;
+			}
+
+			auto id = static_cast<std::uint32_t>(index.constraints.size());
+			index.constraints.emplace_back(version);
+			constraint_ids.emplace(version, id);
+			return id;
+		}
+
+		// Parses "a (>= 1.0) | b:any [arch] <profile>, c" into one edge per alternative
+		// Every comma separated clause of a package gets its own group so alternatives can be told apart
+		void relationships(std::uint32_t source, std::string_view field, canister::graph::kind kind, std::uint32_t &group) {
+			size_t clause_start = 0;
+			while (clause_start <= field.size()) {
+				auto clause_end = std::min(field.find(',', clause_start), field.size());
+				auto clause = field.substr(clause_start, clause_end - clause_start);
+				clause_start = clause_end + 1;
+
+				auto clause_edges = edges.size();
+				size_t alternative_start = 0;
+
+				while (alternative_start <= clause.size()) {
+					auto alternative_end = std::min(clause.find('|', alternative_start), clause.size());
+					auto alternative = trim(clause.substr(alternative_start, alternative_end - alternative_start));
+					alternative_start = alternative_end + 1;
+
+					auto name_end = alternative.find_first_of(" \t([<");
+					auto name = alternative.substr(0, name_end);
+					name = name.substr(0, name.find(':'));
+
+					if (name.empty()) {
+						continue;
+					}
+
+					canister::graph::edge edge {
+						.node = intern(name),
+						.kind = kind,
+						.relation = canister::dpkg::relation::any,
+						.group = group,
+						.constraint = 0,
+					};
+
+					auto open = alternative.find('(');
+					auto close = alternative.find(')', open);
+					if (open != std::string_view::npos && close != std::string_view::npos) {
+						auto restriction = trim(alternative.substr(open + 1, close - open - 1));
+						auto operator_end = restriction.find_first_not_of("<>=");
+						auto op = restriction.substr(0, operator_end);
+						auto version = trim(restriction.substr(std::min(operator_end, restriction.size())));
+
+						if (op == "<<") {
+							edge.relation = canister::dpkg::relation::earlier;
+						} else if (op == "<=" || op == "<") {
+							edge.relation = canister::dpkg::relation::earlier_equal;
+						} else if (op == "=") {
+							edge.relation = canister::dpkg::relation::equal;
+						} else if (op == ">=" || op == ">") {
+							edge.relation = canister::dpkg::relation::later_equal;
+						} else if (op == ">>") {
+							edge.relation = canister::dpkg::relation::later;
+						}
+
+						if (edge.relation != canister::dpkg::relation::any) {
+							edge.constraint = constraint(version);
+						}
+					}
+
+					edges.push_back({ source, edge });
+				}
+
+				if (edges.size() != clause_edges) {
+					group++;
+				}
+			}
+		}
+
+		// Lays the edges out in CSR form, once by source and once by target
+		void finish() {
+			auto count = index.names.size();
+			index.versions.resize(count);
+			index.forward_offsets.assign(count + 1, 0);
+			index.reverse_offsets.assign(count + 1, 0);
+
+			for (auto &pending : edges) {
+				index.forward_offsets[pending.source + 1]++;
+				index.reverse_offsets[pending.edge.node + 1]++;
+			}
+
+			for (size_t node = 0; node < count; node++) {
+				index.forward_offsets[node + 1] += index.forward_offsets[node];
+				index.reverse_offsets[node + 1] += index.reverse_offsets[node];
+			}
+
+			index.forward.resize(edges.size());
+			index.reverse.resize(edges.size());
+			auto forward_position = std::vector<std::uint32_t>(index.forward_offsets.begin(), index.forward_offsets.end() - 1);
+			auto reverse_position = std::vector<std::uint32_t>(index.reverse_offsets.begin(), index.reverse_offsets.end() - 1);
+
+			for (auto &pending : edges) {
+				index.forward[forward_position[pending.source]++] = pending.edge;
+
+				auto reverse = pending.edge;
+				reverse.node = pending.source;
+				index.reverse[reverse_position[pending.edge.node]++] = reverse;
+			}
+		}
+
+	private:
+		canister::graph::index &index;
+		std::unordered_map<std::string, std::uint32_t> constraint_ids;
+		std::vector<pending_edge> edges;
+	};
+
+	std::span<const canister::graph::edge> forward(const canister::graph::index &index, std::uint32_t node) {
+		return std::span(index.forward).subspan(index.forward_offsets[node], index.forward_offsets[node + 1] - index.forward_offsets[node]);
+	}
+
+	std::span<const canister::graph::edge> reverse(const canister::graph::index &index, std::uint32_t node) {
+		return std::span(index.reverse).subspan(index.reverse_offsets[node], index.reverse_offsets[node + 1] - index.reverse_offsets[node]);
+	}
+
+	// Names nothing ships are virtual, an unversioned relationship on them holds as long as something provides them
+	bool satisfied(const canister::graph::index &index, const canister::graph::edge &edge, std::string_view version) {
+		if (!version.empty()) {
+			return canister::dpkg::satisfies(version, edge.relation, index.constraints[edge.constraint]);
+		}
+
+		if (edge.relation != canister::dpkg::relation::any) {
+			return false;
+		}
+
+		for (auto &provider : reverse(index, edge.node)) {
+			if (provider.kind == canister::graph::kind::provides) {
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	nlohmann::json edge_json(const canister::graph::index &index, const canister::graph::edge &edge) {
+		auto json = nlohmann::json({
+			{ "package", index.names[edge.node] },
+			{ "kind", kind_names[static_cast<int>(edge.kind)] },
+			{ "group", edge.group },
+		});
+
+		if (edge.relation != canister::dpkg::relation::any) {
+			json["relation"] = relation_names[static_cast<int>(edge.relation)];
+			json["version"] = index.constraints[edge.constraint];
+		}
+
+		return json;
+	}
+
+	std::shared_ptr<const canister::graph::index> current() {
+		std::lock_guard lock(graph_mutex);
+		return graph_current;
+	}
+}
+
+void canister::graph::rebuild() {
+	auto index = std::make_shared<canister::graph::index>();
+	builder graph_builder(*index);
+	std::vector<std::pair<std::uint32_t, std::string>> versions;
+
+	// Only the current version of each package takes part, older versions can't be installed alongside it
+	canister::catalog::for_each_current([&](const canister::catalog::vpackage &vpackage) {
+		auto source = graph_builder.intern(vpackage.package);
+		versions.emplace_back(source, vpackage.version);
+
+		std::uint32_t group = 0;
+		graph_builder.relationships(source, vpackage.depends, canister::graph::kind::depends, group);
+		graph_builder.relationships(source, vpackage.pre_depends, canister::graph::kind::pre_depends, group);
+		graph_builder.relationships(source, vpackage.conflicts, canister::graph::kind::conflicts, group);
+		graph_builder.relationships(source, vpackage.provides, canister::graph::kind::provides, group);
+		graph_builder.relationships(source, vpackage.replaces, canister::graph::kind::replaces, group);
+	});
+
+	graph_builder.finish();
+	for (auto &[node, version] : versions) {
+		index->versions[node] = std::move(version);
+	}
+
+	canister::log::info("graph", "indexed " + std::to_string(index->names.size()) + " nodes and " + std::to_string(index->forward.size()) + " edges");
+
+	std::lock_guard lock(graph_mutex);
+	graph_current = std::move(index);
+}
+
+std::optional<std::string> canister::graph::dependencies_json(const std::string &id) {
+	auto index = current();
+	auto node = index->ids.find(id);
+	if (node == index->ids.end() || index->versions[node->second].empty()) {
+		return std::nullopt;
+	}
+
+	auto edges = nlohmann::json::array();
+	for (auto &edge : forward(*index, node->second)) {
+		auto json = edge_json(*index, edge);
+		json["satisfied"] = satisfied(*index, edge, index->versions[edge.node]);
+		edges.push_back(json);
+	}
+
+	auto json = nlohmann::json({
+		{ "package", id },
+		{ "version", index->versions[node->second] },
+		{ "data", edges },
+	});
+
+	return json.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+}
+
+std::optional<std::string> canister::graph::dependents_json(const std::string &id, std::string_view version) {
+	auto index = current();
+	auto node = index->ids.find(id);
+	if (node == index->ids.end()) {
+		return std::nullopt;
+	}
+
+	auto target = node->second;
+	auto edges = nlohmann::json::array();
+	auto breaks = nlohmann::json::array();
+
+	for (auto &edge : reverse(*index, target)) {
+		auto json = edge_json(*index, edge);
+		auto before = satisfied(*index, edge, index->versions[target]);
+		json["satisfied"] = before;
+
+		// A dependent only breaks when the proposed version fails a relationship that holds today and no alternative in the same group does
+		if (!version.empty() && (edge.kind == canister::graph::kind::depends || edge.kind == canister::graph::kind::pre_depends)) {
+			auto after = canister::dpkg::satisfies(version, edge.relation, index->constraints[edge.constraint]);
+			json["satisfied_after"] = after;
+
+			if (before && !after) {
+				auto alternative = false;
+				for (auto &sibling : forward(*index, edge.node)) {
+					if (sibling.group == edge.group && sibling.node != target && satisfied(*index, sibling, index->versions[sibling.node])) {
+						alternative = true;
+						break;
+					}
+				}
+
+				if (!alternative) {
+					breaks.push_back(index->names[edge.node]);
+				}
+			}
+		}
+
+		edges.push_back(json);
+	}
+
+	auto json = nlohmann::json({
+		{ "package", id },
+		{ "data", edges },
+	});
+
+	if (!version.empty()) {
+		json["version"] = version;
+		json["breaks"] = breaks;
+	}
+
+	return json.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+}
+
+std::optional<std::string> canister::graph::providers_json(const std::string &name) {
+	auto index = current();
+	auto node = index->ids.find(name);
+	if (node == index->ids.end()) {
+		return std::nullopt;
+	}
+
+	// A real package with that name counts as providing itself
+	auto providers = nlohmann::json::array();
+	if (!index->versions[node->second].empty()) {
+		providers.push_back({
+			{ "package", name },
+			{ "version", index->versions[node->second] },
+		});
+	}
+
+	for (auto &edge : reverse(*index, node->second)) {
+		if (edge.kind != canister::graph::kind::provides) {
+			continue;
+		}
+
+		auto provider = nlohmann::json({
+			{ "package", index->names[edge.node] },
+			{ "version", index->versions[edge.node] },
+		});
+
+		if (edge.relation == canister::dpkg::relation::equal) {
+			provider["provides_version"] = index->constraints[edge.constraint];
+		}
+
+		providers.push_back(provider);
+	}
+
+	auto json = nlohmann::json({
+		{ "name", name },
+		{ "data", providers },
+	});
+
+	return json.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
+}
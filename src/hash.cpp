@@ -0,0 +1,311 @@
+#include <canister.h>
+
+// SHA-256 with a SHA-NI path for CPUs that have it and a portable fallback
+// The implementation is picked once at runtime and never changes, so hashers on any thread can share it
+namespace {
+	using compress_function = void (*)(std::uint32_t *state, const std::uint8_t *data, std::size_t blocks);
+
+	alignas(16) constexpr std::uint32_t round_constants[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+		0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+		0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+		0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+		0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+		0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+	};
+
+	constexpr std::uint32_t rotate(std::uint32_t value, int bits) {
+		return (value >> bits) | (value << (32 - bits));
+	}
+
+	void compress_portable(std::uint32_t *state, const std::uint8_t *data, std::size_t blocks) {
+		std::uint32_t schedule[64];
+
+		for (; blocks > 0; blocks--, data += 64) {
+			for (int i = 0; i < 16; i++) {
+				schedule[i] = (std::uint32_t(data[i * 4]) << 24) | (std::uint32_t(data[i * 4 + 1]) << 16) | (std::uint32_t(data[i * 4 + 2]) << 8) | std::uint32_t(data[i * 4 + 3]);
+			}
+
+			for (int i = 16; i < 64; i++) {
+				auto s0 = rotate(schedule[i - 15], 7) ^ rotate(schedule[i - 15], 18) ^ (schedule[i - 15] >> 3);
+				auto s1 = rotate(schedule[i - 2], 17) ^ rotate(schedule[i - 2], 19) ^ (schedule[i - 2] >> 10);
+				schedule[i] = schedule[i - 16] + s0 + schedule[i - 7] + s1;
+			}
+
+			auto a = state[0], b = state[1], c = state[2], d = state[3];
+			auto e = state[4], f = state[5], g = state[6], h = state[7];
+
+			for (int i = 0; i < 64; i++) {
+				auto s1 = rotate(e, 6) ^ rotate(e, 11) ^ rotate(e, 25);
+				auto choice = (e & f) ^ (~e & g);
+				auto first = h + s1 + choice + round_constants[i] + schedule[i];
+				auto s0 = rotate(a, 2) ^ rotate(a, 13) ^ rotate(a, 22);
+				auto majority = (a & b) ^ (a & c) ^ (b & c);
+				auto second = s0 + majority;
+
+				h = g;
+				g = f;
+				f = e;
+				e = d + first;
+				d = c;
+				c = b;
+				b = a;
+				a = first + second;
+			}
+
+			state[0] += a;
+			state[1] += b;
+			state[2] += c;
+			state[3] += d;
+			state[4] += e;
+			state[5] += f;
+			state[6] += g;
+			state[7] += h;
+		}
+	}
+
+#if defined(__x86_64__)
+	__attribute__((target("sha,sse4.1"))) void compress_sha_ni(std::uint32_t *state, const std::uint8_t *data, std::size_t blocks) {
+		const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+		// The instructions want the state as ABEF and CDGH instead of ABCD and EFGH
+		__m128i swapped = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[0])), 0xB1);
+		__m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(&state[4])), 0x1B);
+		__m128i state0 = _mm_alignr_epi8(swapped, state1, 8);
+		state1 = _mm_blend_epi16(state1, swapped, 0xF0);
+
+		for (; blocks > 0; blocks--, data += 64) {
+			const __m128i saved0 = state0;
+			const __m128i saved1 = state1;
+			__m128i words[4];
+
+			for (int group = 0; group < 16; group++) {
+				auto &current = words[group % 4];
+
+				if (group < 4) {
+					current = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(data + group * 16)), byte_swap);
+				} else {
+					auto scheduled = _mm_sha256msg1_epu32(current, words[(group + 1) % 4]);
+					scheduled = _mm_add_epi32(scheduled, _mm_alignr_epi8(words[(group + 3) % 4], words[(group + 2) % 4], 4));
+					current = _mm_sha256msg2_epu32(scheduled, words[(group + 3) % 4]);
+				}
+
+				auto message = _mm_add_epi32(current, _mm_load_si128(reinterpret_cast<const __m128i *>(&round_constants[group * 4])));
+				state1 = _mm_sha256rnds2_epu32(state1, state0, message);
+				state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(message, 0x0E));
+			}
+
+			state0 = _mm_add_epi32(state0, saved0);
+			state1 = _mm_add_epi32(state1, saved1);
+		}
+
+		swapped = _mm_shuffle_epi32(state0, 0x1B);
+		state1 = _mm_shuffle_epi32(state1, 0xB1);
+		state0 = _mm_blend_epi16(swapped, state1, 0xF0);
+		state1 = _mm_alignr_epi8(state1, swapped, 8);
+
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(&state[0]), state0);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(&state[4]), state1);
+	}
+#endif
+
+	bool sha_ni_supported() {
+#if defined(__x86_64__)
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+#else
+		return false;
+#endif
+	}
+
+	compress_function select_compress() {
+#if defined(__x86_64__)
+		if (sha_ni_supported()) {
+			return compress_sha_ni;
+		}
+#endif
+
+		return compress_portable;
+	}
+
+	// A function local static is set up on first use, even by hashers in other translation units' static initializers
+	compress_function compress_blocks() {
+		static const compress_function selected = select_compress();
+		return selected;
+	}
+}
+
+bool canister::hash::supported(canister::hash::engine engine) {
+	return engine == canister::hash::engine::portable || sha_ni_supported();
+}
+
+canister::hash::sha256::sha256()
+	: compress(compress_blocks())
+	, state { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 } {
+}
+
+canister::hash::sha256::sha256(canister::hash::engine engine)
+	: sha256() {
+	if (!canister::hash::supported(engine)) {
+		throw std::runtime_error("hash: engine isn't supported on this CPU");
+	}
+
+#if defined(__x86_64__)
+	compress = engine == canister::hash::engine::sha_ni ? compress_sha_ni : compress_portable;
+#else
+	compress = compress_portable;
+#endif
+}
+
+void canister::hash::sha256::update(std::string_view data) {
+	if (data.empty()) {
+		return;
+	}
+
+	auto bytes = reinterpret_cast<const std::uint8_t *>(data.data());
+	auto remaining = data.size();
+	length += remaining;
+
+	// Top up a partially filled block from the previous update first
+	if (buffered > 0) {
+		auto needed = std::min(remaining, buffer.size() - buffered);
+		std::memcpy(buffer.data() + buffered, bytes, needed);
+
+		buffered += needed;
+		bytes += needed;
+		remaining -= needed;
+
+		if (buffered < buffer.size()) {
+			return;
+		}
+
+		compress(state.data(), buffer.data(), 1);
+		buffered = 0;
+	}
+
+	// Whole blocks are hashed in place without being copied
+	if (remaining >= 64) {
+		compress(state.data(), bytes, remaining / 64);
+		bytes += remaining - remaining % 64;
+		remaining %= 64;
+	}
+
+	if (remaining > 0) {
+		std::memcpy(buffer.data(), bytes, remaining);
+		buffered = remaining;
+	}
+}
+
+canister::hash::digest canister::hash::sha256::finish() {
+	const std::uint64_t bits = length * 8;
+
+	buffer[buffered++] = 0x80;
+	if (buffered > 56) {
+		std::fill(buffer.begin() + buffered, buffer.end(), 0);
+		compress(state.data(), buffer.data(), 1);
+		buffered = 0;
+	}
+
+	std::fill(buffer.begin() + buffered, buffer.begin() + 56, 0);
+	for (int i = 0; i < 8; i++) {
+		buffer[63 - i] = static_cast<std::uint8_t>(bits >> (i * 8));
+	}
+
+	compress(state.data(), buffer.data(), 1);
+
+	canister::hash::digest result;
+	for (int i = 0; i < 8; i++) {
+		result[i * 4] = static_cast<std::uint8_t>(state[i] >> 24);
+		result[i * 4 + 1] = static_cast<std::uint8_t>(state[i] >> 16);
+		result[i * 4 + 2] = static_cast<std::uint8_t>(state[i] >> 8);
+		result[i * 4 + 3] = static_cast<std::uint8_t>(state[i]);
+	}
+
+	return result;
+}
+
+canister::hash::digest canister::hash::digest_of(std::string_view data) {
+	canister::hash::sha256 hasher;
+	hasher.update(data);
+	return hasher.finish();
+}
+
+std::optional<canister::hash::digest> canister::hash::from_hex(std::string_view hex) {
+	if (hex.size() != 64) {
+		return std::nullopt;
+	}
+
+	auto nibble = [](char value) -> int {
+		if (value >= '0' && value <= '9') {
+			return value - '0';
+		}
+
+		// Repositories aren't consistent about the case of their hashes
+		value = static_cast<char>(std::tolower(static_cast<unsigned char>(value)));
+		if (value >= 'a' && value <= 'f') {
+			return value - 'a' + 10;
+		}
+
+		return -1;
+	};
+
+	canister::hash::digest result;
+	for (size_t i = 0; i < result.size(); i++) {
+		auto high = nibble(hex[i * 2]);
+		auto low = nibble(hex[i * 2 + 1]);
+
+		if (high < 0 || low < 0) {
+			return std::nullopt;
+		}
+
+		result[i] = static_cast<std::uint8_t>((high << 4) | low);
+	}
+
+	return result;
+}
+
+std::string canister::hash::to_hex(const canister::hash::digest &digest) {
+	constexpr char characters[] = "0123456789abcdef";
+	std::string hex(digest.size() * 2, '0');
+
+	for (size_t i = 0; i < digest.size(); i++) {
+		hex[i * 2] = characters[digest[i] >> 4];
+		hex[i * 2 + 1] = characters[digest[i] & 0x0f];
+	}
+
+	return hex;
+}
+
+bool canister::hash::verify(std::string_view data, std::string_view expected_hex) {
+	auto expected = canister::hash::from_hex(expected_hex);
+	if (!expected.has_value()) {
+		return false;
+	}
+
+	return canister::hash::digest_of(data) == expected.value();
+}
+
+std::optional<canister::hash::digest> canister::hash::fingerprint(std::string_view sha_256, std::string_view size, std::string_view version) {
+	// Stanzas without a usable hash can't be told apart from a different build, so they're never merged
+	auto content = canister::hash::from_hex(sha_256);
+	if (!content.has_value()) {
+		return std::nullopt;
+	}
+
+	canister::hash::sha256 hasher;
+	hasher.update(std::string_view(reinterpret_cast<const char *>(content->data()), content->size()));
+	hasher.update(std::string_view("\0", 1));
+	hasher.update(size);
+	hasher.update(std::string_view("\0", 1));
+	hasher.update(version);
+	return hasher.finish();
+}
+
+std::size_t canister::hash::digest_hasher::operator()(const canister::hash::digest &digest) const {
+	// The digest is already uniformly distributed, any slice of it is a good hash
+	std::size_t value;
+	std::memcpy(&value, digest.data(), sizeof(value));
+	return value;
+}
@@ -1,5 +1,173 @@
 #include <canister.h>
 
+// Every worker runs its own app on its own loop, anything published has to be handed to that loop first
+std::mutex workers_mutex;
+std::vector<std::pair<uWS::App *, uWS::Loop *>> workers;
+std::vector<std::pair<uWS::Loop *, us_listen_socket_t *>> listen_sockets;
+std::vector<std::thread> worker_threads;
+
+// Every worker reports once whether it got the port, start() waits on all of them before anything else runs
+std::mutex startup_mutex;
+std::condition_variable startup_changed;
+unsigned startup_reported = 0;
+bool startup_failed = false;
+thread_local us_listen_socket_t *listening = nullptr;
+
+// The last manifest that was served in full, kept so a 304 can hand it out again
+std::mutex manifest_mutex;
+std::optional<nlohmann::json> manifest_last;
+std::string manifest_etag;
+std::string manifest_last_modified;
+
+// Hosts that keep failing are skipped until their cooldown runs out, keyed by scheme and authority
+std::mutex breakers_mutex;
+std::unordered_map<std::string, canister::http::breaker> breakers;
+
+// Politeness towards every host and the shared bandwidth cap, all of it guarded by traffic_mutex
+std::mutex traffic_mutex;
+std::condition_variable traffic_changed;
+std::unordered_map<std::string, canister::http::bucket> buckets;
+std::set<std::tuple<canister::http::priority, std::uint64_t, std::string>> admissions;
+std::uint64_t admissions_sequence = 0;
+std::array<canister::http::traffic_stats, 4> traffic_counters;
+double bandwidth_tokens = 0;
+std::chrono::steady_clock::time_point bandwidth_refilled = std::chrono::steady_clock::now();
+std::uint64_t bandwidth_bytes = 0;
+
+// Emptied buffers waiting for the next fetch, so multi-megabyte bodies don't go back to the allocator every time
+std::mutex buffer_pool_mutex;
+std::vector<std::string> buffer_pool;
+
+namespace {
+	std::string host_of(std::string_view url) {
+		auto scheme = url.find("://");
+		auto start = scheme == std::string_view::npos ? 0 : scheme + 3;
+		return std::string(url.substr(0, url.find('/', start)));
+	}
+
+	// Full jitter keeps every repository on a flaky host from retrying in lockstep
+	void backoff(std::uint32_t attempt) {
+		thread_local std::mt19937_64 random(std::random_device {}());
+		auto ceiling = static_cast<std::uint64_t>(canister::config::get().fetch_retry_delay) << std::min<std::uint32_t>(attempt, 10);
+		std::this_thread::sleep_for(std::chrono::milliseconds(std::uniform_int_distribution<std::uint64_t>(0, ceiling)(random)));
+	}
+
+	const std::array<std::string, 4> traffic_names = { "release", "packages", "price", "deb" };
+
+	using header_handler = std::function<void(const std::string &name, std::string_view value)>;
+
+	// Responses land in the buffer as curl hands them over, every chunk is paid for from the shared bandwidth first
+	// A known Content-Length sizes the buffer up front so a big body is never moved while it arrives
+	void write_into(curlpp::Easy &request, canister::http::buffer &body, canister::http::traffic kind, const header_handler &on_header = {}) {
+		request.setOpt(new curlpp::options::WriteFunction([&body, kind](char *data, size_t size, size_t count) -> size_t {
+			auto length = size * count;
+			canister::http::throttle(length, kind);
+			body.append(data, length);
+			return length;
+		}));
+
+		request.setOpt(new curlpp::options::HeaderFunction([&body, on_header](char *data, size_t size, size_t count) -> size_t {
+			std::string_view line(data, size * count);
+			auto separator = line.find(':');
+			if (separator == std::string_view::npos) {
+				return size * count;
+			}
+
+			std::string name(line.substr(0, separator));
+			std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+			auto value = line.substr(separator + 1);
+			value.remove_prefix(std::min(value.find_first_not_of(' '), value.size()));
+			value.remove_suffix(value.size() - std::min(value.find_last_not_of("\r\n") + 1, value.size()));
+
+			if (name == "content-length") {
+				std::uint64_t length = 0;
+				auto [end, error] = std::from_chars(value.data(), value.data() + value.size(), length);
+				if (error == std::errc() && length <= HTTP_PRESIZE_LIMIT) {
+					body.reserve(length);
+				}
+			}
+
+			if (on_header) {
+				on_header(name, value);
+			}
+
+			return size * count;
+		}));
+	}
+}
+
+canister::http::buffer::buffer() {
+	std::lock_guard lock(buffer_pool_mutex);
+	if (!buffer_pool.empty()) {
+		storage = std::move(buffer_pool.back());
+		buffer_pool.pop_back();
+	}
+
+	pooled = true;
+}
+
+canister::http::buffer::buffer(canister::http::buffer &&other) noexcept : storage(std::move(other.storage)), pooled(other.pooled) {
+	other.pooled = false;
+}
+
+canister::http::buffer &canister::http::buffer::operator=(canister::http::buffer &&other) noexcept {
+	if (this != &other) {
+		release();
+		storage = std::move(other.storage);
+		pooled = other.pooled;
+		other.pooled = false;
+	}
+
+	return *this;
+}
+
+canister::http::buffer::~buffer() {
+	release();
+}
+
+void canister::http::buffer::release() {
+	if (!pooled) {
+		return;
+	}
+
+	pooled = false;
+	if (storage.capacity() > HTTP_BUFFER_RETAIN) {
+		return;
+	}
+
+	storage.clear();
+
+	// The biggest buffers are the ones worth keeping, a full pool gives up its smallest
+	std::lock_guard lock(buffer_pool_mutex);
+	if (buffer_pool.size() < HTTP_BUFFER_POOL) {
+		buffer_pool.push_back(std::move(storage));
+	} else if (buffer_pool.front().capacity() < storage.capacity()) {
+		buffer_pool.front() = std::move(storage);
+	}
+
+	// Kept smallest to largest so the constructor hands out the biggest from the back, a Packages body then rarely has to regrow
+	std::sort(buffer_pool.begin(), buffer_pool.end(), [](const auto &left, const auto &right) {
+		return left.capacity() < right.capacity();
+	});
+}
+
+void canister::http::buffer::reserve(std::size_t size) {
+	storage.reserve(size);
+}
+
+void canister::http::buffer::append(const char *data, std::size_t size) {
+	storage.append(data, size);
+}
+
+void canister::http::buffer::clear() {
+	storage.clear();
+}
+
+std::string_view canister::http::buffer::view() const {
+	return storage;
+}
+
 uWS::App canister::http::http_server() {
 	auto server = uWS::App();
 
@@ -38,7 +206,10 @@ uWS::App canister::http::http_server() {
 				ws->send(json.dump(), uWS::TEXT);
 				if (status == "unauthorized") {
 					ws->end(401);
+					return;
 				}
+
+				ws->subscribe("refresh");
 			},
 
 			.message = [](uWS::WebSocket<false, true, std::string> *ws, std::string_view message, uWS::OpCode code) {
@@ -47,151 +218,710 @@ uWS::App canister::http::http_server() {
 					return;
 				}
 
-				// Refresh command
+				// Refreshes are handed to the coordinator so this worker's loop never blocks on one
+				// Progress comes back to every authorized socket through the refresh topic
 				if (message == "refresh") {
-					try {
-						canister::log::info("http", "fetching repository manifest");
-						auto manifest = canister::http::manifest();
-						if (!manifest.has_value()) {
-							ws->send("fail:refresh", uWS::TEXT);
-							return;
-						}
-
-						canister::parser::parse_manifest(manifest.value(), ws);
-					} catch (curlpp::LogicError &exc) {
-						auto message = "failed to fetch manifest (logic): " + std::string(exc.what());
-						canister::log::error("http", message);
-					} catch (curlpp::RuntimeError &exc) {
-						auto message = "failed to fetch manifest (runtime): " + std::string(exc.what());
-						canister::log::error("http", message);
-					}
+					canister::log::info("http", "refresh requested");
+					canister::scheduler::request_refresh();
+				}
+
+				// Downstream consumers opt into the per-repository change feed published after every ingest
+				if (message == "subscribe:changes") {
+					ws->subscribe("changes");
+				} else if (message == "unsubscribe:changes") {
+					ws->unsubscribe("changes");
 				}
 			},
 		});
 
+	// Only the timestamp changes between requests so there's no reason to go through a JSON object
 	server.get("/healthz", [](uWS::HttpResponse<false> *res, __attribute__((unused)) uWS::HttpRequest *req) {
-		auto json = nlohmann::json({
-			{ "status", "200 OK" },
-			{ "timestamp", canister::util::timestamp() },
+		canister::http::respond(res, "200 OK", R"({"status":"200 OK","timestamp":")" + canister::util::timestamp() + R"("})");
+	});
+
+	// Request and bandwidth counters so refresh duration can be tuned against how hard hosts get hit
+	server.get("/stats", [](uWS::HttpResponse<false> *res, __attribute__((unused)) uWS::HttpRequest *req) {
+		canister::http::respond(res, "200 OK", canister::http::stats().dump());
+	});
+
+	// Read API served straight out of the in-memory catalog
+	// Everything but search is rendered once per catalog generation and served from the response cache
+	server.get("/v1/package/:id", [](uWS::HttpResponse<false> *res, uWS::HttpRequest *req) {
+		auto id = std::string(req->getParameter(0));
+		auto payload = canister::responses::get("package:" + id, [&id]() {
+			return canister::catalog::package_json(id);
 		});
 
-		res->cork([res, json]() {
-			res->writeHeader("Content-Type", "application/json");
-			res->writeStatus("200 OK");
-			res->end(json.dump());
+		if (!payload) {
+			canister::http::respond(res, "404 Not Found", R"({"status":"404 Not Found"})");
+			return;
+		}
+
+		canister::http::respond(res, req, *payload);
+	});
+
+	// Control files are only read out of debs that are already cached, nothing is downloaded on request
+	server.get("/v1/package/:id/control", [](uWS::HttpResponse<false> *res, uWS::HttpRequest *req) {
+		auto id = std::string(req->getParameter(0));
+		auto payload = canister::responses::get("control:" + id, [&id]() -> std::optional<std::string> {
+			auto vpackage = canister::catalog::current_vpackage(id);
+			if (!vpackage.has_value()) {
+				return std::nullopt;
+			}
+
+			auto path = canister::deb::cached(vpackage->sha_256);
+			if (!path.has_value()) {
+				return std::nullopt;
+			}
+
+			std::optional<canister::deb::control_info> control;
+			try {
+				control = canister::deb::control(path.value());
+			} catch (std::exception &exc) {
+				canister::log::error("deb", exc.what());
+			}
+
+			if (!control.has_value()) {
+				return std::nullopt;
+			}
+
+			auto json = nlohmann::json({
+				{ "package", vpackage->package },
+				{ "version", vpackage->version },
+				{ "sha_256", vpackage->sha_256 },
+				{ "fields", control->fields },
+				{ "scripts", control->scripts },
+			});
+
+			return json.dump(-1, ' ', false, nlohmann::json::error_handler_t::replace);
 		});
+
+		if (!payload) {
+			canister::http::respond(res, "404 Not Found", R"({"status":"404 Not Found"})");
+			return;
+		}
+
+		canister::http::respond(res, req, *payload);
 	});
 
-	// uws tries globstar methods last so we can use it to catch 404s
-	server.any("/*", [](uWS::HttpResponse<false> *res, __attribute__((unused)) uWS::HttpRequest *req) {
-		auto json = nlohmann::json({
-			{ "status", "404 Not Found" },
-			{ "timestamp", canister::util::timestamp() },
+	// Relationships come from the dependency graph, which is rebuilt once every refresh settles
+	server.get("/v1/package/:id/dependencies", [](uWS::HttpResponse<false> *res, uWS::HttpRequest *req) {
+		auto id = std::string(req->getParameter(0));
+		auto payload = canister::responses::get("dependencies:" + id, [&id]() {
+			return canister::graph::dependencies_json(id);
 		});
 
-		res->cork([res, json]() {
-			res->writeHeader("Content-Type", "application/json");
-			res->writeStatus("404 Not Found");
-			res->end(json.dump());
+		if (!payload) {
+			canister::http::respond(res, "404 Not Found", R"({"status":"404 Not Found"})");
+			return;
+		}
+
+		canister::http::respond(res, req, *payload);
+	});
+
+	// Passing a version reports which dependents would stop being installable if the package moved to it
+	server.get("/v1/package/:id/dependents", [](uWS::HttpResponse<false> *res, uWS::HttpRequest *req) {
+		auto id = std::string(req->getParameter(0));
+		auto version = std::string(req->getQuery("version"));
+		auto render = [&id, &version]() {
+			return canister::graph::dependents_json(id, version);
+		};
+
+		// Versions come straight from the client, caching them would let anyone flush the cache for everyone else
+		std::shared_ptr<const canister::responses::payload> payload;
+		if (version.empty()) {
+			payload = canister::responses::get("dependents:" + id, render);
+		} else if (auto body = render()) {
+			payload = canister::responses::build(std::move(body.value()));
+		}
+
+		if (!payload) {
+			canister::http::respond(res, "404 Not Found", R"({"status":"404 Not Found"})");
+			return;
+		}
+
+		canister::http::respond(res, req, *payload);
+	});
+
+	server.get("/v1/provides/:name", [](uWS::HttpResponse<false> *res, uWS::HttpRequest *req) {
+		auto name = std::string(req->getParameter(0));
+		auto payload = canister::responses::get("provides:" + name, [&name]() {
+			return canister::graph::providers_json(name);
 		});
+
+		if (!payload) {
+			canister::http::respond(res, "404 Not Found", R"({"status":"404 Not Found"})");
+			return;
+		}
+
+		canister::http::respond(res, req, *payload);
 	});
 
-	server.listen(8080, [](auto *socket) {
-		if (socket) {
-			canister::log::info("http", "running successfully");
-		} else {
-			canister::log::error("http", "failed to bind to socket");
+	server.get("/v1/repo/:slug", [](uWS::HttpResponse<false> *res, uWS::HttpRequest *req) {
+		auto slug = std::string(req->getParameter(0));
+		auto payload = canister::responses::get("repository:" + slug, [&slug]() {
+			return canister::catalog::repository_json(slug);
+		});
+
+		if (!payload) {
+			canister::http::respond(res, "404 Not Found", R"({"status":"404 Not Found"})");
+			return;
+		}
+
+		canister::http::respond(res, req, *payload);
+	});
+
+	server.get("/v1/repos", [](uWS::HttpResponse<false> *res, uWS::HttpRequest *req) {
+		auto payload = canister::responses::get("repositories", []() -> std::optional<std::string> {
+			return canister::catalog::repositories_json();
+		});
+
+		canister::http::respond(res, req, *payload);
+	});
+
+	server.get("/v1/sections", [](uWS::HttpResponse<false> *res, uWS::HttpRequest *req) {
+		auto payload = canister::responses::get("sections", []() -> std::optional<std::string> {
+			return canister::catalog::sections_json();
+		});
+
+		canister::http::respond(res, req, *payload);
+	});
+
+	server.get("/v1/search", [](uWS::HttpResponse<false> *res, uWS::HttpRequest *req) {
+		auto query = req->getQuery("q");
+		if (query.empty()) {
+			canister::http::respond(res, "400 Bad Request", R"({"status":"400 Bad Request","message":"missing query parameter q"})");
+			return;
+		}
+
+		canister::http::respond(res, "200 OK", canister::catalog::search_json(query, 100));
+	});
+
+	// uws tries globstar methods last so we can use it to catch 404s
+	server.any("/*", [](uWS::HttpResponse<false> *res, __attribute__((unused)) uWS::HttpRequest *req) {
+		canister::http::respond(res, "404 Not Found", R"({"status":"404 Not Found","timestamp":")" + canister::util::timestamp() + R"("})");
+	});
+
+	server.listen(canister::config::get().port, [](auto *socket) {
+		listening = socket;
+		if (!socket) {
+			canister::log::error("http", "failed to bind to port " + std::to_string(canister::config::get().port));
 		}
 	});
 
 	return server;
 };
 
+namespace {
+	void report_startup(bool bound) {
+		std::lock_guard lock(startup_mutex);
+		startup_reported++;
+		startup_failed = startup_failed || !bound;
+		startup_changed.notify_all();
+	}
+}
+
+bool canister::http::start() {
+	auto configured = canister::config::get().http_workers;
+	auto count = configured > 0 ? configured : std::max(1u, std::thread::hardware_concurrency());
+
+	// uSockets listens with SO_REUSEPORT so every app binds the same port and the kernel spreads connections between them
+	for (unsigned worker = 0; worker < count; worker++) {
+		worker_threads.emplace_back([]() {
+			bool reported = false;
+
+			try {
+				auto server = canister::http::http_server();
+				if (!listening) {
+					report_startup(false);
+					return;
+				}
+
+				{
+					std::lock_guard lock(workers_mutex);
+					workers.emplace_back(&server, uWS::Loop::get());
+					listen_sockets.emplace_back(uWS::Loop::get(), listening);
+				}
+
+				report_startup(true);
+				reported = true;
+				server.run();
+
+				std::lock_guard lock(workers_mutex);
+				workers.erase(std::remove(workers.begin(), workers.end(), std::make_pair(&server, uWS::Loop::get())), workers.end());
+			} catch (std::exception &exc) {
+				canister::log::error("http", exc.what());
+				if (!reported) {
+					report_startup(false);
+				}
+			}
+		});
+	}
+
+	{
+		std::unique_lock lock(startup_mutex);
+		startup_changed.wait(lock, [count]() {
+			return startup_reported == count;
+		});
+
+		if (!startup_failed) {
+			canister::log::info("http", "serving on " + std::to_string(count) + " workers");
+			return true;
+		}
+	}
+
+	// Workers that did bind stop listening so their loops run dry and every thread can be joined
+	{
+		std::lock_guard lock(workers_mutex);
+		for (auto &[loop, socket] : listen_sockets) {
+			loop->defer([socket]() {
+				us_listen_socket_close(0, socket);
+			});
+		}
+	}
+
+	canister::http::wait();
+	return false;
+}
+
+void canister::http::wait() {
+	for (auto &thread : worker_threads) {
+		thread.join();
+	}
+
+	worker_threads.clear();
+}
+
+void canister::http::broadcast(const std::string &topic, const std::string &message) {
+	std::lock_guard lock(workers_mutex);
+
+	// Apps aren't thread safe, so each one publishes from its own loop
+	for (auto &[app, loop] : workers) {
+		loop->defer([app, topic, message]() {
+			app->publish(topic, message, uWS::TEXT);
+		});
+	}
+}
+
+void canister::http::respond(uWS::HttpResponse<false> *res, std::string_view status, std::string_view body) {
+	// The status has to be written before any header or uWS will send a 200 in its place
+	res->cork([res, status, body]() {
+		res->writeStatus(status);
+		res->writeHeader("Content-Type", "application/json");
+		res->end(body);
+	});
+}
+
+void canister::http::respond(uWS::HttpResponse<false> *res, uWS::HttpRequest *req, const canister::responses::payload &payload) {
+	// Clients that already hold this generation of the payload only get the status back
+	auto if_none_match = req->getHeader("if-none-match");
+	if (if_none_match == "*" || if_none_match.find(payload.etag) != std::string_view::npos) {
+		res->cork([res, &payload]() {
+			res->writeStatus("304 Not Modified");
+			res->writeHeader("ETag", payload.etag);
+			res->writeHeader("Vary", "Accept-Encoding");
+			res->endWithoutBody();
+		});
+
+		return;
+	}
+
+	// Prefer zstd since it's smaller, fall back to gzip and then the plain body
+	auto accept_encoding = req->getHeader("accept-encoding");
+	std::string_view encoding;
+	std::string_view body = payload.identity;
+
+	if (!payload.zstd.empty() && accept_encoding.find("zstd") != std::string_view::npos) {
+		encoding = "zstd";
+		body = payload.zstd;
+	} else if (!payload.gzip.empty() && accept_encoding.find("gzip") != std::string_view::npos) {
+		encoding = "gzip";
+		body = payload.gzip;
+	}
+
+	res->cork([res, &payload, encoding, body]() {
+		res->writeStatus("200 OK");
+		res->writeHeader("Content-Type", "application/json");
+		res->writeHeader("ETag", payload.etag);
+		res->writeHeader("Vary", "Accept-Encoding");
+
+		if (!encoding.empty()) {
+			res->writeHeader("Content-Encoding", encoding);
+		}
+
+		res->end(body);
+	});
+}
+
 std::list<std::string> canister::http::headers() {
 	std::list<std::string> headers;
 	headers.push_back("X-Firmware: 2.0");
 	headers.push_back("X-Machine: iPhone13,1");
 	headers.push_back("Cache-Control: no-cache");
-	headers.push_back("User-Agent: Canister/2.0; (+https://canister.me/go/ua)");
+	headers.push_back("User-Agent: " + canister::config::get().user_agent);
 	headers.push_back("X-Unique-ID: canister-v2-unique-device-identifier");
 	return headers;
 }
 
-std::optional<nlohmann::json> canister::http::manifest() {
-	try {
-		curlpp::Easy request;
-		std::ostringstream response_stream;
+void canister::http::apply_policy(curlpp::Easy &request, std::uint32_t timeout) {
+	const auto &settings = canister::config::get();
+
+	// Without NoSignal curl uses SIGALRM for its timeouts, which isn't safe with more than one thread fetching
+	request.setOpt(new curlpp::options::NoSignal(true));
+	request.setOpt(new curlpp::options::ConnectTimeout(settings.connect_timeout));
+	request.setOpt(new curlpp::options::Timeout(timeout));
+	request.setOpt(new curlpp::options::LowSpeedLimit(settings.low_speed_limit));
+	request.setOpt(new curlpp::options::LowSpeedTime(settings.low_speed_time));
+}
+
+canister::http::attempt canister::http::classify(long status) {
+	if (status == 408 || status == 425 || status == 429 || status >= 500) {
+		return canister::http::attempt::retry;
+	}
+
+	return canister::http::attempt::fail;
+}
+
+bool canister::http::with_policy(const std::string &url, canister::http::priority priority, const std::function<canister::http::attempt()> &perform) {
+	const auto &settings = canister::config::get();
+	auto host = host_of(url);
+
+	{
+		std::lock_guard lock(breakers_mutex);
+		auto &state = breakers[host];
+		if (state.open_until > std::chrono::steady_clock::now()) {
+			state.skipped++;
+			return false;
+		}
+
+		// Once the cooldown is over a single request finds out if the host is back, everything else keeps skipping it
+		if (state.failures >= settings.breaker_threshold) {
+			if (state.probing) {
+				state.skipped++;
+				return false;
+			}
+
+			state.probing = true;
+		}
+	}
+
+	auto outcome = canister::http::attempt::fail;
+	for (std::uint32_t attempt = 0; attempt < settings.fetch_attempts; attempt++) {
+		if (attempt > 0) {
+			backoff(attempt);
+		}
+
+		// Retries take a token as well, a struggling host shouldn't see more requests because of it
+		canister::http::admit(host, priority);
+
+		// Timeouts, refused connections and failed lookups all surface as runtime errors
+		try {
+			outcome = perform();
+		} catch (curlpp::RuntimeError &) {
+			outcome = canister::http::attempt::retry;
+		} catch (std::exception &) {
+			outcome = canister::http::attempt::fail;
+		}
+
+		if (outcome != canister::http::attempt::retry) {
+			break;
+		}
+	}
+
+	// A host that answered at all is healthy, even if the answer was a 404
+	std::lock_guard lock(breakers_mutex);
+	auto &state = breakers[host];
+	state.probing = false;
+
+	if (outcome == canister::http::attempt::retry) {
+		if (++state.failures >= settings.breaker_threshold) {
+			state.open_until = std::chrono::steady_clock::now() + std::chrono::seconds(settings.breaker_cooldown);
+			canister::log::error("http", host + " - failed " + std::to_string(state.failures) + " times in a row, skipping it for " + std::to_string(settings.breaker_cooldown) + "s");
+		}
+	} else {
+		if (state.failures >= settings.breaker_threshold) {
+			canister::log::info("http", host + " - recovered");
+		}
+
+		state.failures = 0;
+	}
+
+	return outcome == canister::http::attempt::success;
+}
+
+std::chrono::milliseconds canister::http::admit(const std::string &host, canister::http::priority priority) {
+	const auto &settings = canister::config::get();
+	auto started = std::chrono::steady_clock::now();
+
+	std::unique_lock lock(traffic_mutex);
+	auto ticket = std::make_tuple(priority, admissions_sequence++, host);
+	admissions.insert(ticket);
+
+	auto &bucket = buckets.try_emplace(host, canister::http::bucket { .tokens = static_cast<double>(settings.host_burst), .refilled = started }).first->second;
+	auto &counters = traffic_counters[static_cast<std::size_t>(priority.kind)];
+	counters.waiting++;
+
+	while (true) {
+		auto now = std::chrono::steady_clock::now();
+		auto refill = std::chrono::duration<double>(now - bucket.refilled).count() * settings.host_rate;
+		bucket.tokens = std::min<double>(settings.host_burst, bucket.tokens + refill);
+		bucket.refilled = now;
+
+		// Only the most urgent request for a host takes its next token, everything else for that host queues behind it
+		auto first = std::find_if(admissions.begin(), admissions.end(), [&host](const auto &waiting) {
+			return std::get<2>(waiting) == host;
+		});
+
+		if (*first != ticket) {
+			traffic_changed.wait(lock);
+			continue;
+		}
+
+		if (bucket.tokens >= 1) {
+			bucket.tokens -= 1;
+			break;
+		}
+
+		traffic_changed.wait_for(lock, std::chrono::duration<double>((1 - bucket.tokens) / settings.host_rate));
+	}
+
+	admissions.erase(ticket);
+	bucket.requests++;
+
+	auto queued = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started);
+	counters.waiting--;
+	counters.requests++;
+	counters.queued += queued.count();
+
+	traffic_changed.notify_all();
+	return queued;
+}
+
+void canister::http::throttle(std::size_t bytes, canister::http::traffic kind) {
+	const auto limit = canister::config::get().bandwidth_limit;
+	auto started = std::chrono::steady_clock::now();
+
+	std::unique_lock lock(traffic_mutex);
+	auto &counters = traffic_counters[static_cast<std::size_t>(kind)];
+	counters.bytes += bytes;
+	bandwidth_bytes += bytes;
+
+	if (limit == 0) {
+		return;
+	}
+
+	// Background traffic yields to anything more urgent, but only for so long that curl's low speed limit never gives up on it
+	auto yield_until = started + std::chrono::seconds(1);
+	counters.throttling++;
+
+	while (true) {
+		auto now = std::chrono::steady_clock::now();
+		auto refill = std::chrono::duration<double>(now - bandwidth_refilled).count() * static_cast<double>(limit);
+		bandwidth_tokens = std::min<double>(static_cast<double>(limit), bandwidth_tokens + refill);
+		bandwidth_refilled = now;
+
+		auto yielding = now < yield_until && std::any_of(traffic_counters.begin(), traffic_counters.begin() + static_cast<std::size_t>(kind), [](const auto &urgent) {
+			return urgent.throttling > 0;
+		});
 
-		request.setOpt(new curlpp::options::LowSpeedLimit(0));
-		request.setOpt(curlpp::options::Url(MANIFEST_URL));
-		request.setOpt(curlpp::options::HttpHeader(canister::http::headers()));
-		request.setOpt(curlpp::options::WriteStream(&response_stream));
+		// A chunk is let through as soon as there's any budget left, the debt is paid off by whoever comes next
+		if (!yielding && bandwidth_tokens > 0) {
+			bandwidth_tokens -= static_cast<double>(bytes);
+			break;
+		}
+
+		if (yielding) {
+			traffic_changed.wait_until(lock, yield_until);
+		} else {
+			traffic_changed.wait_for(lock, std::chrono::duration<double>(-bandwidth_tokens / static_cast<double>(limit) + 0.001));
+		}
+	}
+
+	counters.throttling--;
+	counters.throttled += std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count();
+	traffic_changed.notify_all();
+}
+
+nlohmann::json canister::http::stats() {
+	const auto &settings = canister::config::get();
+	auto classes = nlohmann::json::object();
+	auto hosts = nlohmann::json::object();
+	std::uint64_t bytes = 0;
+
+	{
+		std::lock_guard lock(traffic_mutex);
+		for (std::size_t index = 0; index < traffic_counters.size(); index++) {
+			auto &counters = traffic_counters[index];
+			classes[traffic_names[index]] = {
+				{ "requests", counters.requests },
+				{ "bytes", counters.bytes },
+				{ "waiting", counters.waiting },
+				{ "queued_ms", counters.queued },
+				{ "throttled_ms", counters.throttled },
+			};
+		}
+
+		for (auto &[host, bucket] : buckets) {
+			hosts[host] = {
+				{ "requests", bucket.requests },
+				{ "tokens", bucket.tokens },
+			};
+		}
+
+		bytes = bandwidth_bytes;
+	}
+
+	// Taken separately so the two locks are never held together
+	{
+		std::lock_guard lock(breakers_mutex);
+		auto now = std::chrono::steady_clock::now();
+		for (auto &[host, state] : breakers) {
+			hosts[host]["failures"] = state.failures;
+			hosts[host]["skipped"] = state.skipped;
+			hosts[host]["open"] = state.open_until > now;
+		}
+	}
+
+	return nlohmann::json({
+		{ "bandwidth", {
+			{ "limit", settings.bandwidth_limit },
+			{ "bytes", bytes },
+		} },
+		{ "host_rate", settings.host_rate },
+		{ "host_burst", settings.host_burst },
+		{ "classes", classes },
+		{ "hosts", hosts },
+	});
+}
+
+std::optional<canister::http::manifest_response> canister::http::manifest() {
+	const auto url = canister::config::get().manifest_url;
+	canister::http::buffer body;
+	std::string etag, last_modified;
+	long http_code = 0;
+
+	// The validators from the last full response let the server answer with a 304 when nothing changed
+	auto headers = canister::http::headers();
+	{
+		std::lock_guard lock(manifest_mutex);
+		if (manifest_last.has_value() && !manifest_etag.empty()) {
+			headers.push_back("If-None-Match: " + manifest_etag);
+		}
+
+		if (manifest_last.has_value() && !manifest_last_modified.empty()) {
+			headers.push_back("If-Modified-Since: " + manifest_last_modified);
+		}
+	}
+
+	// Nothing can be refreshed before the manifest is in, so it goes ahead of every repository
+	auto priority = canister::http::priority { .kind = canister::http::traffic::release, .ranking = std::numeric_limits<std::int8_t>::min() };
+	auto fetched = canister::http::with_policy(url, priority, [&]() {
+		curlpp::Easy request;
+		body.clear();
+		etag.clear();
+		last_modified.clear();
+
+		canister::http::apply_policy(request, canister::config::get().fetch_timeout);
+		request.setOpt(curlpp::options::Url(url));
+		request.setOpt(curlpp::options::HttpHeader(headers));
+		write_into(request, body, priority.kind, [&etag, &last_modified](const std::string &name, std::string_view value) {
+			if (name == "etag") {
+				etag = value;
+			} else if (name == "last-modified") {
+				last_modified = value;
+			}
+		});
 
 		request.perform();
 
-		auto http_code = curlpp::infos::ResponseCode::get(request);
-		if (http_code != 200) {
-			throw new std::runtime_error("invalid status code: " + http_code);
+		http_code = curlpp::infos::ResponseCode::get(request);
+		return http_code == 200 || http_code == 304 ? canister::http::attempt::success : canister::http::classify(http_code);
+	});
+
+	if (!fetched) {
+		return std::nullopt;
+	}
+
+	try {
+		std::lock_guard lock(manifest_mutex);
+		if (http_code == 304) {
+			if (!manifest_last.has_value()) {
+				return std::nullopt;
+			}
+
+			return canister::http::manifest_response { .changed = false, .data = manifest_last.value() };
 		}
 
-		std::string response = response_stream.str();
-		nlohmann::json data = nlohmann::json::parse(response);
-		return data;
+		nlohmann::json data = nlohmann::json::parse(body.view());
+
+		manifest_last = data;
+		manifest_etag = etag;
+		manifest_last_modified = last_modified;
+		return canister::http::manifest_response { .changed = true, .data = data };
 	} catch (...) {
 		return std::nullopt;
 	}
 }
 
-std::optional<std::ostringstream> canister::http::fetch(const std::string url) {
-	try {
+std::optional<canister::http::buffer> canister::http::fetch(const std::string url, canister::http::priority priority) {
+	canister::http::buffer body;
+
+	auto fetched = canister::http::with_policy(url, priority, [&]() {
 		curlpp::Easy request;
-		std::ostringstream response_stream;
+		body.clear();
 
-		// request.setOpt(new curlpp::options::Timeout(10));
-		request.setOpt(new curlpp::options::LowSpeedLimit(0));
+		canister::http::apply_policy(request, canister::config::get().fetch_timeout);
 		request.setOpt(new curlpp::options::Url(url));
 		request.setOpt(new curlpp::options::HttpHeader(canister::http::headers()));
-		request.setOpt(new curlpp::options::WriteStream(&response_stream));
+		write_into(request, body, priority.kind);
 
 		request.perform();
 
 		auto http_code = curlpp::infos::ResponseCode::get(request);
-		if (http_code != 200) {
-			throw new std::runtime_error("invalid status code: " + http_code);
-		}
+		return http_code == 200 ? canister::http::attempt::success : canister::http::classify(http_code);
+	});
 
-		return response_stream;
-	} catch (...) {
+	if (!fetched) {
 		return std::nullopt;
 	}
+
+	return body;
 }
 
-std::optional<std::string> canister::http::sileo_endpoint_price(const std::string package, std::string uri) {
-	try {
-		curlpp::Easy request;
-		std::ostringstream response_stream;
+std::optional<std::string> canister::http::sileo_endpoint_price(std::string_view package, std::string uri, std::int8_t ranking) {
+	canister::http::buffer body;
 
-		uri.erase(std::remove(uri.begin(), uri.end(), '\n'), uri.end());
+	uri.erase(std::remove(uri.begin(), uri.end(), '\n'), uri.end());
 
-		if (uri.ends_with("/")) {
-			uri.pop_back();
-		}
+	if (uri.ends_with("/")) {
+		uri.pop_back();
+	}
+
+	// Prices can wait until every index is in, the packages are ingested as "Paid" otherwise anyway
+	auto priority = canister::http::priority { .kind = canister::http::traffic::price, .ranking = ranking };
+	auto url = uri + "/package/" + std::string(package) + "/info";
+	auto fetched = canister::http::with_policy(url, priority, [&]() {
+		curlpp::Easy request;
+		body.clear();
 
-		request.setOpt(new curlpp::options::Timeout(10));
-		request.setOpt(new curlpp::options::LowSpeedLimit(0));
+		canister::http::apply_policy(request, canister::config::get().sileo_timeout);
 		request.setOpt(new curlpp::options::CustomRequest("POST"));
-		request.setOpt(new curlpp::options::Url(uri + "/package/" + package + "/info"));
+		request.setOpt(new curlpp::options::Url(url));
 		request.setOpt(new curlpp::options::HttpHeader(canister::http::headers()));
-		request.setOpt(new curlpp::options::WriteStream(&response_stream));
+		write_into(request, body, priority.kind);
 
 		request.perform();
 
 		auto http_code = curlpp::infos::ResponseCode::get(request);
-		if (http_code != 200) {
-			throw new std::runtime_error("invalid status code: " + http_code);
-		}
+		return http_code == 200 ? canister::http::attempt::success : canister::http::classify(http_code);
+	});
+
+	if (!fetched) {
+		return std::nullopt;
+	}
 
-		auto json = nlohmann::json::parse(response_stream.str());
+	try {
+		auto json = nlohmann::json::parse(body.view());
 		if (!json.contains("price")) {
 			throw std::runtime_error("missing price field");
 		}
@@ -202,63 +932,67 @@ std::optional<std::string> canister::http::sileo_endpoint_price(const std::strin
 	}
 }
 
-std::optional<std::ostringstream> canister::http::sileo_endpoint(const std::string uri) {
-	try {
+std::optional<canister::http::buffer> canister::http::sileo_endpoint(const std::string uri, std::int8_t ranking) {
+	canister::http::buffer body;
+	auto url = uri + "/payment_endpoint";
+
+	auto priority = canister::http::priority { .kind = canister::http::traffic::packages, .ranking = ranking };
+	auto fetched = canister::http::with_policy(url, priority, [&]() {
 		curlpp::Easy request;
-		std::ostringstream response_stream;
+		body.clear();
 
-		request.setOpt(new curlpp::options::Timeout(10));
-		request.setOpt(new curlpp::options::LowSpeedLimit(0));
-		request.setOpt(new curlpp::options::Url(uri + "/payment_endpoint"));
+		canister::http::apply_policy(request, canister::config::get().sileo_timeout);
+		request.setOpt(new curlpp::options::Url(url));
 		request.setOpt(new curlpp::options::HttpHeader(canister::http::headers()));
-		request.setOpt(new curlpp::options::WriteStream(&response_stream));
+		write_into(request, body, priority.kind);
 
 		request.perform();
 
 		auto http_code = curlpp::infos::ResponseCode::get(request);
-		if (http_code != 200) {
-			throw new std::runtime_error("invalid status code: " + http_code);
-		}
+		return http_code == 200 ? canister::http::attempt::success : canister::http::classify(http_code);
+	});
 
-		return response_stream;
-	} catch (...) {
+	if (!fetched) {
 		return std::nullopt;
 	}
+
+	return body;
 }
 
-std::string canister::http::fetch_release(canister::parser::repo_manifest manifest) {
-	std::string url;
+std::string canister::http::release_url(const canister::parser::repo_manifest &manifest) {
 	if (!manifest.dist.empty() && !manifest.suite.empty()) {
-		url = manifest.uri + "/dists/" + manifest.dist + "/Release";
+		return manifest.uri + "/dists/" + manifest.dist + "/Release";
 	} else {
-		url = manifest.uri + "/Release";
+		return manifest.uri + "/Release";
 	}
+}
+
+std::string canister::http::fetch_release(canister::parser::repo_manifest manifest) {
+	std::string url = canister::http::release_url(manifest);
 
 	try {
-		auto response_stream = canister::http::fetch(url);
+		auto body = canister::http::fetch(url, { .kind = canister::http::traffic::release, .ranking = manifest.ranking });
 
 		std::string file_name = canister::util::safe_fs_name(url);
 		std::string file_path = canister::util::cache_path() + file_name;
 
-		if (!response_stream.has_value()) {
+		if (!body.has_value()) {
 			return std::string("cnstr-not-available");
 		}
 
 		canister::log::info("http", manifest.slug + " - hit: " + url);
-		std::string response = response_stream.value().str();
-		std::ifstream file(file_path);
+		auto response = body->view();
+		canister::util::mapped_file cached(file_path);
 
-		if (file.good()) { // If this is true that means the file exists
-			// Converts our ifstream to a string using streambuf iterators
-			std::string cached = std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-			if (canister::util::matched_hash(response, cached)) {
+		if (cached.good()) { // If this is true that means the file exists
+			if (canister::util::matched_hash(response, cached.view())) {
 				return std::string("cnstr-cache-available");
 			}
 		}
 
 		// Write the response data to the file and then return the file name
 		std::ofstream out(file_path, std::ios::binary | std::ios::out);
-		out << response;
+		out.write(response.data(), static_cast<std::streamsize>(response.size()));
 		out.flush();
 		out.close();
 
@@ -278,7 +1012,7 @@ std::string canister::http::fetch_release(canister::parser::repo_manifest manife
 	}
 }
 
-std::string canister::http::fetch_packages(canister::parser::repo_manifest manifest) {
+std::string canister::http::fetch_packages(canister::parser::repo_manifest manifest, const std::map<std::string, canister::hash::digest> &release_hashes) {
 	std::string files[6] = {
 		"Packages.zst",
 		"Packages.xz",
@@ -290,38 +1024,47 @@ std::string canister::http::fetch_packages(canister::parser::repo_manifest manif
 
 	for (auto &repo_file : files) {
 		std::string final_path = canister::util::cache_path() + manifest.slug + ".Packages";
-		std::string url;
+		std::string url, index_path;
 
+		// The index path is how the file is listed in the Release hashes
 		if (!manifest.dist.empty() && !manifest.suite.empty()) {
+			index_path = manifest.suite + "/binary-iphoneos-arm/" + repo_file;
 			url = manifest.uri + "/dists/" + manifest.dist + manifest.suite + "/binary-iphoneos-arm/" + repo_file;
 		} else {
+			index_path = repo_file;
 			url = manifest.uri + "/" + repo_file;
 		}
 
 		try {
-			auto response_stream = canister::http::fetch(url);
+			auto body = canister::http::fetch(url, { .kind = canister::http::traffic::packages, .ranking = manifest.ranking });
 			std::string file_name = canister::util::safe_fs_name(url);
 			std::string file_path = canister::util::cache_path() + file_name;
 
-			if (!response_stream.has_value()) {
+			if (!body.has_value()) {
 				continue;
 			}
 
 			canister::log::info("http", manifest.slug + " - hit: " + url);
-			std::string response = response_stream.value().str();
-			std::ifstream file(file_path);
+			auto response = body->view();
+
+			// Indexes that the Release vouches for have to match it, otherwise the next format is tried
+			auto expected = release_hashes.find(index_path);
+			if (expected != release_hashes.end() && canister::hash::digest_of(response) != expected->second) {
+				canister::log::error("http", manifest.slug + " - release hash mismatch: " + url);
+				continue;
+			}
+
+			canister::util::mapped_file cached(file_path);
 
-			if (file.good()) { // If this is true that means the file exists
-				// Converts our ifstream to a string using streambuf iterators
-				std::string cached = std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
-				if (canister::util::matched_hash(response, cached)) {
+			if (cached.good()) { // If this is true that means the file exists
+				if (canister::util::matched_hash(response, cached.view())) {
 					return std::string("cnstr-cache-available");
 				}
 			}
 
 			// Write the response data to the file and then return the file name
 			std::ofstream out(file_path, std::ios::binary | std::ios::out);
-			out << response;
+			out.write(response.data(), static_cast<std::streamsize>(response.size()));
 			out.flush();
 			out.close();
 
@@ -1,12 +1,6 @@
 #include <canister.h>
 
-void canister::parser::parse_manifest(const nlohmann::json data, uWS::WebSocket<false, true, std::string> *ws) {
-	canister::log::info("parser", "processing repository manifest");
-
-	int successful = 0;
-	int failed = 0;
-	int cached = 0;
-
+std::vector<canister::parser::repo_manifest> canister::parser::read_manifest(const nlohmann::json &data, std::function<void(const std::string &)> report) {
 	std::vector<canister::parser::repo_manifest> manifests;
 
 	for (auto &[iter, value] : data.items()) {
@@ -18,7 +12,8 @@ void canister::parser::parse_manifest(const nlohmann::json data, uWS::WebSocket<
 				{ "timestamp", canister::util::timestamp() },
 			});
 
-			ws->send(json.dump(), uWS::TEXT);
+			report(json.dump());
+			continue;
 		}
 
 		// Get all of our necessary props from the manifest
@@ -49,292 +44,192 @@ void canister::parser::parse_manifest(const nlohmann::json data, uWS::WebSocket<
 		manifests.push_back(manifest);
 	}
 
-	for (auto &manifest : manifests) {
-		std::string release_path, packages_path;
-		std::map<std::string, std::string> release;
-		canister::parser::packages_info packages_info;
+	return manifests;
+}
 
-		release_path = canister::http::fetch_release(manifest);
-		packages_path = canister::http::fetch_packages(manifest);
+canister::parser::packages_info canister::parser::parse_packages(const std::string id, std::string_view content) {
+	size_t start, end = 0;
+	canister::parser::packages_info info{};
+	std::vector<std::string_view> stanzas;
 
-		if (release_path == "cnstr-not-available") {
-			ws->send("failed:download_release:" + manifest.slug, uWS::TEXT);
-			canister::log::error("http", manifest.slug + " - failed to download release");
-			failed++;
-			continue;
-		}
+	while ((start = content.find_first_not_of("\n\n", end)) != std::string::npos) {
+		end = content.find("\n\n", start);
+		stanzas.push_back(content.substr(start, end - start));
+	}
 
-		if (packages_path == "cnstr-not-available") {
-			ws->send("failed:download_packages:" + manifest.slug, uWS::TEXT);
-			canister::log::error("http", manifest.slug + " - failed to download packages");
-			failed++;
-			continue;
-		}
+	// Stanzas are split into one contiguous chunk per leased worker instead of one thread per package
+	// Every chunk gets its own arena since monotonic resources aren't thread safe
+	const size_t minimum_chunk = 256;
+	canister::util::worker_lease lease(std::max<size_t>(1, stanzas.size() / minimum_chunk));
+	size_t workers = lease.count();
 
-		if (release_path == "cnstr-cache-available" && packages_path == "cnstr-cache-available") {
-			canister::log::info("parser", manifest.slug + " - skipping due to cache");
-			cached++;
-			continue;
-		}
+	const size_t chunk_size = (stanzas.size() + workers - 1) / workers;
+	const size_t arena_size = std::max<size_t>(64 * 1024, content.size() / workers);
+	std::vector<std::future<std::vector<canister::parser::apt_kv>>> package_threads;
 
-		if (release_path != "cnstr-cache-available") {
-			// Read files and parse with the parser
-			std::ifstream release_file(release_path);
-			if (!release_file.good()) {
-				release_file.close();
-				canister::log::error("parser", manifest.slug + " - release failed fs check");
-				ws->send("failed:parser_release:" + manifest.slug, uWS::TEXT);
-				failed++;
-				continue;
-			}
+	for (size_t chunk_start = 0; chunk_start < stanzas.size(); chunk_start += chunk_size) {
+		auto chunk_end = std::min(chunk_start + chunk_size, stanzas.size());
+		auto arena = info.arenas.emplace_back(std::make_unique<std::pmr::monotonic_buffer_resource>(arena_size)).get();
 
-			std::ostringstream release_stream;
-			release_stream << release_file.rdbuf();
-			std::string release_contents = release_stream.str();
-			release_file.close();
+		package_threads.push_back(std::async(std::launch::async, [&stanzas, chunk_start, chunk_end, arena]() {
+			std::vector<canister::parser::apt_kv> packages;
+			packages.reserve(chunk_end - chunk_start);
 
-			if (release_contents.empty()) {
-				ws->send("failed:parser_release:" + manifest.slug, uWS::TEXT);
-				canister::log::error("parser", manifest.slug + " - empty release");
-				failed++;
-				continue;
+			for (auto index = chunk_start; index < chunk_end; index++) {
+				packages.push_back(canister::parser::parse_apt_kv(stanzas[index], canister::util::packages_keys(), arena));
 			}
 
-			release = canister::parser::parse_release(manifest.slug, release_contents);
+			return packages;
+		}));
+	}
+
+	info.data.reserve(stanzas.size());
+	for (auto &result : package_threads) {
+		for (auto &package : result.get()) {
+			info.data.push_back(std::move(package));
 		}
+	}
 
-		if (packages_path != "cnstr-cache-available") {
-			std::ifstream packages_file(packages_path);
-			if (!packages_file.good()) {
-				packages_file.close();
-				canister::log::error("parser", manifest.slug + " - packages failed fs check");
-				ws->send("failed:parser_packages:" + manifest.slug, uWS::TEXT);
-				failed++;
-				continue;
-			}
+	for (auto &package : info.data) {
+		// Check if the section isn't already in the array then adds it
+		auto section = package.find("Section");
+		if (section == package.end()) {
+			continue;
+		}
 
-			std::ostringstream packages_stream;
-			packages_stream << packages_file.rdbuf();
-			std::string packages_contents = packages_stream.str();
-			packages_file.close();
+		auto search_result = std::find(info.sections.begin(), info.sections.end(), section->second);
+		if (search_result == info.sections.end()) {
+			info.sections.push_back(std::string(section->second));
+		}
+	}
 
-			if (packages_contents.empty()) {
-				ws->send("failed:parser_packages:" + manifest.slug, uWS::TEXT);
-				canister::log::error("parser", manifest.slug + " - empty packages");
-				failed++;
-				continue;
-			}
+	info.count = info.data.size();
+	canister::log::info("parser", id + " - packages count: " + std::to_string(info.count));
+	return info;
+}
 
-			packages_info = canister::parser::parse_packages(manifest.slug, packages_contents);
-		}
+std::map<std::string, std::string> canister::parser::parse_release(const std::string id, std::string_view content) {
+	std::pmr::monotonic_buffer_resource arena;
+	const auto kv_map = parse_apt_kv(content, canister::util::release_keys(), &arena);
 
-		auto request = canister::http::sileo_endpoint(manifest.uri);
-		auto endpoint = request.has_value() ? request.value().str() : "";
-
-		// Ths dist and suite are blank strings because NULL is unacceptable
-		canister::db::write_repository({
-			.slug = manifest.slug,
-			.aliases = manifest.aliases,
-			.ranking = manifest.ranking,
-			.package_count = packages_info.count,
-			.sections = packages_info.sections,
-			.uri = manifest.uri,
-			.dist = "",
-			.suite = "",
-			.name = release["Name"],
-			.version = release["Version"],
-			.description = release["Description"],
-			.date = release["Date"],
-			.payment_gateway = release["Payment-Gateway"],
-			.sileo_endpoint = endpoint,
-		});
-
-		// TODO: Support Payment-Gateway specification for price calculation
-		for (auto &package_map : packages_info.data) {
-			// This means a package with the ID does not exist
-			auto exists = canister::db::package_exists(package_map["Package"]);
-
-			std::string price;
-			if (package_map["Tag"].find("cydia::commercial") != std::string::npos) {
-				if (endpoint.length() > 0) {
-					auto sileo_price_request = canister::http::sileo_endpoint_price(package_map["Package"], endpoint);
-					price = sileo_price_request.has_value() ? sileo_price_request.value() : "Paid";
-				} else {
-					price = "Paid";
-				}
-			} else {
-				price = "Free";
-			}
+	// Releases are tiny and outlive the arena, so they're copied out
+	std::map<std::string, std::string> release;
+	for (auto &[key, value] : kv_map) {
+		release.emplace(key, value);
+	}
 
-			if (!exists.has_value()) {
-				canister::db::write_package({
-					.id = package_map["Package"],
-					.repo = manifest.slug,
-					.price = price,
-				});
-
-				auto header = package_map["Header"].length() > 0 ? package_map["Header"] : "";
-				auto tint_color = "";
-				auto udid = package_map["Package"] + "$$" + package_map["Version"] + "$$" + manifest.slug;
-
-				// TODO: Support the new DepictionKit specification
-				canister::db::write_vpackage({
-					.uuid = udid,
-					.package = package_map["Package"],
-					.current_version = true,
-					.version = package_map["Version"],
-					.architecture = package_map["Architecture"],
-					.filename = package_map["Filename"],
-					.sha_256 = package_map["SHA256"],
-					.name = package_map["Name"],
-					.description = package_map["Description"],
-					.author = package_map["Author"],
-					.maintainer = package_map["Maintainer"],
-					.depiction = package_map["Depiction"],
-					.native_depiction = package_map["SileoDepiction"],
-					.header = header,
-					.tint_color = tint_color,
-					.icon = package_map["Icon"],
-					.section = package_map["Section"],
-					.tag = package_map["Tag"],
-					.installed_size = package_map["Installed-Size"],
-					.size = package_map["Size"],
-				});
-			} else {
-				// Update the package's repository if the newer slug has a better ranking
-				auto db_slug = exists.value();
-				auto db_ranking = canister::db::repository_ranking(db_slug);
-
-				// Lower ranking is better
-				if (manifest.ranking < db_ranking) {
-					canister::db::write_package({
-						.id = package_map["Package"],
-						.repo = manifest.slug,
-						.price = price,
-					});
-				}
+	canister::log::info("parser", id + " - key length: " + std::to_string(release.size()));
+	return release;
+}
 
-				// Insert this subpackage as a VPackage and set current_version using version comparison.
-				auto vpackage_query = canister::db::current_vpackage_version(package_map["Package"]);
-				if (!vpackage_query.has_value()) {
-					continue;
-				}
+std::map<std::string, canister::hash::digest> canister::parser::parse_release_hashes(std::string_view content) {
+	std::map<std::string, canister::hash::digest> hashes;
+	bool in_sha256 = false;
+	size_t position = 0;
 
-				auto header = package_map["Header"].length() > 0 ? package_map["Header"] : "";
-				auto tint_color = "";
-				auto udid = package_map["Package"] + "$$" + package_map["Version"] + "$$" + manifest.slug;
-
-				canister::db::write_vpackage({
-					.uuid = udid,
-					.package = package_map["Package"],
-					.current_version = false,
-					.version = package_map["Version"],
-					.architecture = package_map["Architecture"],
-					.filename = package_map["Filename"],
-					.sha_256 = package_map["SHA256"],
-					.name = package_map["Name"],
-					.description = package_map["Description"],
-					.author = package_map["Author"],
-					.maintainer = package_map["Maintainer"],
-					.depiction = package_map["Depiction"],
-					.native_depiction = package_map["SileoDepiction"],
-					.header = header,
-					.tint_color = tint_color,
-					.icon = package_map["Icon"],
-					.section = package_map["Section"],
-					.tag = package_map["Tag"],
-					.installed_size = package_map["Installed-Size"],
-					.size = package_map["Size"],
-				});
-
-				// When it's equal to a value of one that means the first argument is a greater version
-				if (canister::dpkg::compare(package_map["Version"], vpackage_query.value()) == 1) {
-					canister::db::set_current_vpackage(udid, package_map["Package"]);
-				}
-			}
+	while (position < content.size()) {
+		auto end = content.find('\n', position);
+		if (end == std::string_view::npos) {
+			end = content.size();
 		}
 
-		successful++;
+		auto line = content.substr(position, end - position);
+		position = end + 1;
 
-		ws->send("success:" + std::to_string(successful), uWS::OpCode::TEXT);
-		ws->send("failed:" + std::to_string(failed), uWS::OpCode::TEXT);
-		ws->send("cached:" + std::to_string(cached), uWS::OpCode::TEXT);
-	}
-}
+		if (line.ends_with('\r')) {
+			line.remove_suffix(1);
+		}
 
-canister::parser::packages_info canister::parser::parse_packages(const std::string id, const std::string content) {
-	size_t start, end = 0;
-	canister::parser::packages_info info{};
-	std::vector<std::future<std::map<std::string, std::string>>> package_threads;
+		// Hash lists are a key without a value followed by indented "<hash> <size> <path>" lines
+		if (!line.starts_with(' ')) {
+			in_sha256 = line.starts_with("SHA256:");
+			continue;
+		}
 
-	while ((start = content.find_first_not_of("\n\n", end)) != std::string::npos) {
-		end = content.find("\n\n", start);
+		if (!in_sha256) {
+			continue;
+		}
 
-		// We want to do each package on a separate thread (hopefully BigBoss plays nicely)
-		package_threads.push_back(std::async(std::launch::async, canister::parser::parse_apt_kv, std::stringstream(content.substr(start, end - start)), canister::util::packages_keys()));
-	}
+		std::vector<std::string_view> tokens;
+		size_t token_start;
+		size_t token_end = 0;
 
-	for (auto &result : package_threads) {
-		result.wait();
-		auto package = result.get();
-		info.data.push_back(package);
+		while ((token_start = line.find_first_not_of(' ', token_end)) != std::string_view::npos) {
+			token_end = line.find(' ', token_start);
+			tokens.push_back(line.substr(token_start, token_end - token_start));
+		}
 
-		// Check if the section isn't already in the array then adds it
-		if (!package.contains("Section")) {
+		if (tokens.size() != 3) {
 			continue;
 		}
 
-		auto search_result = std::find(info.sections.begin(), info.sections.end(), package["Section"]);
-		if (search_result == info.sections.end()) {
-			info.sections.push_back(package["Section"]);
+		auto digest = canister::hash::from_hex(tokens[0]);
+		if (digest.has_value()) {
+			hashes.emplace(tokens[2], digest.value());
 		}
 	}
 
-	info.count = info.data.size();
-	canister::log::info("parser", id + " - packages count: " + std::to_string(info.count));
-	return info;
+	return hashes;
 }
 
-std::map<std::string, std::string> canister::parser::parse_release(const std::string id, const std::string content) {
-	const auto release = parse_apt_kv(std::stringstream(content), canister::util::release_keys());
-	canister::log::info("parser", id + " - key length: " + std::to_string(release.size()));
-	return release;
-}
+canister::parser::apt_kv canister::parser::parse_apt_kv(std::string_view content, const std::vector<std::string> &key_validator, std::pmr::memory_resource *arena) {
+	canister::parser::apt_kv kv_map(arena);
+	std::string_view previous_key;
+	size_t position = 0;
 
-std::map<std::string, std::string> canister::parser::parse_apt_kv(std::stringstream stream, std::vector<std::string> key_validator) {
-	std::map<std::string, std::string> kv_map;
-	std::string line, previous_key;
+	while (position < content.size()) {
+		auto end = content.find('\n', position);
+		if (end == std::string_view::npos) {
+			end = content.size();
+		}
+
+		auto line = content.substr(position, end - position);
+		position = end + 1;
 
-	while (std::getline(stream, line, '\n')) {
 		if (line.size() == 0) {
 			continue;
 		}
 
-		std::smatch matches;
-		if (!std::regex_match(line, matches, std::regex("^(.*?): (.*)"))) {
+		// This matches "^(.*?): (.*)" without a regex, which also never matched across a carriage return
+		auto separator = line.find(": ");
+		if (separator == std::string_view::npos || line.find('\r') != std::string_view::npos) {
 			// There's a chance instead of multiline, some idiot gave a key without value
 			// Trim the string incase there may be a space after the colon
-			size_t end = line.find_last_not_of(' ');
-			end == std::string::npos ? line = "" : line = line.substr(0, end + 1);
+			size_t trim = line.find_last_not_of(' ');
+			trim == std::string_view::npos ? line = "" : line = line.substr(0, trim + 1);
 
 			if (!line.ends_with(":")) {
-				kv_map[previous_key].append("\n" + line);
+				// Multiline values are joined inside of the arena, the old value is released alongside it
+				auto &value = kv_map[previous_key];
+				auto size = value.size() + 1 + line.size();
+				auto buffer = static_cast<char *>(arena->allocate(size, alignof(char)));
+
+				if (!value.empty()) {
+					std::memcpy(buffer, value.data(), value.size());
+				}
+
+				buffer[value.size()] = '\n';
+				if (!line.empty()) {
+					std::memcpy(buffer + value.size() + 1, line.data(), line.size());
+				}
+
+				value = std::string_view(buffer, size);
 			} else {
-				previous_key = matches[1];
+				previous_key = std::string_view();
 			}
-		}
 
-		// This means we don't have a value before and after the colon in the KV
-		if (matches.size() != 3) {
 			continue;
 		}
 
+		auto key = line.substr(0, separator);
+		auto value = line.substr(separator + 2);
+
 		// Validate our key before adding it to the map since Canister doesn't need all keys
-		if (std::find(key_validator.begin(), key_validator.end(), matches[1]) != key_validator.end()) {
-			kv_map.insert(std::make_pair(matches[1], matches[2]));
+		if (std::find(key_validator.begin(), key_validator.end(), key) != key_validator.end()) {
+			kv_map.emplace(key, value);
 		}
 
-		previous_key = matches[1];
+		previous_key = key;
 	}
 
 	return kv_map;
@@ -0,0 +1,528 @@
+#include <canister.h>
+
+// Fingerprint -> uuid of the canonical VPackage, only ever touched from the write stage
+std::unordered_map<canister::hash::digest, std::string, canister::hash::digest_hasher> pipeline_fingerprints;
+std::unordered_map<std::string, std::int8_t> pipeline_rankings; // Slug -> ranking of every repository that can hold a canonical row
+bool pipeline_fingerprints_loaded = false;
+
+namespace {
+	// Returns the canonical VPackage when another repository already wrote this exact build
+	std::optional<std::string> canonical_vpackage(const std::optional<canister::hash::digest> &fingerprint, std::string_view udid) {
+		if (!fingerprint.has_value()) {
+			return std::nullopt;
+		}
+
+		auto canonical = pipeline_fingerprints.find(fingerprint.value());
+		if (canonical == pipeline_fingerprints.end() || canonical->second == udid) {
+			return std::nullopt;
+		}
+
+		return canonical->second;
+	}
+
+	// Lower ranking is better, a canonical row from a repository we don't know the ranking of is left alone
+	bool outranks(std::int8_t ranking, std::string_view canonical) {
+		auto holder = pipeline_rankings.find(std::string(canonical.substr(canonical.rfind("$$") + 2)));
+		return holder != pipeline_rankings.end() && ranking < holder->second;
+	}
+
+	// The canonical row lists its own repository as a mirror too, so the table has every host of a build
+	void record_canonical(const std::optional<canister::hash::digest> &fingerprint, std::string_view fingerprint_hex, std::string_view slug, std::string_view udid, std::string_view filename) {
+		if (!fingerprint.has_value()) {
+			return;
+		}
+
+		pipeline_fingerprints.insert_or_assign(fingerprint.value(), std::string(udid));
+		canister::db::write_mirror({
+			.fingerprint = fingerprint_hex,
+			.repo = slug,
+			.uuid = udid,
+			.filename = filename,
+		});
+	}
+}
+
+void canister::pipeline::reload_fingerprints() {
+	pipeline_fingerprints.clear();
+	pipeline_rankings.clear();
+	pipeline_fingerprints_loaded = false;
+}
+
+void canister::pipeline::fetch(canister::pipeline::repository_job &job) {
+	auto &manifest = job.manifest;
+	job.release_path = canister::http::fetch_release(manifest);
+
+	// The cached Release is mapped even if it didn't change so it can verify the Packages download
+	auto release_file = canister::util::mapped_file(canister::util::cache_path() + canister::util::safe_fs_name(canister::http::release_url(manifest)));
+	auto release_hashes = canister::parser::parse_release_hashes(release_file.view());
+	job.packages_path = canister::http::fetch_packages(manifest, release_hashes);
+
+	if (job.release_path == "cnstr-not-available") {
+		canister::log::error("http", manifest.slug + " - failed to download release");
+		job.failure = "failed:download_release:" + manifest.slug;
+		return;
+	}
+
+	if (job.packages_path == "cnstr-not-available") {
+		canister::log::error("http", manifest.slug + " - failed to download packages");
+		job.failure = "failed:download_packages:" + manifest.slug;
+		return;
+	}
+
+	// Unchanged files are still parsed from the cache when only the other one changed, or when the catalog hasn't seen the repository yet
+	auto release_cache = canister::util::cache_path() + canister::util::safe_fs_name(canister::http::release_url(manifest));
+	auto packages_cache = canister::util::cache_path() + manifest.slug + ".Packages";
+
+	if (job.release_path == "cnstr-cache-available" && job.packages_path == "cnstr-cache-available") {
+		job.cached = true;
+		if (canister::catalog::contains_repository(manifest.slug)) {
+			return;
+		}
+
+		job.catalog_only = true;
+	}
+
+	if (job.release_path == "cnstr-cache-available") {
+		job.release_path = release_cache;
+	}
+
+	if (job.packages_path == "cnstr-cache-available") {
+		job.packages_path = packages_cache;
+	}
+
+	auto request = canister::http::sileo_endpoint(manifest.uri, manifest.ranking);
+	job.sileo_endpoint = request.has_value() ? std::string(request->view()) : "";
+}
+
+void canister::pipeline::parse(canister::pipeline::repository_job &job) {
+	auto &manifest = job.manifest;
+
+	// Map the files and parse them in place with the parser
+	canister::util::mapped_file release_file(job.release_path);
+	if (!release_file.good()) {
+		canister::log::error("parser", manifest.slug + " - release failed fs check");
+		job.failure = "failed:parser_release:" + manifest.slug;
+		return;
+	}
+
+	if (release_file.view().empty()) {
+		canister::log::error("parser", manifest.slug + " - empty release");
+		job.failure = "failed:parser_release:" + manifest.slug;
+		return;
+	}
+
+	job.release = canister::parser::parse_release(manifest.slug, release_file.view());
+
+	job.packages_file = canister::util::mapped_file(job.packages_path);
+	if (!job.packages_file.good()) {
+		canister::log::error("parser", manifest.slug + " - packages failed fs check");
+		job.failure = "failed:parser_packages:" + manifest.slug;
+		return;
+	}
+
+	if (job.packages_file.view().empty()) {
+		canister::log::error("parser", manifest.slug + " - empty packages");
+		job.failure = "failed:parser_packages:" + manifest.slug;
+		return;
+	}
+
+	job.packages_info = canister::parser::parse_packages(manifest.slug, job.packages_file.view());
+
+	// Fingerprints are worked out here so the write stage only has to look them up
+	job.fingerprints.reserve(job.packages_info.data.size());
+	for (auto &package_map : job.packages_info.data) {
+		job.fingerprints.push_back(canister::hash::fingerprint(package_map["SHA256"], package_map["Size"], package_map["Version"]));
+	}
+}
+
+void canister::pipeline::price(canister::pipeline::repository_job &job) {
+	auto &manifest = job.manifest;
+
+	// Every commercial package is a request to the payment endpoint, so this has a stage of its own away from parsing
+	// TODO: Support Payment-Gateway specification for price calculation
+	job.prices.reserve(job.packages_info.data.size());
+	for (auto &package_map : job.packages_info.data) {
+		if (package_map["Tag"].find("cydia::commercial") == std::string::npos) {
+			job.prices.push_back("Free");
+			continue;
+		}
+
+		if (job.sileo_endpoint.length() > 0) {
+			auto sileo_price_request = canister::http::sileo_endpoint_price(package_map["Package"], job.sileo_endpoint, manifest.ranking);
+			job.prices.push_back(sileo_price_request.has_value() ? sileo_price_request.value() : "Paid");
+		} else {
+			job.prices.push_back("Paid");
+		}
+	}
+}
+
+void canister::pipeline::write(canister::pipeline::repository_job &job) {
+	auto &manifest = job.manifest;
+	auto &release = job.release;
+	auto &packages_info = job.packages_info;
+
+	// Scratch for everything built while ingesting, released in one shot after the repository is written
+	std::pmr::monotonic_buffer_resource scratch;
+
+	if (!pipeline_fingerprints_loaded) {
+		pipeline_fingerprints = canister::db::fingerprints();
+		for (auto &repository : canister::db::repositories().value_or(std::vector<canister::db::repository> {})) {
+			pipeline_rankings[repository.slug] = repository.ranking;
+		}
+
+		pipeline_fingerprints_loaded = true;
+	}
+
+	pipeline_rankings[manifest.slug] = manifest.ranking;
+
+	// Ths dist and suite are blank strings because NULL is unacceptable
+	canister::db::write_repository({
+		.slug = manifest.slug,
+		.aliases = manifest.aliases,
+		.ranking = manifest.ranking,
+		.package_count = packages_info.count,
+		.sections = packages_info.sections,
+		.uri = manifest.uri,
+		.dist = "",
+		.suite = "",
+		.name = release["Name"],
+		.version = release["Version"],
+		.description = release["Description"],
+		.date = release["Date"],
+		.payment_gateway = release["Payment-Gateway"],
+		.sileo_endpoint = job.sileo_endpoint,
+	});
+
+	// Every build this repository still lists, anything else it used to mirror is dropped afterwards
+	std::vector<std::string> listed;
+
+	for (size_t index = 0; index < packages_info.data.size(); index++) {
+		auto &package_map = packages_info.data[index];
+		auto &price = job.prices[index];
+		auto fingerprint = job.fingerprints[index];
+
+		// The uuid starts with the package ID, a different package claiming the same build is written unmerged
+		if (fingerprint.has_value()) {
+			auto claimed = pipeline_fingerprints.find(fingerprint.value());
+			if (claimed != pipeline_fingerprints.end() && !claimed->second.starts_with(std::string(package_map["Package"]) + "$$")) {
+				fingerprint.reset();
+			}
+		}
+
+		std::pmr::string fingerprint_hex(&scratch);
+		if (fingerprint.has_value()) {
+			fingerprint_hex = canister::hash::to_hex(fingerprint.value());
+			listed.emplace_back(fingerprint_hex);
+		}
+
+		// This means a package with the ID does not exist
+		auto exists = canister::db::package_exists(package_map["Package"]);
+
+		if (!exists.has_value()) {
+			canister::db::write_package({
+				.id = package_map["Package"],
+				.repo = manifest.slug,
+				.price = price,
+			});
+
+			auto header = package_map["Header"].length() > 0 ? package_map["Header"] : "";
+			auto tint_color = "";
+
+			std::pmr::string udid(&scratch);
+			udid.append(package_map["Package"]).append("$$").append(package_map["Version"]).append("$$").append(manifest.slug);
+
+			// TODO: Support the new DepictionKit specification
+			canister::db::write_vpackage({
+				.uuid = udid,
+				.package = package_map["Package"],
+				.current_version = true,
+				.version = package_map["Version"],
+				.architecture = package_map["Architecture"],
+				.filename = package_map["Filename"],
+				.sha_256 = package_map["SHA256"],
+				.name = package_map["Name"],
+				.description = package_map["Description"],
+				.author = package_map["Author"],
+				.maintainer = package_map["Maintainer"],
+				.depiction = package_map["Depiction"],
+				.native_depiction = package_map["SileoDepiction"],
+				.header = header,
+				.tint_color = tint_color,
+				.icon = package_map["Icon"],
+				.section = package_map["Section"],
+				.tag = package_map["Tag"],
+				.installed_size = package_map["Installed-Size"],
+				.size = package_map["Size"],
+				.fingerprint = fingerprint_hex,
+			});
+
+			record_canonical(fingerprint, fingerprint_hex, manifest.slug, udid, package_map["Filename"]);
+		} else {
+			// Insert this subpackage as a VPackage and set current_version using version comparison.
+			auto vpackage_query = canister::db::current_vpackage_version(package_map["Package"]);
+			if (!vpackage_query.has_value()) {
+				continue;
+			}
+
+			auto header = package_map["Header"].length() > 0 ? package_map["Header"] : "";
+			auto tint_color = "";
+
+			std::pmr::string udid(&scratch);
+			udid.append(package_map["Package"]).append("$$").append(package_map["Version"]).append("$$").append(manifest.slug);
+
+			canister::db::vpackage vpackage {
+				.uuid = udid,
+				.package = package_map["Package"],
+				.current_version = false,
+				.version = package_map["Version"],
+				.architecture = package_map["Architecture"],
+				.filename = package_map["Filename"],
+				.sha_256 = package_map["SHA256"],
+				.name = package_map["Name"],
+				.description = package_map["Description"],
+				.author = package_map["Author"],
+				.maintainer = package_map["Maintainer"],
+				.depiction = package_map["Depiction"],
+				.native_depiction = package_map["SileoDepiction"],
+				.header = header,
+				.tint_color = tint_color,
+				.icon = package_map["Icon"],
+				.section = package_map["Section"],
+				.tag = package_map["Tag"],
+				.installed_size = package_map["Installed-Size"],
+				.size = package_map["Size"],
+				.fingerprint = fingerprint_hex,
+			};
+
+			// A rehosted build only gets pointed at the row that already exists instead of a row of its own
+			// The best ranked host takes the row over though, so the database agrees with what the catalog serves
+			auto canonical = canonical_vpackage(fingerprint, udid);
+			auto replaced = canonical.has_value() && outranks(manifest.ranking, canonical.value()) && canister::db::replace_canonical(vpackage, canonical.value());
+			if (canonical.has_value() && !replaced) {
+				canister::db::write_mirror({
+					.fingerprint = fingerprint_hex,
+					.repo = manifest.slug,
+					.uuid = canonical.value(),
+					.filename = package_map["Filename"],
+				});
+
+				continue;
+			}
+
+			if (!replaced) {
+				canister::db::write_vpackage(vpackage);
+			}
+
+			record_canonical(fingerprint, fingerprint_hex, manifest.slug, udid, package_map["Filename"]);
+
+			// A positive result means the first argument is a greater version
+			if (canister::dpkg::compare(package_map["Version"], vpackage_query.value()) > 0) {
+				canister::db::set_current_vpackage(udid, package_map["Package"]);
+			}
+		}
+	}
+
+	canister::db::prune_mirrors(manifest.slug, listed);
+
+	// Ownership of everything this repository hosts is settled in one pass instead of a ranking query per package
+	std::unordered_map<std::string_view, std::size_t> positions;
+	canister::db::reconcile_owners({ manifest.slug }, [&](const std::string &repo, const std::string &id) -> std::optional<std::string> {
+		if (repo != manifest.slug) {
+			return canister::catalog::package_price(repo, id);
+		}
+
+		if (positions.empty()) {
+			for (size_t index = 0; index < packages_info.data.size(); index++) {
+				positions.emplace(packages_info.data[index]["Package"], index);
+			}
+		}
+
+		auto position = positions.find(id);
+		if (position == positions.end()) {
+			return std::nullopt;
+		}
+
+		return job.prices[position->second];
+	});
+}
+
+canister::pipeline::summary canister::pipeline::refresh(const std::vector<canister::parser::repo_manifest> &manifests, std::function<void(const std::string &)> report) {
+	canister::pipeline::summary summary;
+	const auto &settings = canister::config::get();
+	canister::pipeline::queue<std::unique_ptr<canister::pipeline::repository_job>> fetched(settings.pipeline_queue_depth);
+	canister::pipeline::queue<std::unique_ptr<canister::pipeline::repository_job>> parsed(settings.pipeline_queue_depth);
+	canister::pipeline::queue<std::unique_ptr<canister::pipeline::repository_job>> priced(settings.pipeline_queue_depth);
+
+	// Each repository moves through fetch -> parse -> price -> write, so different repositories occupy different stages at once
+	// Whichever stage is the slowest ends up setting the pace for the whole refresh
+	std::vector<std::thread> stages;
+	std::atomic<std::size_t> next_manifest = 0;
+	std::atomic<std::size_t> running_fetchers = settings.pipeline_fetch_workers;
+	std::atomic<std::size_t> running_pricers = settings.pipeline_fetch_workers;
+	bool catalog_changed = false;
+
+	// Closed queues make every stage give up at its next push, so the stages can always be joined
+	// Any way out of here goes through this, a joinable thread left behind would std::terminate the whole server
+	auto shutdown = [&]() {
+		fetched.close();
+		parsed.close();
+		priced.close();
+
+		for (auto &stage : stages) {
+			if (stage.joinable()) {
+				stage.join();
+			}
+		}
+	};
+
+	struct stage_guard {
+		std::function<void()> release;
+		~stage_guard() {
+			release();
+		}
+	} guard { shutdown };
+
+	for (std::size_t worker = 0; worker < settings.pipeline_fetch_workers; worker++) {
+		stages.emplace_back([&]() {
+			std::size_t index;
+			while ((index = next_manifest++) < manifests.size()) {
+				auto job = std::make_unique<canister::pipeline::repository_job>();
+				job->manifest = manifests[index];
+
+				try {
+					canister::pipeline::fetch(*job);
+				} catch (std::exception &exc) {
+					canister::log::error("pipeline", job->manifest.slug + " - fetch stage: " + std::string(exc.what()));
+					job->failure = "failed:download_packages:" + job->manifest.slug;
+				}
+
+				if (!fetched.push(std::move(job))) {
+					break;
+				}
+			}
+
+			// The last fetcher out lets the parse stage know nothing else is coming
+			if (--running_fetchers == 0) {
+				fetched.close();
+			}
+		});
+	}
+
+	stages.emplace_back([&]() {
+		while (auto job = fetched.pop()) {
+			auto &current = *job.value();
+			if (current.failure.empty() && (!current.cached || current.catalog_only)) {
+				try {
+					canister::pipeline::parse(current);
+				} catch (std::exception &exc) {
+					canister::log::error("pipeline", current.manifest.slug + " - parse stage: " + std::string(exc.what()));
+					current.failure = "failed:parser_packages:" + current.manifest.slug;
+				}
+			}
+
+			if (!parsed.push(std::move(job.value()))) {
+				break;
+			}
+		}
+
+		parsed.close();
+	});
+
+	// Price lookups wait on the network like fetches do, so they get as many workers and a slow endpoint only holds up its own repository
+	for (std::size_t worker = 0; worker < settings.pipeline_fetch_workers; worker++) {
+		stages.emplace_back([&]() {
+			while (auto job = parsed.pop()) {
+				auto &current = *job.value();
+				if (current.failure.empty() && (!current.cached || current.catalog_only)) {
+					try {
+						canister::pipeline::price(current);
+					} catch (std::exception &exc) {
+						canister::log::error("pipeline", current.manifest.slug + " - price stage: " + std::string(exc.what()));
+						current.failure = "failed:parser_packages:" + current.manifest.slug;
+					}
+				}
+
+				if (!priced.push(std::move(job.value()))) {
+					break;
+				}
+			}
+
+			if (--running_pricers == 0) {
+				priced.close();
+			}
+		});
+	}
+
+	// Writes stay on the calling thread since it owns the database connection and the reporter
+	while (auto job = priced.pop()) {
+		auto &current = *job.value();
+
+		if (!current.failure.empty()) {
+			report(current.failure);
+			summary.failed++;
+			summary.outcomes[current.manifest.slug] = canister::pipeline::outcome::failed;
+			continue;
+		}
+
+		if (current.cached) {
+			canister::log::info("parser", current.manifest.slug + " - skipping due to cache");
+			if (current.catalog_only) {
+				try {
+					canister::catalog::update_repository(canister::catalog::from_job(current));
+					catalog_changed = true;
+				} catch (std::exception &exc) {
+					canister::log::error("pipeline", current.manifest.slug + " - catalog stage: " + std::string(exc.what()));
+					report("failed:catalog:" + current.manifest.slug);
+					summary.failed++;
+					summary.outcomes[current.manifest.slug] = canister::pipeline::outcome::failed;
+					continue;
+				}
+			}
+
+			summary.cached++;
+			summary.outcomes[current.manifest.slug] = canister::pipeline::outcome::cached;
+			continue;
+		}
+
+		try {
+			canister::pipeline::write(current);
+
+			auto repository = canister::catalog::from_job(current);
+			canister::catalog::update_repository(repository);
+			canister::deb::enqueue(*repository);
+			catalog_changed = true;
+		} catch (std::exception &exc) {
+			canister::log::error("pipeline", current.manifest.slug + " - write stage: " + std::string(exc.what()));
+			report("failed:write:" + current.manifest.slug);
+			summary.failed++;
+			summary.outcomes[current.manifest.slug] = canister::pipeline::outcome::failed;
+			continue;
+		}
+
+		summary.successful++;
+		summary.outcomes[current.manifest.slug] = canister::pipeline::outcome::updated;
+
+		report("success:" + std::to_string(summary.successful));
+		report("failed:" + std::to_string(summary.failed));
+		report("cached:" + std::to_string(summary.cached));
+	}
+
+	shutdown();
+
+	// The next start picks up from here instead of parsing every repository again
+	if (catalog_changed) {
+		try {
+			canister::snapshot::write();
+		} catch (std::exception &exc) {
+			canister::log::error("snapshot", exc.what());
+		}
+
+		// Anything rendered from the old graph while repositories were being swapped in is dropped with it
+		canister::graph::rebuild();
+		canister::responses::invalidate();
+		canister::responses::warm();
+	}
+
+	canister::log::info("pipeline", "refreshed " + std::to_string(manifests.size()) + " repositories: " + std::to_string(summary.successful) + " updated, " + std::to_string(summary.cached) + " cached, " + std::to_string(summary.failed) + " failed");
+	return summary;
+}
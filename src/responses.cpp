@@ -0,0 +1,130 @@
+#include <canister.h>
+
+// Payloads are only valid for the catalog generation they were rendered from
+// The list keeps them most recently used first and the map points into it, so a hit only moves one node
+std::mutex responses_mutex;
+std::uint64_t responses_generation = 0;
+std::list<std::pair<std::string, std::shared_ptr<const canister::responses::payload>>> responses_order;
+std::unordered_map<std::string, decltype(responses_order)::iterator> responses_cache;
+
+namespace {
+	// Tiny bodies come out larger once compressed so they're only ever sent as they are
+	const std::size_t compression_threshold = 256;
+
+	std::string gzip(std::string_view body, int level) {
+		z_stream stream {};
+
+		// A window of 15 + 16 makes zlib write a gzip header instead of a raw zlib one
+		if (deflateInit2(&stream, level, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+			throw std::runtime_error("gzip: failed to initialize deflate");
+		}
+
+		std::string output(deflateBound(&stream, body.size()), '\0');
+		stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(body.data()));
+		stream.avail_in = static_cast<uInt>(body.size());
+		stream.next_out = reinterpret_cast<Bytef *>(output.data());
+		stream.avail_out = static_cast<uInt>(output.size());
+
+		auto result = deflate(&stream, Z_FINISH);
+		output.resize(stream.total_out);
+		deflateEnd(&stream);
+
+		if (result != Z_STREAM_END) {
+			throw std::runtime_error("gzip: failed to compress payload");
+		}
+
+		return output;
+	}
+
+	std::string zstd(std::string_view body, int level) {
+		std::string output(ZSTD_compressBound(body.size()), '\0');
+		auto size = ZSTD_compress(output.data(), output.size(), body.data(), body.size(), level);
+
+		if (ZSTD_isError(size)) {
+			throw std::runtime_error("zstd: " + std::string(ZSTD_getErrorName(size)));
+		}
+
+		output.resize(size);
+		return output;
+	}
+}
+
+std::shared_ptr<const canister::responses::payload> canister::responses::build(std::string body, canister::responses::effort effort) {
+	auto payload = std::make_shared<canister::responses::payload>();
+	payload->etag = "\"" + canister::hash::to_hex(canister::hash::digest_of(body)).substr(0, 32) + "\"";
+
+	// Compressed variants are only kept when they actually save something
+	if (body.size() >= compression_threshold) {
+		auto best = effort == canister::responses::effort::best;
+		auto gzip_body = gzip(body, best ? RESPONSES_WARM_GZIP_LEVEL : RESPONSES_GZIP_LEVEL);
+		if (gzip_body.size() < body.size()) {
+			payload->gzip = std::move(gzip_body);
+		}
+
+		auto zstd_body = zstd(body, best ? RESPONSES_WARM_ZSTD_LEVEL : RESPONSES_ZSTD_LEVEL);
+		if (zstd_body.size() < body.size()) {
+			payload->zstd = std::move(zstd_body);
+		}
+	}
+
+	payload->identity = std::move(body);
+	return payload;
+}
+
+std::shared_ptr<const canister::responses::payload> canister::responses::get(const std::string &key, std::function<std::optional<std::string>()> render, canister::responses::effort effort) {
+	std::uint64_t generation;
+
+	{
+		std::lock_guard lock(responses_mutex);
+		auto cached = responses_cache.find(key);
+		if (cached != responses_cache.end()) {
+			responses_order.splice(responses_order.begin(), responses_order, cached->second);
+			return cached->second->second;
+		}
+
+		generation = responses_generation;
+	}
+
+	// Rendering happens outside of the lock, at worst two requests race to render the same payload
+	auto body = render();
+	if (!body.has_value()) {
+		return nullptr;
+	}
+
+	auto payload = canister::responses::build(std::move(body.value()), effort);
+
+	// A refresh that landed while this was rendering makes it stale, so it's served once and dropped
+	std::lock_guard lock(responses_mutex);
+	if (generation != responses_generation || responses_cache.contains(key)) {
+		return payload;
+	}
+
+	responses_order.emplace_front(key, payload);
+	responses_cache.emplace(key, responses_order.begin());
+
+	if (responses_cache.size() > RESPONSES_MAX_ENTRIES) {
+		responses_cache.erase(responses_order.back().first);
+		responses_order.pop_back();
+	}
+
+	return payload;
+}
+
+void canister::responses::invalidate() {
+	std::lock_guard lock(responses_mutex);
+	responses_generation++;
+	responses_cache.clear();
+	responses_order.clear();
+}
+
+void canister::responses::warm() {
+	// Listings are requested by every client, so they're rendered before anyone asks for them
+	// This runs after a refresh instead of inside a request handler, so these get the slow compression levels
+	canister::responses::get("repositories", []() -> std::optional<std::string> {
+		return canister::catalog::repositories_json();
+	}, canister::responses::effort::best);
+
+	canister::responses::get("sections", []() -> std::optional<std::string> {
+		return canister::catalog::sections_json();
+	}, canister::responses::effort::best);
+}
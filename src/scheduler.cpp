@@ -0,0 +1,315 @@
+#include <canister.h>
+
+// Schedules are only touched by whoever is refreshing but a lock keeps them safe regardless
+std::mutex schedules_mutex;
+std::map<std::string, canister::scheduler::repository_schedule> schedules;
+
+// Refresh requests from any worker are collapsed into one flag for the coordinator
+std::mutex coordinator_mutex;
+std::condition_variable coordinator_wake;
+bool full_refresh_requested = false;
+
+// The last manifest that was applied, only the coordinator reads or replaces it
+std::vector<canister::parser::repo_manifest> applied_manifests;
+bool applied_manifests_loaded = false;
+
+namespace {
+	void forget_schedule(const std::string &slug) {
+		std::lock_guard lock(schedules_mutex);
+		schedules.erase(slug);
+	}
+
+	// Without its cached Packages the next fetch can't be skipped, so the repository is parsed and written in full
+	void forget_packages(const std::string &slug) {
+		std::error_code error;
+		std::filesystem::remove(canister::util::cache_path() + slug + ".Packages", error);
+	}
+
+	void forget_cache(const canister::parser::repo_manifest &manifest) {
+		std::error_code error;
+		std::filesystem::remove(canister::util::cache_path() + canister::util::safe_fs_name(canister::http::release_url(manifest)), error);
+		forget_packages(manifest.slug);
+	}
+}
+
+void canister::scheduler::start() {
+	// A single coordinator thread owns the write path, so refreshes never overlap or block an HTTP worker
+	std::thread(canister::scheduler::run).detach();
+	canister::log::info("scheduler", "checking for due repositories every " + std::to_string(canister::config::get().scheduler_tick) + "s");
+}
+
+void canister::scheduler::run() {
+	while (true) {
+		bool full_refresh;
+
+		{
+			std::unique_lock lock(coordinator_mutex);
+			coordinator_wake.wait_for(lock, std::chrono::seconds(canister::config::get().scheduler_tick), []() {
+				return full_refresh_requested;
+			});
+
+			full_refresh = std::exchange(full_refresh_requested, false);
+		}
+
+		try {
+			full_refresh ? canister::scheduler::refresh_all() : canister::scheduler::tick();
+		} catch (std::exception &exc) {
+			canister::log::error("scheduler", exc.what());
+		}
+	}
+}
+
+void canister::scheduler::request_refresh() {
+	std::lock_guard lock(coordinator_mutex);
+	full_refresh_requested = true;
+	coordinator_wake.notify_one();
+}
+
+void canister::scheduler::refresh_all() {
+	auto report = [](const std::string &message) {
+		canister::http::broadcast("refresh", message);
+	};
+
+	try {
+		canister::log::info("http", "fetching repository manifest");
+		auto manifests = canister::scheduler::current_manifests(report);
+		if (!manifests.has_value()) {
+			report("fail:refresh");
+			return;
+		}
+
+		// A full refresh is as good as a scheduled one, so the scheduler learns from it too
+		canister::log::info("parser", "processing repository manifest");
+		canister::scheduler::record(canister::pipeline::refresh(manifests.value(), report));
+	} catch (curlpp::LogicError &exc) {
+		auto message = "failed to fetch manifest (logic): " + std::string(exc.what());
+		canister::log::error("http", message);
+	} catch (curlpp::RuntimeError &exc) {
+		auto message = "failed to fetch manifest (runtime): " + std::string(exc.what());
+		canister::log::error("http", message);
+	}
+}
+
+void canister::scheduler::tick() {
+	// Scheduled refreshes report to the same subscribers as the ones that were asked for
+	auto report = [](const std::string &message) {
+		canister::log::info("scheduler", message);
+		canister::http::broadcast("refresh", message);
+	};
+
+	auto manifests = canister::scheduler::current_manifests(report);
+	if (!manifests.has_value()) {
+		canister::log::error("scheduler", "failed to fetch repository manifest");
+		return;
+	}
+
+	auto due = canister::scheduler::due(manifests.value());
+	if (due.empty()) {
+		return;
+	}
+
+	canister::log::info("scheduler", "refreshing " + std::to_string(due.size()) + " of " + std::to_string(manifests.value().size()) + " repositories");
+	canister::scheduler::record(canister::pipeline::refresh(due, report));
+}
+
+std::optional<std::vector<canister::parser::repo_manifest>> canister::scheduler::current_manifests(std::function<void(const std::string &)> report) {
+	auto response = canister::http::manifest();
+	if (!response.has_value()) {
+		return std::nullopt;
+	}
+
+	if (!response.value().changed && applied_manifests_loaded) {
+		return applied_manifests;
+	}
+
+	// The first manifest after a start is compared with the database, the snapshot can be missing repositories
+	// A repository dropped from the manifest while core was down would otherwise never be pruned
+	std::map<std::string, canister::parser::repo_manifest> previous;
+	if (applied_manifests_loaded) {
+		for (auto &manifest : applied_manifests) {
+			previous.emplace(manifest.slug, manifest);
+		}
+	} else {
+		auto repositories = canister::db::repositories();
+		if (!repositories.has_value()) {
+			canister::log::error("scheduler", "failed to read the previous repositories, trying again next tick");
+			return std::nullopt;
+		}
+
+		for (auto &repository : repositories.value()) {
+			previous.emplace(repository.slug, canister::parser::repo_manifest {
+				.slug = repository.slug,
+				.ranking = repository.ranking,
+				.aliases = repository.aliases,
+				.uri = repository.uri,
+				.dist = repository.dist,
+				.suite = repository.suite,
+			});
+		}
+	}
+
+	auto manifests = canister::parser::read_manifest(response.value().data, report);
+
+	// A broken manifest would otherwise prune every repository we have
+	if (manifests.empty() && !previous.empty()) {
+		canister::log::error("scheduler", "manifest lists no repositories, keeping the previous one");
+		return std::nullopt;
+	}
+
+	canister::scheduler::apply(canister::scheduler::diff(previous, manifests));
+	applied_manifests = manifests;
+	applied_manifests_loaded = true;
+	return manifests;
+}
+
+canister::scheduler::manifest_diff canister::scheduler::diff(const std::map<std::string, canister::parser::repo_manifest> &previous, const std::vector<canister::parser::repo_manifest> &current) {
+	canister::scheduler::manifest_diff result;
+	std::unordered_set<std::string> seen;
+
+	for (auto &manifest : current) {
+		seen.insert(manifest.slug);
+
+		auto before = previous.find(manifest.slug);
+		if (before == previous.end()) {
+			result.added.push_back(manifest);
+			continue;
+		}
+
+		// Anything that changes where the files come from needs them downloaded again, rankings only need rewriting
+		auto &old = before->second;
+		if (old.uri != manifest.uri || old.dist != manifest.dist || old.suite != manifest.suite) {
+			result.moved.push_back(manifest);
+		} else if (old.ranking != manifest.ranking || old.aliases != manifest.aliases) {
+			result.reranked.push_back(manifest);
+		}
+	}
+
+	for (auto &[slug, manifest] : previous) {
+		if (!seen.contains(slug)) {
+			result.removed.push_back(manifest);
+		}
+	}
+
+	return result;
+}
+
+void canister::scheduler::apply(const canister::scheduler::manifest_diff &changes) {
+	if (changes.added.empty() && changes.removed.empty() && changes.moved.empty() && changes.reranked.empty()) {
+		return;
+	}
+
+	canister::log::info("scheduler", "manifest changed: " + std::to_string(changes.added.size()) + " added, " + std::to_string(changes.removed.size()) + " removed, " + std::to_string(changes.moved.size()) + " moved, " + std::to_string(changes.reranked.size()) + " reranked");
+
+	// Repositories without a schedule are due on this tick
+	for (auto &manifest : changes.added) {
+		forget_schedule(manifest.slug);
+	}
+
+	for (auto &manifest : changes.moved) {
+		forget_schedule(manifest.slug);
+		forget_cache(manifest);
+	}
+
+	// Rankings decide which repository owns a package, so owners are recomputed straight from the rows already written
+	if (!changes.reranked.empty()) {
+		std::vector<std::string> slugs;
+		for (auto &manifest : changes.reranked) {
+			canister::db::update_repository_ranking(manifest.slug, manifest.ranking, manifest.aliases);
+			canister::catalog::rerank_repository(manifest.slug, manifest.ranking, manifest.aliases);
+			slugs.push_back(manifest.slug);
+		}
+
+		canister::db::reconcile_owners(slugs, canister::catalog::package_price);
+	}
+
+	if (!changes.removed.empty()) {
+		std::vector<std::string> slugs;
+		std::unordered_set<std::string> touched;
+
+		for (auto &manifest : changes.removed) {
+			slugs.push_back(manifest.slug);
+			forget_schedule(manifest.slug);
+			forget_cache(manifest);
+
+			for (auto &id : canister::catalog::remove_repository(manifest.slug)) {
+				touched.insert(id);
+			}
+		}
+
+		// The catalog already picked new current versions, the database takes them over in the same pass as the prune
+		std::vector<canister::db::current_version> currents;
+		for (auto &id : touched) {
+			auto current = canister::catalog::current_vpackage(id);
+			currents.push_back({
+				.package = id,
+				.uuid = current.has_value() ? current.value().uuid : "",
+				.fingerprint = current.has_value() && current.value().fingerprint.has_value() ? canister::hash::to_hex(current.value().fingerprint.value()) : "",
+			});
+		}
+
+		auto orphaned = canister::db::prune_repositories(slugs, currents);
+		canister::pipeline::reload_fingerprints();
+
+		// Builds these only mirrored lost their row, so they're written again on this tick
+		for (auto &slug : orphaned) {
+			forget_schedule(slug);
+			forget_packages(slug);
+		}
+	}
+
+	if (changes.removed.empty() && changes.reranked.empty()) {
+		return;
+	}
+
+	try {
+		canister::snapshot::write();
+	} catch (std::exception &exc) {
+		canister::log::error("snapshot", exc.what());
+	}
+
+	canister::graph::rebuild();
+	canister::responses::invalidate();
+	canister::responses::warm();
+}
+
+std::vector<canister::parser::repo_manifest> canister::scheduler::due(const std::vector<canister::parser::repo_manifest> &manifests) {
+	std::lock_guard lock(schedules_mutex);
+	std::vector<canister::parser::repo_manifest> due;
+	auto now = std::chrono::steady_clock::now();
+
+	// Repositories we've never seen are always due
+	for (auto &manifest : manifests) {
+		auto schedule = schedules.find(manifest.slug);
+		if (schedule == schedules.end() || schedule->second.next_refresh <= now) {
+			due.push_back(manifest);
+		}
+	}
+
+	return due;
+}
+
+void canister::scheduler::record(const canister::pipeline::summary &summary) {
+	std::lock_guard lock(schedules_mutex);
+	auto now = std::chrono::steady_clock::now();
+
+	const auto minimum = std::chrono::seconds(SCHEDULER_MIN_INTERVAL);
+	const auto maximum = std::chrono::seconds(SCHEDULER_MAX_INTERVAL);
+
+	for (auto &[slug, outcome] : summary.outcomes) {
+		auto [schedule, inserted] = schedules.try_emplace(slug, canister::scheduler::repository_schedule {
+			.interval = std::chrono::seconds(SCHEDULER_INITIAL_INTERVAL),
+			.next_refresh = now,
+		});
+
+		// A repository whose Release or Packages changed is polled twice as often
+		// Unchanged and failing repositories back off until they're only polled at the maximum interval
+		auto &interval = schedule->second.interval;
+		if (outcome == canister::pipeline::outcome::updated) {
+			interval = std::max(minimum, interval / 2);
+		} else {
+			interval = std::min(maximum, interval * 2);
+		}
+
+		schedule->second.next_refresh = now + interval;
+	}
+}
@@ -0,0 +1,301 @@
+#include <canister.h>
+
+// Postings map a token to the documents (packages) containing it and which fields it appeared in
+// Tokens are kept in an ordered map so that every completion of a prefix is one contiguous range
+std::shared_mutex search_mutex;
+std::vector<canister::search::document> search_documents;
+std::unordered_map<std::string, std::uint32_t> search_document_ids;
+std::vector<std::uint32_t> search_free_documents;
+std::map<std::string, std::unordered_map<std::uint32_t, std::uint8_t>> search_postings;
+std::unordered_map<std::uint32_t, std::unordered_set<const std::string *>> search_trigrams;
+
+namespace {
+	enum field : std::uint8_t {
+		id_field = 1,
+		name_field = 2,
+		author_field = 4,
+		description_field = 8
+	};
+
+	// Descriptions can be essays, only the start of one is worth indexing
+	const std::size_t description_token_limit = 64;
+	const std::size_t prefix_expansion_limit = 256;
+	const double fuzzy_threshold = 0.35;
+
+	std::vector<std::string> tokenize(std::string_view text, std::size_t limit = SIZE_MAX) {
+		std::vector<std::string> tokens;
+		std::string token;
+
+		for (auto character : text) {
+			auto byte = static_cast<unsigned char>(character);
+
+			// Anything outside of ASCII is kept as is so non-English names are still searchable
+			if (std::isalnum(byte) || byte >= 0x80) {
+				token.push_back(static_cast<char>(std::tolower(byte)));
+				continue;
+			}
+
+			if (!token.empty()) {
+				tokens.push_back(std::move(token));
+				token.clear();
+
+				if (tokens.size() >= limit) {
+					return tokens;
+				}
+			}
+		}
+
+		if (!token.empty()) {
+			tokens.push_back(std::move(token));
+		}
+
+		return tokens;
+	}
+
+	// Tokens are padded so that their first and last characters get trigrams of their own
+	std::vector<std::uint32_t> trigrams(const std::string &token) {
+		std::vector<std::uint32_t> result;
+		auto padded = "$" + token + "$";
+
+		for (size_t index = 0; index + 3 <= padded.size(); index++) {
+			auto code = (std::uint32_t(static_cast<unsigned char>(padded[index])) << 16) | (std::uint32_t(static_cast<unsigned char>(padded[index + 1])) << 8) | std::uint32_t(static_cast<unsigned char>(padded[index + 2]));
+			result.push_back(code);
+		}
+
+		std::sort(result.begin(), result.end());
+		result.erase(std::unique(result.begin(), result.end()), result.end());
+		return result;
+	}
+
+	double field_weight(std::uint8_t fields) {
+		if (fields & (id_field | name_field)) {
+			return 2.0;
+		}
+
+		if (fields & author_field) {
+			return 1.0;
+		}
+
+		return 0.5;
+	}
+
+	// Must be called with the exclusive lock held
+	void remove_postings(std::uint32_t document) {
+		for (auto &token : search_documents[document].tokens) {
+			auto postings = search_postings.find(token);
+			if (postings == search_postings.end()) {
+				continue;
+			}
+
+			postings->second.erase(document);
+			if (!postings->second.empty()) {
+				continue;
+			}
+
+			// Tokens nobody uses anymore also have to leave the trigram index which points at them
+			for (auto trigram : trigrams(postings->first)) {
+				auto tokens = search_trigrams.find(trigram);
+				if (tokens != search_trigrams.end()) {
+					tokens->second.erase(&postings->first);
+					if (tokens->second.empty()) {
+						search_trigrams.erase(tokens);
+					}
+				}
+			}
+
+			search_postings.erase(postings);
+		}
+
+		search_documents[document].tokens.clear();
+	}
+
+	struct match {
+		int tier;
+		double score;
+	};
+
+	// Tier 3 is an exact token, 2 is a completed prefix and 1 is a fuzzy match
+	void collect(std::unordered_map<std::uint32_t, match> &hits, const std::unordered_map<std::uint32_t, std::uint8_t> &postings, int tier, double similarity) {
+		for (auto &[document, fields] : postings) {
+			auto score = similarity * field_weight(fields);
+			auto &hit = hits[document];
+
+			if (tier > hit.tier || (tier == hit.tier && score > hit.score)) {
+				hit = { tier, score };
+			}
+		}
+	}
+}
+
+void canister::search::update_document(const canister::catalog::package &package) {
+	std::unique_lock lock(search_mutex);
+
+	std::uint32_t document;
+	auto existing = search_document_ids.find(package.id);
+
+	if (existing != search_document_ids.end()) {
+		document = existing->second;
+		remove_postings(document);
+	} else if (!search_free_documents.empty()) {
+		document = search_free_documents.back();
+		search_free_documents.pop_back();
+		search_document_ids.emplace(package.id, document);
+	} else {
+		document = static_cast<std::uint32_t>(search_documents.size());
+		search_documents.emplace_back();
+		search_document_ids.emplace(package.id, document);
+	}
+
+	auto &entry = search_documents[document];
+	entry.id = package.id;
+	entry.ranking = package.ranking;
+
+	std::map<std::string, std::uint8_t> fields;
+	for (auto &token : tokenize(package.id)) {
+		fields[token] |= id_field;
+	}
+
+	if (package.current) {
+		for (auto &token : tokenize(package.current->name)) {
+			fields[token] |= name_field;
+		}
+
+		for (auto &token : tokenize(package.current->author)) {
+			fields[token] |= author_field;
+		}
+
+		for (auto &token : tokenize(package.current->description, description_token_limit)) {
+			fields[token] |= description_field;
+		}
+	}
+
+	for (auto &[token, mask] : fields) {
+		auto [postings, inserted] = search_postings.try_emplace(token);
+		postings->second[document] = mask;
+
+		if (inserted) {
+			for (auto trigram : trigrams(token)) {
+				search_trigrams[trigram].insert(&postings->first);
+			}
+		}
+
+		entry.tokens.push_back(token);
+	}
+}
+
+void canister::search::remove_document(const std::string &id) {
+	std::unique_lock lock(search_mutex);
+
+	auto existing = search_document_ids.find(id);
+	if (existing == search_document_ids.end()) {
+		return;
+	}
+
+	remove_postings(existing->second);
+	search_documents[existing->second] = {};
+	search_free_documents.push_back(existing->second);
+	search_document_ids.erase(existing);
+}
+
+std::vector<std::string> canister::search::query(std::string_view text, std::size_t limit) {
+	auto query_tokens = tokenize(text);
+	if (query_tokens.empty()) {
+		return {};
+	}
+
+	std::shared_lock lock(search_mutex);
+	std::unordered_map<std::uint32_t, match> candidates;
+
+	for (size_t position = 0; position < query_tokens.size(); position++) {
+		auto &token = query_tokens[position];
+		std::unordered_map<std::uint32_t, match> hits;
+
+		auto exact = search_postings.find(token);
+		if (exact != search_postings.end()) {
+			collect(hits, exact->second, 3, 1.0);
+		}
+
+		// Completions are scored by how much of the completed token was actually typed
+		size_t expansions = 0;
+		for (auto completion = search_postings.upper_bound(token); completion != search_postings.end() && expansions < prefix_expansion_limit; completion++, expansions++) {
+			if (!completion->first.starts_with(token)) {
+				break;
+			}
+
+			collect(hits, completion->second, 2, double(token.size()) / double(completion->first.size()));
+		}
+
+		// Typos are only worth looking for when the precise matches came up short
+		if (hits.size() < limit && token.size() >= 3) {
+			auto query_trigrams = trigrams(token);
+			std::unordered_map<const std::string *, std::size_t> shared;
+
+			for (auto trigram : query_trigrams) {
+				auto tokens = search_trigrams.find(trigram);
+				if (tokens == search_trigrams.end()) {
+					continue;
+				}
+
+				for (auto candidate : tokens->second) {
+					shared[candidate]++;
+				}
+			}
+
+			for (auto &[candidate, count] : shared) {
+				auto total = query_trigrams.size() + trigrams(*candidate).size() - count;
+				auto similarity = double(count) / double(total);
+
+				if (similarity >= fuzzy_threshold) {
+					collect(hits, search_postings.at(*candidate), 1, similarity);
+				}
+			}
+		}
+
+		// Every query token has to match, a document is only as good as its weakest token
+		if (position == 0) {
+			candidates = std::move(hits);
+			continue;
+		}
+
+		for (auto candidate = candidates.begin(); candidate != candidates.end();) {
+			auto hit = hits.find(candidate->first);
+			if (hit == hits.end()) {
+				candidate = candidates.erase(candidate);
+				continue;
+			}
+
+			candidate->second.tier = std::min(candidate->second.tier, hit->second.tier);
+			candidate->second.score += hit->second.score;
+			candidate++;
+		}
+	}
+
+	std::vector<std::pair<std::uint32_t, match>> ranked(candidates.begin(), candidates.end());
+
+	// Match quality comes first, within it packages from better ranked repositories win
+	std::sort(ranked.begin(), ranked.end(), [](auto &left, auto &right) {
+		auto &left_document = search_documents[left.first];
+		auto &right_document = search_documents[right.first];
+
+		if (left.second.tier != right.second.tier) {
+			return left.second.tier > right.second.tier;
+		}
+
+		if (left_document.ranking != right_document.ranking) {
+			return left_document.ranking < right_document.ranking;
+		}
+
+		if (left.second.score != right.second.score) {
+			return left.second.score > right.second.score;
+		}
+
+		return left_document.id < right_document.id;
+	});
+
+	std::vector<std::string> results;
+	for (size_t index = 0; index < ranked.size() && index < limit; index++) {
+		results.push_back(search_documents[ranked[index].first].id);
+	}
+
+	return results;
+}
@@ -0,0 +1,349 @@
+#include <canister.h>
+
+namespace {
+	const char snapshot_magic[8] = { 'C', 'N', 'S', 'T', 'R', 'S', 'N', 'P' };
+
+	// Identical strings (architectures, sections, authors) are only stored once
+	class string_table {
+	public:
+		canister::snapshot::string_ref add(const std::string &value) {
+			auto existing = offsets.find(value);
+			if (existing != offsets.end()) {
+				return existing->second;
+			}
+
+			if (data.size() + value.size() > UINT32_MAX) {
+				throw std::runtime_error("snapshot string table is too large");
+			}
+
+			canister::snapshot::string_ref reference {
+				.offset = static_cast<std::uint32_t>(data.size()),
+				.length = static_cast<std::uint32_t>(value.size()),
+			};
+
+			data.append(value);
+			offsets.emplace(value, reference);
+			return reference;
+		}
+
+		std::string data;
+
+	private:
+		std::unordered_map<std::string, canister::snapshot::string_ref> offsets;
+	};
+
+	template <typename T>
+	void append(std::string &buffer, const T &value) {
+		buffer.append(reinterpret_cast<const char *>(&value), sizeof(T));
+	}
+
+	// Records are copied out instead of cast in place so a corrupt snapshot can't cause a misaligned read
+	template <typename T>
+	T read(std::string_view file, std::uint64_t offset) {
+		if (offset > file.size() || file.size() - offset < sizeof(T)) {
+			throw std::runtime_error("snapshot record out of bounds");
+		}
+
+		T value;
+		std::memcpy(&value, file.data() + offset, sizeof(T));
+		return value;
+	}
+
+	void write_all(int descriptor, std::string_view data) {
+		while (!data.empty()) {
+			auto written = ::write(descriptor, data.data(), data.size());
+			if (written < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+
+				throw std::runtime_error("failed to write snapshot: " + std::string(std::strerror(errno)));
+			}
+
+			data.remove_prefix(static_cast<std::size_t>(written));
+		}
+	}
+}
+
+std::string canister::snapshot::path() {
+	return canister::util::cache_path() + "catalog.snapshot";
+}
+
+void canister::snapshot::write() {
+	auto repositories = canister::catalog::repositories();
+
+	string_table strings;
+	std::vector<canister::snapshot::repository_record> repository_records;
+	std::vector<canister::snapshot::string_ref> lists;
+	std::vector<canister::snapshot::package_record> package_records;
+
+	for (auto &repository : repositories) {
+		canister::snapshot::repository_record record {};
+		record.packages_size = repository->packages_size;
+		record.packages_modified = repository->packages_modified;
+		record.slug = strings.add(repository->slug);
+		record.uri = strings.add(repository->uri);
+		record.dist = strings.add(repository->dist);
+		record.suite = strings.add(repository->suite);
+		record.name = strings.add(repository->name);
+		record.version = strings.add(repository->version);
+		record.description = strings.add(repository->description);
+		record.date = strings.add(repository->date);
+		record.payment_gateway = strings.add(repository->payment_gateway);
+		record.sileo_endpoint = strings.add(repository->sileo_endpoint);
+		record.ranking = repository->ranking;
+
+		record.aliases_first = static_cast<std::uint32_t>(lists.size());
+		record.aliases_count = static_cast<std::uint32_t>(repository->aliases.size());
+		for (auto &alias : repository->aliases) {
+			lists.push_back(strings.add(alias));
+		}
+
+		record.sections_first = static_cast<std::uint32_t>(lists.size());
+		record.sections_count = static_cast<std::uint32_t>(repository->sections.size());
+		for (auto &section : repository->sections) {
+			lists.push_back(strings.add(section));
+		}
+
+		record.packages_first = package_records.size();
+		record.packages_count = repository->packages.size();
+		for (auto &vpackage : repository->packages) {
+			package_records.push_back({
+				.uuid = strings.add(vpackage.uuid),
+				.package = strings.add(vpackage.package),
+				.repo = strings.add(vpackage.repo),
+				.price = strings.add(vpackage.price),
+				.version = strings.add(vpackage.version),
+				.architecture = strings.add(vpackage.architecture),
+				.filename = strings.add(vpackage.filename),
+				.sha_256 = strings.add(vpackage.sha_256),
+				.name = strings.add(vpackage.name),
+				.description = strings.add(vpackage.description),
+				.author = strings.add(vpackage.author),
+				.maintainer = strings.add(vpackage.maintainer),
+				.depiction = strings.add(vpackage.depiction),
+				.native_depiction = strings.add(vpackage.native_depiction),
+				.header = strings.add(vpackage.header),
+				.icon = strings.add(vpackage.icon),
+				.section = strings.add(vpackage.section),
+				.tag = strings.add(vpackage.tag),
+				.installed_size = strings.add(vpackage.installed_size),
+				.size = strings.add(vpackage.size),
+				.depends = strings.add(vpackage.depends),
+				.pre_depends = strings.add(vpackage.pre_depends),
+				.conflicts = strings.add(vpackage.conflicts),
+				.provides = strings.add(vpackage.provides),
+				.replaces = strings.add(vpackage.replaces),
+				.fingerprint = vpackage.fingerprint.value_or(canister::hash::digest {}),
+				.has_fingerprint = vpackage.fingerprint.has_value(),
+			});
+		}
+
+		repository_records.push_back(record);
+	}
+
+	canister::snapshot::header header {};
+	std::memcpy(header.magic, snapshot_magic, sizeof(snapshot_magic));
+	header.version = SNAPSHOT_VERSION;
+	header.repository_count = static_cast<std::uint32_t>(repository_records.size());
+	header.repositories_offset = sizeof(canister::snapshot::header);
+	header.lists_offset = header.repositories_offset + repository_records.size() * sizeof(canister::snapshot::repository_record);
+	header.list_count = lists.size();
+	header.packages_offset = header.lists_offset + lists.size() * sizeof(canister::snapshot::string_ref);
+	header.package_count = package_records.size();
+	header.strings_offset = header.packages_offset + package_records.size() * sizeof(canister::snapshot::package_record);
+	header.strings_size = strings.data.size();
+
+	std::string buffer;
+	buffer.reserve(header.strings_offset + header.strings_size);
+	append(buffer, header);
+
+	for (auto &record : repository_records) {
+		append(buffer, record);
+	}
+
+	for (auto &reference : lists) {
+		append(buffer, reference);
+	}
+
+	for (auto &record : package_records) {
+		append(buffer, record);
+	}
+
+	buffer.append(strings.data);
+
+	// Readers only ever see the old snapshot or the complete new one since the rename is atomic
+	auto destination = canister::snapshot::path();
+	auto temporary = destination + ".tmp";
+
+	int descriptor = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (descriptor < 0) {
+		throw std::runtime_error("failed to open snapshot: " + std::string(std::strerror(errno)));
+	}
+
+	try {
+		write_all(descriptor, buffer);
+		if (fsync(descriptor) != 0) {
+			throw std::runtime_error("failed to sync snapshot: " + std::string(std::strerror(errno)));
+		}
+	} catch (...) {
+		close(descriptor);
+		std::filesystem::remove(temporary);
+		throw;
+	}
+
+	close(descriptor);
+	std::filesystem::rename(temporary, destination);
+
+	// The rename itself only survives a crash once the directory entry is on disk too
+	int directory = open(canister::util::cache_path().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (directory < 0) {
+		throw std::runtime_error("failed to open cache directory: " + std::string(std::strerror(errno)));
+	}
+
+	int synced = fsync(directory);
+	int error = errno;
+	close(directory);
+	if (synced != 0) {
+		throw std::runtime_error("failed to sync cache directory: " + std::string(std::strerror(error)));
+	}
+
+	canister::log::info("snapshot", "wrote " + std::to_string(repository_records.size()) + " repositories and " + std::to_string(package_records.size()) + " packages");
+}
+
+void canister::snapshot::load() {
+	canister::util::mapped_file file(canister::snapshot::path());
+	if (!file.good()) {
+		canister::log::info("snapshot", "no snapshot found, starting cold");
+		return;
+	}
+
+	auto data = file.view();
+	std::size_t loaded = 0;
+
+	try {
+		auto header = read<canister::snapshot::header>(data, 0);
+		if (std::memcmp(header.magic, snapshot_magic, sizeof(snapshot_magic)) != 0) {
+			canister::log::error("snapshot", "not a snapshot file, ignoring it");
+			return;
+		}
+
+		if (header.version != SNAPSHOT_VERSION) {
+			canister::log::info("snapshot", "snapshot version " + std::to_string(header.version) + " is outdated, ignoring it");
+			return;
+		}
+
+		if (header.strings_offset > data.size() || data.size() - header.strings_offset < header.strings_size) {
+			throw std::runtime_error("string table out of bounds");
+		}
+
+		auto strings = data.substr(header.strings_offset, header.strings_size);
+		auto text = [&strings](const canister::snapshot::string_ref &reference) {
+			if (reference.offset > strings.size() || strings.size() - reference.offset < reference.length) {
+				throw std::runtime_error("string out of bounds");
+			}
+
+			return std::string(strings.substr(reference.offset, reference.length));
+		};
+
+		auto list = [&](std::uint32_t first, std::uint32_t count) {
+			if (std::uint64_t(first) + count > header.list_count) {
+				throw std::runtime_error("list out of bounds");
+			}
+
+			std::vector<std::string> values;
+			for (std::uint32_t index = first; index < first + count; index++) {
+				values.push_back(text(read<canister::snapshot::string_ref>(data, header.lists_offset + index * sizeof(canister::snapshot::string_ref))));
+			}
+
+			return values;
+		};
+
+		for (std::uint32_t index = 0; index < header.repository_count; index++) {
+			auto record = read<canister::snapshot::repository_record>(data, header.repositories_offset + index * sizeof(canister::snapshot::repository_record));
+			auto slug = text(record.slug);
+
+			// The snapshot is only trusted while the cached Packages file is still the one it was built from
+			// Downloads always replace the file, so size and mtime are enough without reading it back in
+			// Anything else is left for the next refresh to parse again
+			struct stat info;
+			auto packages_path = canister::util::cache_path() + slug + ".Packages";
+			if (stat(packages_path.c_str(), &info) != 0
+				|| std::uint64_t(info.st_size) != record.packages_size
+				|| std::int64_t(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec != record.packages_modified) {
+				canister::log::info("snapshot", slug + " - cache changed since the snapshot, skipping");
+				continue;
+			}
+
+			if (record.packages_first > header.package_count || header.package_count - record.packages_first < record.packages_count) {
+				throw std::runtime_error("packages out of bounds");
+			}
+
+			auto repository = std::make_shared<canister::catalog::repository>();
+			repository->slug = slug;
+			repository->aliases = list(record.aliases_first, record.aliases_count);
+			repository->ranking = static_cast<std::int8_t>(record.ranking);
+			repository->sections = list(record.sections_first, record.sections_count);
+			repository->uri = text(record.uri);
+			repository->dist = text(record.dist);
+			repository->suite = text(record.suite);
+			repository->name = text(record.name);
+			repository->version = text(record.version);
+			repository->description = text(record.description);
+			repository->date = text(record.date);
+			repository->payment_gateway = text(record.payment_gateway);
+			repository->sileo_endpoint = text(record.sileo_endpoint);
+			repository->packages_size = record.packages_size;
+			repository->packages_modified = record.packages_modified;
+			repository->packages.reserve(record.packages_count);
+
+			for (auto package_index = record.packages_first; package_index < record.packages_first + record.packages_count; package_index++) {
+				auto package = read<canister::snapshot::package_record>(data, header.packages_offset + package_index * sizeof(canister::snapshot::package_record));
+				auto id = text(package.package);
+				repository->package_indexes[id].push_back(repository->packages.size());
+
+				// Fingerprints are stored alongside the strings so loading never has to hash anything again
+				std::optional<canister::hash::digest> fingerprint;
+				if (package.has_fingerprint) {
+					fingerprint = package.fingerprint;
+				}
+
+				repository->packages.push_back({
+					.uuid = text(package.uuid),
+					.package = std::move(id),
+					.repo = text(package.repo),
+					.price = text(package.price),
+					.version = text(package.version),
+					.architecture = text(package.architecture),
+					.filename = text(package.filename),
+					.sha_256 = text(package.sha_256),
+					.name = text(package.name),
+					.description = text(package.description),
+					.author = text(package.author),
+					.maintainer = text(package.maintainer),
+					.depiction = text(package.depiction),
+					.native_depiction = text(package.native_depiction),
+					.header = text(package.header),
+					.icon = text(package.icon),
+					.section = text(package.section),
+					.tag = text(package.tag),
+					.installed_size = text(package.installed_size),
+					.size = text(package.size),
+					.depends = text(package.depends),
+					.pre_depends = text(package.pre_depends),
+					.conflicts = text(package.conflicts),
+					.provides = text(package.provides),
+					.replaces = text(package.replaces),
+					.fingerprint = fingerprint,
+				});
+			}
+
+			canister::catalog::update_repository(repository);
+			loaded++;
+		}
+	} catch (std::exception &exc) {
+		canister::log::error("snapshot", "corrupt snapshot, stopped loading: " + std::string(exc.what()));
+	}
+
+	canister::log::info("snapshot", "loaded " + std::to_string(loaded) + " repositories");
+}
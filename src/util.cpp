@@ -1,16 +1,40 @@
 #include <canister.h>
 
+// Threads currently leased by parallel decompression and parsing, callers included
+std::mutex lease_mutex;
+std::size_t leased_workers = 0;
+
+canister::util::worker_lease::worker_lease(std::size_t wanted) {
+	const auto configured = canister::config::get().cpu_workers;
+	const std::size_t budget = configured > 0 ? configured : std::max(1u, std::thread::hardware_concurrency());
+
+	std::lock_guard lock(lease_mutex);
+	auto available = budget > leased_workers ? budget - leased_workers : 0;
+	leased = std::max<std::size_t>(1, std::min(wanted, available));
+	leased_workers += leased;
+}
+
+canister::util::worker_lease::~worker_lease() {
+	std::lock_guard lock(lease_mutex);
+	leased_workers -= leased;
+}
+
+std::size_t canister::util::worker_lease::count() const {
+	return leased;
+}
+
 std::string canister::util::timestamp() {
 	const auto now = std::chrono::system_clock::now();
 	return std::to_string(now.time_since_epoch().count());
 }
 
 std::string canister::util::cache_path() {
-	return std::filesystem::temp_directory_path().string() + "/canister/";
+	return canister::config::get().cache_path;
 }
 
-std::vector<std::string> canister::util::release_keys() {
-	return {
+const std::vector<std::string> &canister::util::release_keys() {
+	// These are looked up for every line we parse, so they're only built once
+	static const std::vector<std::string> keys = {
 		"Architecture",
 		"Codename",
 		"Components",
@@ -22,10 +46,12 @@ std::vector<std::string> canister::util::release_keys() {
 		"Version",
 		"Payment-Gateway"
 	};
+
+	return keys;
 }
 
-std::vector<std::string> canister::util::packages_keys() {
-	return {
+const std::vector<std::string> &canister::util::packages_keys() {
+	static const std::vector<std::string> keys = {
 		"Package",
 		"Architecture",
 		"Section",
@@ -43,8 +69,34 @@ std::vector<std::string> canister::util::packages_keys() {
 		"SHA256",
 		"Installed-Size",
 		"Size",
-		"Version"
+		"Version",
+		"Depends",
+		"Pre-Depends",
+		"Conflicts",
+		"Provides",
+		"Replaces"
 	};
+
+	return keys;
+}
+
+const std::vector<std::string> &canister::util::control_keys() {
+	// Everything a Packages stanza has plus what usually only makes it into the control file
+	static const std::vector<std::string> keys = [] {
+		auto keys = canister::util::packages_keys();
+		keys.insert(keys.end(), {
+			"Recommends",
+			"Suggests",
+			"Breaks",
+			"Essential",
+			"Priority",
+			"Homepage"
+		});
+
+		return keys;
+	}();
+
+	return keys;
 }
 
 std::string canister::util::safe_fs_name(const std::string token) {
@@ -60,14 +112,83 @@ std::string canister::util::safe_fs_name(const std::string token) {
 	return value;
 }
 
-bool canister::util::matched_hash(const std::string left, const std::string right) {
-	std::vector<unsigned char> left_vector(picosha2::k_digest_size);
-	picosha2::hash256(left.begin(), left.end(), left_vector.begin(), left_vector.end());
-	std::string left_hash = picosha2::bytes_to_hex_string(left_vector.begin(), left_vector.end());
+bool canister::util::matched_hash(std::string_view left, std::string_view right) {
+	// Different lengths can never have the same hash so there's no reason to hash them
+	if (left.size() != right.size()) {
+		return false;
+	}
+
+	return canister::hash::digest_of(left) == canister::hash::digest_of(right);
+}
+
+canister::util::mapped_file::mapped_file(const std::string &path) {
+	int descriptor = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (descriptor < 0) {
+		return;
+	}
 
-	std::vector<unsigned char> right_vector(picosha2::k_digest_size);
-	picosha2::hash256(right.begin(), right.end(), right_vector.begin(), right_vector.end());
-	std::string right_hash = picosha2::bytes_to_hex_string(right_vector.begin(), right_vector.end());
+	struct stat info;
+	if (fstat(descriptor, &info) != 0) {
+		close(descriptor);
+		return;
+	}
+
+	// Empty files can't be mapped but they're still valid files
+	size = static_cast<std::size_t>(info.st_size);
+	modified_at = std::int64_t(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+	if (size > 0) {
+		data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+		if (data == MAP_FAILED) {
+			data = nullptr;
+			size = 0;
+			close(descriptor);
+			return;
+		}
+
+		// Everything we map is parsed or hashed front to back so aggressive read-ahead is ideal
+		madvise(data, size, MADV_SEQUENTIAL);
+	}
+
+	close(descriptor);
+	opened = true;
+}
+
+canister::util::mapped_file::mapped_file(mapped_file &&other) noexcept
+	: data(std::exchange(other.data, nullptr))
+	, size(std::exchange(other.size, 0))
+	, modified_at(std::exchange(other.modified_at, 0))
+	, opened(std::exchange(other.opened, false)) {
+}
+
+canister::util::mapped_file &canister::util::mapped_file::operator=(mapped_file &&other) noexcept {
+	if (this != &other) {
+		if (data) {
+			munmap(data, size);
+		}
+
+		data = std::exchange(other.data, nullptr);
+		size = std::exchange(other.size, 0);
+		modified_at = std::exchange(other.modified_at, 0);
+		opened = std::exchange(other.opened, false);
+	}
+
+	return *this;
+}
+
+canister::util::mapped_file::~mapped_file() {
+	if (data) {
+		munmap(data, size);
+	}
+}
+
+bool canister::util::mapped_file::good() const {
+	return opened;
+}
+
+std::string_view canister::util::mapped_file::view() const {
+	return std::string_view(static_cast<const char *>(data), size);
+}
 
-	return left_hash == right_hash;
+std::int64_t canister::util::mapped_file::modified() const {
+	return modified_at;
 }
@@ -0,0 +1,63 @@
+#include "../fuzz/reference.h"
+
+// Known answers for dpkg::compare, runs as `meson test dpkg`
+// Callers used to test the result against 1, the original only returned 1 for some greater versions, so those are checked too
+
+namespace {
+	struct ordering {
+		std::string left;
+		std::string right;
+		int expected;
+	};
+
+	std::size_t checked = 0;
+	std::size_t failures = 0;
+
+	void check(const std::string &label, int actual, int expected) {
+		checked++;
+		if (actual != expected) {
+			failures++;
+			std::cerr << label << "\n  expected: " << expected << "\n  actual:   " << actual << std::endl;
+		}
+	}
+}
+
+int main() {
+	const std::vector<ordering> orderings = {
+		{ "1.0", "1.0", 0 },
+		{ "1.0-1", "1.0-2", -1 },
+		{ "1.0~beta1", "1.0", -1 },
+		{ "1:0.9", "2.0", 1 },
+		{ "1.0.007", "1.0.7", 0 },
+		{ "1.10", "1.9", 1 },
+		{ "2.0", "10.0", -1 },
+	};
+
+	// The original returned 7, 2 and 6 for these and -1 for the wrapped epoch, so a `== 1` check missed every upgrade
+	const std::vector<ordering> missed = {
+		{ "1.9", "1.2", 1 },
+		{ "1.0c", "1.0a", 1 },
+		{ "1.0-9", "1.0-3", 1 },
+		{ "128:1.0", "1:1.0", 1 },
+	};
+
+	for (auto &entry : orderings) {
+		auto label = "compare(\"" + entry.left + "\", \"" + entry.right + "\")";
+		check(label, canister::dpkg::compare(entry.left, entry.right), entry.expected);
+		check(label + " swapped", canister::dpkg::compare(entry.right, entry.left), -entry.expected);
+	}
+
+	for (auto &entry : missed) {
+		auto label = "compare(\"" + entry.left + "\", \"" + entry.right + "\")";
+		check(label, canister::dpkg::compare(entry.left, entry.right), entry.expected);
+		check(label + " swapped", canister::dpkg::compare(entry.right, entry.left), -entry.expected);
+
+		if (reference::compare(entry.left, entry.right) == 1) {
+			failures++;
+			std::cerr << label << " is no longer a pair the original got wrong, pick another" << std::endl;
+		}
+	}
+
+	std::cout << "dpkg: " << checked << " comparisons checked, " << failures << " failures" << std::endl;
+	return failures == 0 ? 0 : 1;
+}
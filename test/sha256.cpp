@@ -0,0 +1,89 @@
+#include <canister.h>
+
+// Known answer test for both SHA-256 engines, runs as `meson test sha256`
+// Every vector is hashed in one go and again split across update() calls around the 64 byte block and 56 byte padding edges
+
+namespace {
+	struct vector {
+		std::string name;
+		std::string input;
+		std::string expected;
+	};
+
+	std::size_t checked = 0;
+	std::size_t failures = 0;
+
+	void check(const std::string &label, const canister::hash::digest &digest, const std::string &expected) {
+		checked++;
+
+		auto actual = canister::hash::to_hex(digest);
+		if (actual != expected) {
+			failures++;
+			std::cerr << label << "\n  expected: " << expected << "\n  actual:   " << actual << std::endl;
+		}
+	}
+
+	canister::hash::digest whole(canister::hash::engine engine, std::string_view input) {
+		canister::hash::sha256 hasher(engine);
+		hasher.update(input);
+		return hasher.finish();
+	}
+
+	canister::hash::digest chunked(canister::hash::engine engine, std::string_view input, std::size_t chunk) {
+		canister::hash::sha256 hasher(engine);
+		for (std::size_t offset = 0; offset < input.size(); offset += chunk) {
+			hasher.update(input.substr(offset, chunk));
+		}
+
+		return hasher.finish();
+	}
+
+	canister::hash::digest split(canister::hash::engine engine, std::string_view input, std::size_t at) {
+		canister::hash::sha256 hasher(engine);
+		hasher.update(input.substr(0, std::min(at, input.size())));
+		hasher.update(input.substr(std::min(at, input.size())));
+		return hasher.finish();
+	}
+}
+
+int main() {
+	// FIPS 180-2 appendix B and the NIST example values
+	const std::vector<vector> vectors = {
+		{ "empty", "", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+		{ "abc", "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+		{ "448 bit", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+		{ "896 bit", "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu", "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1" },
+		{ "million a", std::string(1000000, 'a'), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+	};
+
+	const std::vector<std::size_t> edges = { 1, 55, 56, 63, 64, 65 };
+	const std::vector<std::pair<canister::hash::engine, std::string>> engines = {
+		{ canister::hash::engine::portable, "portable" },
+		{ canister::hash::engine::sha_ni, "sha-ni" },
+	};
+
+	for (auto &[engine, engine_name] : engines) {
+		if (!canister::hash::supported(engine)) {
+			std::cout << "sha256: " << engine_name << " isn't supported on this CPU, skipped" << std::endl;
+			continue;
+		}
+
+		for (auto &entry : vectors) {
+			auto label = engine_name + " " + entry.name;
+			check(label, whole(engine, entry.input), entry.expected);
+
+			for (auto edge : edges) {
+				check(label + " in chunks of " + std::to_string(edge), chunked(engine, entry.input, edge), entry.expected);
+				check(label + " split at " + std::to_string(edge), split(engine, entry.input, edge), entry.expected);
+			}
+		}
+	}
+
+	// Whatever engine was picked at startup has to agree too
+	for (auto &entry : vectors) {
+		check("default " + entry.name, canister::hash::digest_of(entry.input), entry.expected);
+	}
+
+	std::cout << "sha256: " << checked << " digests checked, " << failures << " failures" << std::endl;
+	return failures == 0 ? 0 : 1;
+}